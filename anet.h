@@ -21,19 +21,55 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include "elist.h"
 
 enum {
 	ATCP_MAX_WR_IOV		= 32,		/* max iov per writev(2) */
+	ATCP_WR_RING		= 256,		/* write descriptors per socket */
+	ATCP_WR_INLINE		= 48,		/* inline buffer, see atcp_wbuf_get */
 };
 
 typedef void (*atcp_ev_func)(int, short, void *);
 
+struct atcp_wr_state;
+
+typedef bool (*atcp_write_func)(struct atcp_wr_state *, void *, bool);
+
+struct atcp_write {
+	uint8_t			inl[ATCP_WR_INLINE]; /* small buffer, e.g. BHS */
+
+	const void		*buf;		/* write buffer pointer */
+	int			togo;		/* write buffer remainder */
+	void			*copy;		/* private copy, see remap */
+	int			fd;		/* if >= 0, send from this file */
+	off_t			off;		/* ... at this offset */
+	bool			in_ring;	/* descriptor from wst->ring */
+	bool			wbuf;		/* inl[] handed out to caller */
+	bool			zc;		/* pages held by zero-copy send */
+	uint32_t		zc_seq;		/* ... with this id */
+
+	int			length;		/* length for accounting */
+	atcp_write_func		cb;		/* callback */
+	void			*cb_data;	/* data passed to cb */
+
+	struct atcp_wr_state	*wst;		/* our parent */
+
+	struct list_head	node;		/* write_[compl_]q list node */
+};
+
 struct atcp_wr_ops {
 	int			(*ev_wset)(void *, int, atcp_ev_func, void *);
 	int			(*ev_add)(void *, const struct timeval *);
 	int			(*ev_del)(void *);
+
+	/* optional: start an asynchronous send of the iovec, finished
+	 * later by atcp_send_done(); and wait (bounded) for it
+	 */
+	int			(*send)(void *, const struct iovec *, int, int);
+	void			(*send_wait)(void *, int);
 };
 
 struct atcp_wr_state {
@@ -43,34 +79,55 @@ struct atcp_wr_state {
 
 	size_t			write_cnt;	/* water level */
 	size_t			write_cnt_max;
+	size_t			write_unsent;	/* not yet sent: the backlog */
+	size_t			write_unsent_max;
 
 	struct list_head	write_q;	/* list of async writes */
 	struct list_head	write_compl_q;	/* list of done writes */
 
+	/* write descriptors are handed out in order from this ring, and
+	 * reclaimed once every older descriptor has also been freed;
+	 * when it is full, descriptors are calloc'd instead
+	 */
+	struct atcp_write	ring[ATCP_WR_RING];
+	unsigned int		ring_head;	/* oldest descriptor in use */
+	unsigned int		ring_tail;	/* next descriptor to hand out */
+
+	/* iovec of the memory writes at the head of write_q, topped
+	 * up as writes are queued and trimmed as they are sent
+	 */
+	struct iovec		iov[ATCP_MAX_WR_IOV];
+	unsigned int		iov_first;	/* first live iov[] entry */
+	unsigned int		iov_cnt;	/* live iov[] entries */
+	size_t			iov_bytes;	/* octets in live entries */
+	struct atcp_write	*iov_last;	/* write of last live entry */
+
+	/* asynchronous send state, see atcp_wr_ops.send */
+	bool			send_busy;	/* a send is in flight */
+	struct atcp_write	*send_last;	/* ... ending with this write */
+
+	/* MSG_ZEROCOPY state */
+	unsigned int		zc_min;		/* min bytes per send; 0 = off */
+	uint32_t		zc_next;	/* id of next zero-copy send */
+	uint32_t		zc_done;	/* last id released by kernel */
+	struct list_head	zc_q;		/* sent writes awaiting release */
+
 	void			*priv;		/* untouched by atcp */
 
 	/* various statistics */
 	uint64_t		opt_write;	/* optimistic writes */
+	uint64_t		remaps;		/* writes given private copies */
+	uint64_t		ring_full;	/* descriptors calloc'd */
+	unsigned int		wbuf_cnt;	/* inline buffers in use */
+	unsigned int		wbuf_cnt_max;
+	uint64_t		zc_sends;	/* zero-copy sends */
+	uint64_t		zc_copied;	/* ... which the kernel copied */
+	uint64_t		async_sends;	/* sends via ops->send */
 
 	const struct atcp_wr_ops *ops;
 	void			*ev_info;	/* passed to ops->ev_* */
 };
 
-typedef bool (*atcp_write_func)(struct atcp_wr_state *, void *, bool);
-
-struct atcp_write {
-	const void		*buf;		/* write buffer pointer */
-	int			togo;		/* write buffer remainder */
-
-	int			length;		/* length for accounting */
-	atcp_write_func		cb;		/* callback */
-	void			*cb_data;	/* data passed to cb */
-
-	struct atcp_wr_state	*wst;		/* our parent */
-
-	struct list_head	node;		/* write_[compl_]q list node */
-};
-
 /* setup and teardown atcp write state */
 extern void atcp_wr_exit(struct atcp_wr_state *wst);
 extern void atcp_wr_init(struct atcp_wr_state *wst,
@@ -93,6 +150,43 @@ extern void atcp_wr_set_fd(struct atcp_wr_state *wst, int fd);
 extern int atcp_writeq(struct atcp_wr_state *wst, const void *buf, unsigned int buflen,
 	        atcp_write_func cb, void *cb_data);
 
+/* get a descriptor's inline buffer, of ATCP_WR_INLINE bytes */
+extern void *atcp_wbuf_get(struct atcp_wr_state *wst);
+
+/* release an inline buffer without sending it */
+extern void atcp_wbuf_put(struct atcp_wr_state *wst, void *buf);
+
+/* add an inline buffer to the write queue; it is released once sent */
+extern int atcp_writeq_wbuf(struct atcp_wr_state *wst, void *buf,
+			    unsigned int buflen);
+
+/* add a file range to the write queue, to be sent with sendfile(2) */
+extern int atcp_writeq_file(struct atcp_wr_state *wst, int fd, off_t off,
+			    unsigned int len, atcp_write_func cb, void *cb_data);
+
+/* copy queued data referencing a memory range that will be overwritten;
+ * -EBUSY if some is still being sent, and cannot be
+ */
+extern int atcp_write_remap(struct atcp_wr_state *wst, const void *buf,
+			    size_t len);
+
+/* likewise, for queued ranges of a file mapped at map; best-effort */
+extern int atcp_write_remap_file(struct atcp_wr_state *wst, int fd, off_t off,
+				 const void *map, size_t len);
+
+/* send writes of min_bytes or more with MSG_ZEROCOPY */
+extern int atcp_wr_set_zerocopy(struct atcp_wr_state *wst,
+				unsigned int min_bytes);
+
+/* process zero-copy completions from the socket error queue */
+extern bool atcp_zc_reap(struct atcp_wr_state *wst);
+
+/* an asynchronous send finished, having sent rc bytes or failed */
+extern void atcp_send_done(struct atcp_wr_state *wst, ssize_t rc);
+
+/* wait (bounded) until an asynchronous send is done with its data */
+extern void atcp_send_flush(struct atcp_wr_state *wst, int timeout_ms);
+
 /* begin pushing write queue to socket */
 extern bool atcp_write_start(struct atcp_wr_state *wst);
 
@@ -108,4 +202,10 @@ static inline size_t atcp_wqueued(struct atcp_wr_state *wst)
 	return wst->write_cnt;
 }
 
+/* number of queued octets not yet handed to the kernel */
+static inline size_t atcp_wunsent(struct atcp_wr_state *wst)
+{
+	return wst->write_unsent;
+}
+
 #endif /* __ANET_H__ */
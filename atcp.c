@@ -21,26 +21,96 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
+#include <unistd.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 #include "anet.h"
 
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#define HAVE_ATCP_ZEROCOPY 1
+#endif
+
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 #endif
 
+/* is zero-copy send 'seq' yet to be released by the kernel? */
+static inline bool atcp_zc_held(const struct atcp_wr_state *wst,
+				uint32_t seq)
+{
+	return (int32_t)(seq - wst->zc_done) > 0;
+}
+
 bool atcp_cb_free(struct atcp_wr_state *wst, void *cb_data, bool done)
 {
 	free(cb_data);
 	return false;
 }
 
+static struct atcp_write *atcp_write_alloc(struct atcp_wr_state *wst)
+{
+	struct atcp_write *wr;
+
+	if (wst->ring_tail - wst->ring_head < ATCP_WR_RING) {
+		wr = &wst->ring[wst->ring_tail++ % ATCP_WR_RING];
+		memset(wr, 0, sizeof(*wr));
+		wr->in_ring = true;
+	} else {
+		wr = calloc(1, sizeof(*wr));
+		if (!wr)
+			return NULL;
+		wst->ring_full++;
+	}
+
+	wr->wst = wst;
+	wr->fd = -1;
+	return wr;
+}
+
+static void atcp_write_release(struct atcp_write *wr)
+{
+	struct atcp_wr_state *wst = wr->wst;
+
+	if (wr->wbuf)
+		wst->wbuf_cnt--;
+
+	if (!wr->in_ring) {
+		free(wr);
+		return;
+	}
+
+	/* zero-copy writes may be freed out of order; the ring only
+	 * advances past a contiguous run of free descriptors
+	 */
+	wr->in_ring = false;
+	while ((wst->ring_head != wst->ring_tail) &&
+	       !wst->ring[wst->ring_head % ATCP_WR_RING].in_ring)
+		wst->ring_head++;
+}
+
+static void atcp_iov_reset(struct atcp_wr_state *wst)
+{
+	wst->iov_first = 0;
+	wst->iov_cnt = 0;
+	wst->iov_bytes = 0;
+	wst->iov_last = NULL;
+}
+
 static void atcp_write_complete(struct atcp_write *tmp)
 {
 	struct atcp_wr_state *wst = tmp->wst;
 
 	list_del(&tmp->node);
-	list_add_tail(&tmp->node, &wst->write_compl_q);
+
+	/* the kernel may still reference pages sent by zero-copy */
+	if (tmp->zc && atcp_zc_held(wst, tmp->zc_seq))
+		list_add_tail(&tmp->node, &wst->zc_q);
+	else
+		list_add_tail(&tmp->node, &wst->write_compl_q);
 }
 
 static bool atcp_write_free(struct atcp_write *tmp, bool done)
@@ -49,10 +119,12 @@ static bool atcp_write_free(struct atcp_write *tmp, bool done)
 	bool rcb = false;
 
 	wst->write_cnt -= tmp->length;
+	wst->write_unsent -= tmp->togo;
 	list_del_init(&tmp->node);
 	if (tmp->cb)
 		rcb = tmp->cb(wst, tmp->cb_data, done);
-	free(tmp);
+	free(tmp->copy);
+	atcp_write_release(tmp);
 
 	return rcb;
 }
@@ -79,27 +151,52 @@ void atcp_write_free_all(struct atcp_wr_state *wst)
 	list_for_each_entry_safe(wr, tmp, &wst->write_q, node) {
 		atcp_write_free(wr, false);
 	}
+	list_for_each_entry_safe(wr, tmp, &wst->zc_q, node) {
+		atcp_write_free(wr, false);
+	}
+	atcp_iov_reset(wst);
 }
 
-static int atcp_wr_iov(struct atcp_wr_state *wst,
-		       struct iovec *iov, int max_iov)
+/* extend iovec with newly queued buffers, stopping short of any file
+ * range; returns true if writes remain beyond the iovec
+ */
+static bool atcp_wr_iov(struct atcp_wr_state *wst)
 {
+	struct list_head *pos;
 	struct atcp_write *tmp;
-	int n_iov = 0;
+	unsigned int i;
+
+	pos = wst->iov_cnt ? wst->iov_last->node.next : wst->write_q.next;
+	if (pos == &wst->write_q)
+		return false;
+
+	/* slide live entries down if the tail of iov[] is used up */
+	if (wst->iov_first &&
+	    (wst->iov_first + wst->iov_cnt == ATCP_MAX_WR_IOV)) {
+		memmove(wst->iov, wst->iov + wst->iov_first,
+			wst->iov_cnt * sizeof(struct iovec));
+		wst->iov_first = 0;
+	}
+
+	for (; pos != &wst->write_q; pos = pos->next) {
+		tmp = list_entry(pos, struct atcp_write, node);
+		i = wst->iov_first + wst->iov_cnt;
+		if (i == ATCP_MAX_WR_IOV || tmp->fd >= 0)
+			return true;
 
-	list_for_each_entry(tmp, &wst->write_q, node) {
-		if (n_iov == max_iov)
-			break;
 		/* bleh, struct iovec should declare iov_base const */
-		iov[n_iov].iov_base = (void *) tmp->buf;
-		iov[n_iov].iov_len = tmp->togo;
-		n_iov++;
+		wst->iov[i].iov_base = (void *) tmp->buf;
+		wst->iov[i].iov_len = tmp->togo;
+		wst->iov_cnt++;
+		wst->iov_bytes += tmp->togo;
+		wst->iov_last = tmp;
 	}
 
-	return n_iov;
+	return false;
 }
 
-static void atcp_wr_completed(struct atcp_wr_state *wst, ssize_t rc)
+static void atcp_wr_completed(struct atcp_wr_state *wst, ssize_t rc,
+			      bool zc, uint32_t zc_seq)
 {
 	/* iterate through write queue, issuing completions based on
 	 * amount of data written
@@ -114,7 +211,31 @@ static void atcp_wr_completed(struct atcp_wr_state *wst, ssize_t rc)
 		/* mark data consumed by decreasing tmp->len */
 		sz = (tmp->togo < rc) ? tmp->togo : rc;
 		tmp->togo -= sz;
-		tmp->buf += sz;
+		wst->write_unsent -= sz;
+		if (zc) {
+			tmp->zc = true;
+			tmp->zc_seq = zc_seq;
+		}
+		if (tmp->fd >= 0)
+			tmp->off += sz;
+		else {
+			/* memory writes are always at the head of iov[],
+			 * unless a remap reset it during an async send
+			 */
+			struct iovec *iov = &wst->iov[wst->iov_first];
+
+			tmp->buf += sz;
+			if (wst->iov_cnt) {
+				iov->iov_base += sz;
+				iov->iov_len -= sz;
+				wst->iov_bytes -= sz;
+				if (tmp->togo == 0) {
+					wst->iov_first++;
+					if (--wst->iov_cnt == 0)
+						atcp_iov_reset(wst);
+				}
+			}
+		}
 		rc -= sz;
 
 		/* if tmp->len reaches zero, write is complete,
@@ -128,25 +249,85 @@ static void atcp_wr_completed(struct atcp_wr_state *wst, ssize_t rc)
 
 static bool atcp_writable(struct atcp_wr_state *wst)
 {
-	int n_iov;
+	struct atcp_write *tmp;
+	int flags;
+	bool more, zc;
 	ssize_t rc;
-	struct iovec iov[ATCP_MAX_WR_IOV];
+	size_t want;
+	off_t off;
+	struct msghdr msg;
 
-	/* accumulate pending writes into iovec */
-	n_iov = atcp_wr_iov(wst, iov, ARRAY_SIZE(iov));
+	while (!atcp_wq_empty(wst)) {
+		/* finished by atcp_send_done() */
+		if (wst->send_busy)
+			return true;
 
-	/* execute non-blocking write */
-do_write:
-	rc = writev(wst->fd, iov, n_iov);
-	if (rc < 0) {
-		if (errno == EINTR)
-			goto do_write;
-		if (errno != EAGAIN)
-			goto err_out;
-		return true;
-	}
+		tmp = list_entry(wst->write_q.next, struct atcp_write, node);
+
+		zc = false;
+
+		if (tmp->fd >= 0) {
+			/* file range: page cache straight to the socket */
+			off = tmp->off;
+			want = tmp->togo;
+			rc = sendfile(wst->fd, tmp->fd, &off, want);
+			if (rc == 0)	/* file truncated beneath us */
+				goto err_out;
+		} else {
+			/* top up iovec with pending writes */
+			more = atcp_wr_iov(wst);
+			want = wst->iov_bytes;
+
+			/* execute non-blocking write; if a file range
+			 * follows, let it share segments with these bytes
+			 */
+			flags = more ? MSG_MORE : 0;
+#ifdef HAVE_ATCP_ZEROCOPY
+			if (wst->zc_min && (want >= wst->zc_min)) {
+				flags |= MSG_ZEROCOPY;
+				zc = true;
+			}
+#endif
 
-	atcp_wr_completed(wst, rc);
+			if (wst->ops->send && !zc) {
+				if (wst->ops->send(wst->ev_info,
+						   wst->iov + wst->iov_first,
+						   wst->iov_cnt, flags) < 0)
+					goto err_out;
+
+				wst->send_busy = true;
+				wst->send_last = wst->iov_last;
+				wst->async_sends++;
+				return true;
+			}
+
+			if (flags) {
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = wst->iov + wst->iov_first;
+				msg.msg_iovlen = wst->iov_cnt;
+				rc = sendmsg(wst->fd, &msg, flags);
+			} else
+				rc = writev(wst->fd, wst->iov + wst->iov_first,
+					    wst->iov_cnt);
+		}
+
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				goto err_out;
+			return true;
+		}
+
+		/* each zero-copy send that queued data consumes an id */
+		if (zc && rc > 0)
+			wst->zc_sends++;
+		atcp_wr_completed(wst, rc, zc, zc ? wst->zc_next++ : 0);
+
+		/* socket buffer full */
+		if (rc < want)
+			break;
+	}
 
 	/* if we emptied the queue, clear write notification */
 	if (atcp_wq_empty(wst)) {
@@ -158,14 +339,43 @@ do_write:
 	return true;
 
 err_out:
+	/* part of a PDU may already be on the wire, e.g. its header
+	 * ahead of a file range sendfile() could not finish; the peer
+	 * can never resynchronise, so take the connection down
+	 */
+	shutdown(wst->fd, SHUT_RDWR);
 	atcp_write_free_all(wst);
 	return false;
 }
 
+void atcp_send_done(struct atcp_wr_state *wst, ssize_t rc)
+{
+	wst->send_busy = false;
+	wst->send_last = NULL;
+
+	if (rc == -EAGAIN || rc == -EINTR)
+		return;			/* sent again by atcp_writable */
+	if (rc < 0) {
+		/* as in atcp_writable(): the stream is lost mid-PDU */
+		shutdown(wst->fd, SHUT_RDWR);
+		atcp_write_free_all(wst);
+		return;
+	}
+
+	atcp_wr_completed(wst, rc, false, 0);
+}
+
+void atcp_send_flush(struct atcp_wr_state *wst, int timeout_ms)
+{
+	if (wst->send_busy && wst->ops->send_wait)
+		wst->ops->send_wait(wst->ev_info, timeout_ms);
+}
+
 static void atcp_wr_event(int fd, short events, void *userdata)
 {
 	struct atcp_wr_state *wst = userdata;
 
+	atcp_zc_reap(wst);
 	atcp_writable(wst);
 	atcp_write_run_compl(wst);
 }
@@ -197,6 +407,10 @@ bool atcp_write_start(struct atcp_wr_state *wst)
 		return true;		/* loop, not poll */
 	}
 
+	/* the send completion, not poll, carries on */
+	if (wst->send_busy)
+		return false;
+
 	if (wst->ops->ev_add(wst->ev_info, NULL) < 0)
 		return true;		/* loop, not poll */
 
@@ -205,6 +419,21 @@ bool atcp_write_start(struct atcp_wr_state *wst)
 	return false;			/* poll wait */
 }
 
+static void atcp_write_queue(struct atcp_write *wr, unsigned int len)
+{
+	struct atcp_wr_state *wst = wr->wst;
+
+	wr->togo = len;
+	wr->length = len;
+	list_add_tail(&wr->node, &wst->write_q);
+	wst->write_cnt += len;
+	if (wst->write_cnt > wst->write_cnt_max)
+		wst->write_cnt_max = wst->write_cnt;
+	wst->write_unsent += len;
+	if (wst->write_unsent > wst->write_unsent_max)
+		wst->write_unsent_max = wst->write_unsent;
+}
+
 int atcp_writeq(struct atcp_wr_state *wst, const void *buf, unsigned int buflen,
 	        atcp_write_func cb, void *cb_data)
 {
@@ -213,22 +442,257 @@ int atcp_writeq(struct atcp_wr_state *wst, const void *buf, unsigned int buflen,
 	if (!buf || !buflen)
 		return -EINVAL;
 
-	wr = calloc(1, sizeof(struct atcp_write));
+	wr = atcp_write_alloc(wst);
 	if (!wr)
 		return -ENOMEM;
 
 	wr->buf = buf;
-	wr->togo = buflen;
-	wr->length = buflen;
 	wr->cb = cb;
 	wr->cb_data = cb_data;
-	wr->wst = wst;
-	list_add_tail(&wr->node, &wst->write_q);
-	wst->write_cnt += buflen;
-	if (wst->write_cnt > wst->write_cnt_max)
-		wst->write_cnt_max = wst->write_cnt;
+	atcp_write_queue(wr, buflen);
+
+	return 0;
+}
+
+static inline struct atcp_write *atcp_wbuf_write(void *buf)
+{
+	return (struct atcp_write *)((char *) buf -
+				     offsetof(struct atcp_write, inl));
+}
+
+/*
+ * Small, short-lived buffers such as PDU headers are carved out of the
+ * write descriptor that will send them, and so come from the same ring.
+ */
+void *atcp_wbuf_get(struct atcp_wr_state *wst)
+{
+	struct atcp_write *wr;
+
+	wr = atcp_write_alloc(wst);
+	if (!wr)
+		return NULL;
 
+	wr->wbuf = true;
+	if (++wst->wbuf_cnt > wst->wbuf_cnt_max)
+		wst->wbuf_cnt_max = wst->wbuf_cnt;
+
+	return wr->inl;
+}
+
+void atcp_wbuf_put(struct atcp_wr_state *wst, void *buf)
+{
+	struct atcp_write *wr = atcp_wbuf_write(buf);
+
+	/* once queued, it is released when sent */
+	if (wr->node.next)
+		return;
+
+	atcp_write_release(wr);
+}
+
+int atcp_writeq_wbuf(struct atcp_wr_state *wst, void *buf,
+		     unsigned int buflen)
+{
+	struct atcp_write *wr = atcp_wbuf_write(buf);
+
+	if (!buflen || buflen > ATCP_WR_INLINE || wr->node.next)
+		return -EINVAL;
+
+	wr->buf = wr->inl;
+	atcp_write_queue(wr, buflen);
+
+	return 0;
+}
+
+/* a remapped write no longer references the caller's memory */
+static void atcp_write_detach(struct atcp_write *wr)
+{
+	wr->wst->remaps++;
+
+	if (wr->cb)
+		wr->cb(wr->wst, wr->cb_data, false);
+	wr->cb = NULL;
+}
+
+/*
+ * Queued writes may reference memory the caller does not own outright.
+ * Before such memory is overwritten, the unsent remainder of every queued
+ * write overlapping [buf, buf+len) is replaced by a private copy, and its
+ * callback run at once.  Data the kernel may still be reading, for an
+ * asynchronous or zero-copy send, cannot be swapped out: -EBUSY says
+ * some is left, its callback to run as its write is freed.
+ */
+int atcp_write_remap(struct atcp_wr_state *wst, const void *buf, size_t len)
+{
+	struct atcp_write *tmp;
+	const char *lo = buf, *hi = lo + len;
+	const char *p;
+	bool in_flight, busy;
+	void *mem;
+	int rc = 0;
+
+	list_for_each_entry(tmp, &wst->zc_q, node) {
+		p = tmp->buf - tmp->length;
+		if (!tmp->copy && (p < hi) && (p + tmp->length > lo))
+			rc = -EBUSY;
+	}
+
+	/* nor can data an asynchronous send may yet be reading */
+	in_flight = wst->send_busy;
+
+	list_for_each_entry(tmp, &wst->write_q, node) {
+		busy = in_flight;
+		if (tmp == wst->send_last)
+			in_flight = false;
+
+		p = tmp->buf;
+		if (tmp->copy || (tmp->fd >= 0) ||
+		    (p >= hi) || (p + tmp->togo <= lo))
+			continue;
+
+		if (busy || (tmp->zc && atcp_zc_held(wst, tmp->zc_seq))) {
+			rc = -EBUSY;
+			continue;
+		}
+
+		mem = malloc(tmp->togo);
+		if (!mem)
+			return -ENOMEM;
+
+		memcpy(mem, tmp->buf, tmp->togo);
+		tmp->buf = tmp->copy = mem;
+		atcp_write_detach(tmp);
+
+		/* rebuilt from write_q on the next send */
+		atcp_iov_reset(wst);
+	}
+
+	return rc;
+}
+
+/*
+ * Only the unsent remainder of a file range is copied.  What sendfile()
+ * already handed to the socket references the page cache until it is
+ * acknowledged, so copy-on-conflict is best-effort for file ranges: a
+ * write landing meanwhile may still reach the peer, in a retransmit.
+ */
+int atcp_write_remap_file(struct atcp_wr_state *wst, int fd, off_t off,
+			  const void *map, size_t len)
+{
+	struct atcp_write *tmp;
+	void *mem;
+
+	list_for_each_entry(tmp, &wst->write_q, node) {
+		if ((tmp->fd != fd) || (tmp->off >= off + (off_t) len) ||
+		    (tmp->off + tmp->togo <= off))
+			continue;
+
+		mem = malloc(tmp->togo);
+		if (!mem)
+			return -ENOMEM;
+
+		/* from the mapping: no read(2) on the caller's event loop */
+		memcpy(mem, (const char *) map + (tmp->off - off), tmp->togo);
+		tmp->buf = tmp->copy = mem;
+		tmp->fd = -1;
+		atcp_write_detach(tmp);
+
+		/* now a memory write, it may join the iovec */
+		atcp_iov_reset(wst);
+	}
+
+	return 0;
+}
+
+int atcp_writeq_file(struct atcp_wr_state *wst, int fd, off_t off,
+		     unsigned int len, atcp_write_func cb, void *cb_data)
+{
+	struct atcp_write *wr;
+
+	if (fd < 0 || !len)
+		return -EINVAL;
+
+	wr = atcp_write_alloc(wst);
+	if (!wr)
+		return -ENOMEM;
+
+	wr->fd = fd;
+	wr->off = off;
+	wr->cb = cb;
+	wr->cb_data = cb_data;
+	atcp_write_queue(wr, len);
+
+	return 0;
+}
+
+int atcp_wr_set_zerocopy(struct atcp_wr_state *wst, unsigned int min_bytes)
+{
+#ifdef HAVE_ATCP_ZEROCOPY
+	int on = 1;
+
+	if (setsockopt(wst->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0)
+		return -errno;
+
+	wst->zc_min = min_bytes;
 	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+bool atcp_zc_reap(struct atcp_wr_state *wst)
+{
+#ifdef HAVE_ATCP_ZEROCOPY
+	struct atcp_write *wr, *tmp;
+	struct sock_extended_err *serr;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	char control[128];
+	bool released = false;
+
+	if (!wst->zc_min)
+		return false;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(wst->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			serr = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/* ids [ee_info, ee_data] released; TCP
+			 * notifies in order
+			 */
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				wst->zc_copied += serr->ee_data -
+						  serr->ee_info + 1;
+			if (atcp_zc_held(wst, serr->ee_data))
+				wst->zc_done = serr->ee_data;
+			released = true;
+		}
+	}
+
+	if (!released)
+		return false;
+
+	list_for_each_entry_safe(wr, tmp, &wst->zc_q, node) {
+		if (atcp_zc_held(wst, wr->zc_seq))
+			continue;
+		list_del(&wr->node);
+		list_add_tail(&wr->node, &wst->write_compl_q);
+	}
+
+	return true;
+#else
+	return false;
+#endif
 }
 
 void atcp_wr_exit(struct atcp_wr_state *wst)
@@ -250,6 +714,9 @@ void atcp_wr_init(struct atcp_wr_state *wst,
 
 	INIT_LIST_HEAD(&wst->write_q);
 	INIT_LIST_HEAD(&wst->write_compl_q);
+	INIT_LIST_HEAD(&wst->zc_q);
+
+	wst->zc_done = (uint32_t) -1;
 
 	wst->fd = -1;
 
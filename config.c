@@ -0,0 +1,259 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "itd-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "iscsi.h"
+#include "target.h"
+
+enum {
+	CONFIG_MAX_ARGS		= 5,
+	CONFIG_LUN_MAX		= 16383,	/* flat space addressing */
+};
+
+/* a number with an optional 'k', 'm', 'g' or 't' suffix */
+int config_parse_size(const char *s, uint64_t *bytes)
+{
+	unsigned long long v;
+	char *end;
+	int shift = 0;
+
+	errno = 0;
+	v = strtoull(s, &end, 10);
+	if (errno || (end == s) || !v)
+		return -1;
+
+	switch (*end) {
+	case 't': case 'T':	shift++;	/* fall through */
+	case 'g': case 'G':	shift++;	/* fall through */
+	case 'm': case 'M':	shift++;	/* fall through */
+	case 'k': case 'K':	shift++;	end++; break;
+	}
+	if (*end)
+		return -1;
+
+	/* refuse what does not fit, rather than wrap */
+	for (; shift > 0; shift--) {
+		if (v > UINT64_MAX / 1024)
+			return -1;
+		v *= 1024;
+	}
+
+	*bytes = v;
+	return 0;
+}
+
+static int config_split(char *line, char **argv)
+{
+	char *s;
+	int argc = 0;
+
+	s = strchr(line, '#');
+	if (s)
+		*s = '\0';
+
+	for (s = strtok(line, " \t\r\n"); s; s = strtok(NULL, " \t\r\n")) {
+		if (argc == CONFIG_MAX_ARGS)
+			return -1;
+		argv[argc++] = s;
+	}
+
+	return argc;
+}
+
+static int config_target(targv_t *tv, char **argv, int argc)
+{
+	struct disc_target *tp;
+	int i;
+
+	if ((argc < 2) || (argc > 3))
+		return -1;
+
+	for (i = 0; i < tv->c; i++)
+		if (!strcmp(tv->v[i].iqn, argv[1])) {
+			fprintf(stderr, "target %s defined twice\n", argv[1]);
+			return -1;
+		}
+
+	ALLOC(struct disc_target, tv->v, tv->size, tv->c, 4, 4,
+	      "config_target", return -1);
+
+	tp = &tv->v[tv->c];
+	memset(tp, 0, sizeof(*tp));
+	tp->de.type = DE_DEVICE;
+	tp->target = strdup(argv[1]);
+	tp->iqn = strdup(argv[1]);
+	tp->mask = strdup(argc == 3 ? argv[2] : "0/0");
+	tv->c++;
+
+	if (!tp->target || !tp->iqn || !tp->mask)
+		return -1;
+
+	return 0;
+}
+
+static int config_lun(struct disc_target *tp, char **argv, int argc)
+{
+	struct disc_lun *lp;
+	unsigned long n;
+	char *end;
+	int i;
+
+	if ((argc != 4) && (argc != 5))
+		return -1;
+
+	n = strtoul(argv[1], &end, 10);
+	if (*end || (end == argv[1]) || (n > CONFIG_LUN_MAX)) {
+		fprintf(stderr, "invalid LUN '%s'\n", argv[1]);
+		return -1;
+	}
+
+	for (i = 0; i < tp->luns.c; i++)
+		if (tp->luns.v[i].lun == n) {
+			fprintf(stderr, "LUN %lu defined twice\n", n);
+			return -1;
+		}
+	if (tp->luns.c == TARGET_MAX_LUNS) {
+		fprintf(stderr, "more than %u LUNs\n", TARGET_MAX_LUNS);
+		return -1;
+	}
+
+	ALLOC(struct disc_lun, tp->luns.v, tp->luns.size, tp->luns.c, 4, 4,
+	      "config_lun", return -1);
+
+	lp = &tp->luns.v[tp->luns.c];
+	memset(lp, 0, sizeof(*lp));
+	lp->lun = n;
+
+	if (!strcmp(argv[2], "ram")) {
+		lp->backend = LUN_RAM;
+		if (config_parse_size(argv[3], &lp->size) < 0) {
+			fprintf(stderr, "invalid size '%s'\n", argv[3]);
+			return -1;
+		}
+	} else if (!strcmp(argv[2], "file") || !strcmp(argv[2], "direct")) {
+		lp->backend = (argv[2][0] == 'f') ? LUN_MAP : LUN_DIRECT;
+		lp->path = strdup(argv[3]);
+		if (!lp->path)
+			return -1;
+	} else {
+		fprintf(stderr, "unknown backing store '%s'\n", argv[2]);
+		return -1;
+	}
+
+	if (argc == 5) {
+		if (!strcmp(argv[4], "512"))
+			lp->block_size = 512;
+		else if (!strcmp(argv[4], "4096"))
+			lp->block_size = 4096;
+		else {
+			fprintf(stderr, "invalid block size '%s'\n", argv[4]);
+			free(lp->path);
+			return -1;
+		}
+	}
+
+	tp->luns.c++;
+	return 0;
+}
+
+/*
+ * Read the targets, and their LUNs, described by a configuration file.
+ * Errors are reported on stderr, at startup.
+ */
+int config_read(const char *fn, targv_t *tv)
+{
+	char line[1024], *argv[CONFIG_MAX_ARGS];
+	struct disc_target *tp = NULL;
+	int argc, lineno = 0, i;
+	FILE *f;
+
+	memset(tv, 0, sizeof(*tv));
+
+	f = fopen(fn, "r");
+	if (!f) {
+		perror(fn);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+
+		argc = config_split(line, argv);
+		if (!argc)
+			continue;
+		if (argc < 0)
+			goto err_syntax;
+
+		if (!strcmp(argv[0], "target")) {
+			if (config_target(tv, argv, argc) < 0)
+				goto err_syntax;
+			tp = &tv->v[tv->c - 1];
+		} else if (!strcmp(argv[0], "lun") && tp) {
+			if (config_lun(tp, argv, argc) < 0)
+				goto err_syntax;
+		} else
+			goto err_syntax;
+	}
+
+	fclose(f);
+
+	if (!tv->c) {
+		fprintf(stderr, "%s: no targets\n", fn);
+		goto err_out;
+	}
+	for (i = 0; i < tv->c; i++)
+		if (!tv->v[i].luns.c) {
+			fprintf(stderr, "%s: target %s has no LUNs\n", fn,
+				tv->v[i].iqn);
+			goto err_out;
+		}
+
+	return 0;
+
+err_syntax:
+	fprintf(stderr, "%s:%d: invalid configuration\n", fn, lineno);
+	fclose(f);
+err_out:
+	config_free(tv);
+	return -1;
+}
+
+void config_free(targv_t *tv)
+{
+	struct disc_target *tp;
+	int i, j;
+
+	for (i = 0; i < tv->c; i++) {
+		tp = &tv->v[i];
+
+		for (j = 0; j < tp->luns.c; j++)
+			free(tp->luns.v[j].path);
+		free(tp->luns.v);
+
+		free(tp->target);
+		free(tp->iqn);
+		free(tp->mask);
+	}
+
+	free(tv->v);
+	memset(tv, 0, sizeof(*tv));
+}
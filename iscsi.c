@@ -77,7 +77,7 @@ int iscsi_task_cmd_decap(const uint8_t * header, struct iscsi_task_cmd *cmd)
 			 NO_CLEANUP, -1);
 
 	cmd->immediate = ((header[0] & 0x40) == 0x40);	/* Immediate bit  */
-	cmd->function = header[1] & 0x80;	/* Function  */
+	cmd->function = header[1] & 0x7f;	/* Function  */
 	cmd->lun = GUINT64_FROM_BE(*((uint64_t *) (void *)(header + 8)));	/* LUN */
 	cmd->tag = ntohl(*((uint32_t *) (void *)(header + 16)));	/* Tag */
 	cmd->ref_tag = ntohl(*((uint32_t *) (void *)(header + 20)));	/* Reference Tag */
@@ -369,7 +369,7 @@ int iscsi_login_cmd_decap(const uint8_t * header, struct iscsi_login_cmd_args *c
 	cmd->version_min = header[3];	/* Version-Min  */
 	cmd->AHSlength = header[4];	/* TotalAHSLength */
 	cmd->length = ntohl(*((uint32_t *) (void *)(header + 4)));	/* Length */
-	cmd->isid = GUINT64_FROM_BE(*((uint64_t *) (void *)(header + 8)));	/* ISID */
+	cmd->isid = GUINT64_FROM_BE(*((uint64_t *) (void *)(header + 8))) >> 16;	/* ISID (48 bits) */
 	cmd->tsih = ntohs(*((uint16_t *) (void *)(header + 14)));	/* TSIH */
 	cmd->tag = ntohl(*((uint32_t *) (void *)(header + 16)));	/* Task Tag */
 	cmd->cid = ntohs(*((uint16_t *) (void *)(header + 20)));	/* CID */
@@ -486,7 +486,7 @@ int iscsi_login_rsp_encap(uint8_t * header, struct iscsi_login_rsp_args *rsp)
 	header[3] = rsp->version_active;	/* Version-active */
 	header[4] = rsp->AHSlength;	/* TotalAHSLength */
 	*((uint32_t *) (void *)(header + 4)) = htonl(rsp->length);	/* Length */
-	*((uint64_t *) (void *)(header + 8)) = GUINT64_TO_BE(rsp->isid);	/* ISID */
+	*((uint64_t *) (void *)(header + 8)) = GUINT64_TO_BE(rsp->isid << 16);	/* ISID (48 bits) */
 	*((uint16_t *) (void *)(header + 14)) = htons(rsp->tsih);	/* TSIH */
 	*((uint32_t *) (void *)(header + 16)) = htonl(rsp->tag);	/* Tag  */
 	*((uint32_t *) (void *)(header + 24)) = htonl(rsp->StatSN);	/* StatRn */
@@ -60,6 +60,7 @@
 #define ISCSI_IMMEDIATE_DATA_DFLT            1
 #define ISCSI_INITIAL_R2T_DFLT               1
 #define ISCSI_USE_PHASE_COLLAPSED_READ_DFLT  0
+#define ISCSI_DATA_SEG_DFLT                  8192	/* MaxRecvDataSegmentLength */
 #define ISCSI_HEADER_LEN                     48
 #define ISCSI_PORT                           3260	/* Default port */
 #define ISCSI_OPCODE(HEADER)                 (HEADER[0] & 0x3f)
@@ -115,6 +116,8 @@ enum {
 	ISCSI_LOGIN_DETAIL_SUCCESS = 0x0,
 	ISCSI_LOGIN_DETAIL_INIT_AUTH_FAILURE = 0x01,
 	ISCSI_LOGIN_DETAIL_VERSION_NOT_SUPPORTED = 0x05,
+	ISCSI_LOGIN_DETAIL_TOO_MANY_CONNECTIONS = 0x06,
+	ISCSI_LOGIN_DETAIL_SESSION_NOT_FOUND = 0x0a,
 	ISCSI_LOGIN_DETAIL_NOT_LOGGED_IN = 0x0b
 };
 
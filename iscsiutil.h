@@ -145,6 +145,14 @@ extern int fsetflags(const char *prefix, int fd, int or_flags);
 extern int iscsi_writev(struct atcp_wr_state *wst,
 			void *header, unsigned header_len,
 			const void *data, unsigned data_len);
+extern int iscsi_writev_ref(struct atcp_wr_state *wst,
+			    void *header, unsigned header_len,
+			    const void *data, unsigned data_len,
+			    atcp_write_func cb, void *cb_data);
+extern int iscsi_writev_file(struct atcp_wr_state *wst,
+			     void *header, unsigned header_len,
+			     int fd, off_t off, unsigned data_len,
+			     atcp_write_func cb, void *cb_data);
 
 extern void     cdb2lba(uint32_t *, uint16_t *, uint8_t *);
 extern void     lba2cdb(uint8_t *, uint32_t *, uint16_t *);
@@ -243,10 +251,40 @@ extern size_t   strlcpy(char *, const char *, size_t);
 
 extern void send_padding(struct atcp_wr_state *wst, unsigned int len_out);
 
-extern void *header_get(void);
-extern void header_put(void *mem);
-extern bool hdr_cb_free(struct atcp_wr_state *, void *, bool);
-extern void hdrs_free_all(void);
+extern void *header_get(struct atcp_wr_state *wst);
+extern void header_put(struct atcp_wr_state *wst, void *mem);
+
+/*
+ * PDU segment buffer cache.  Received data and AHS segments are drawn
+ * from power-of-two size classes, and released buffers are kept on
+ * per-class free stacks for reuse.  Classes larger than the negotiated
+ * MaxRecvDataSegmentLength are never cached.
+ */
+
+enum {
+	SEG_MIN_SHIFT		= 9,		/* smallest class: 512 bytes */
+	SEG_CLASSES		= 16,		/* largest class: 16MB */
+	SEG_CACHE_BYTES		= 1024 * 1024,	/* per-class cache budget */
+	SEG_CACHE_MIN		= 4,		/* per-class minimum depth */
+};
+
+struct seg_pool {
+	void		*free[SEG_CLASSES];	/* per-class free stacks */
+	unsigned int	n_free[SEG_CLASSES];
+	unsigned int	max_class;	/* largest cached class */
+
+	/* various statistics */
+	uint64_t	hits;		/* served from free stack */
+	uint64_t	misses;		/* served by malloc */
+	uint64_t	in_use;		/* buffers handed out */
+	uint64_t	in_use_max;
+};
+
+extern void seg_pool_init(struct seg_pool *pool, size_t max_seg);
+extern void seg_pool_set_max(struct seg_pool *pool, size_t max_seg);
+extern void seg_pool_exit(struct seg_pool *pool);
+extern void *seg_get(struct seg_pool *pool, size_t size);
+extern void seg_put(struct seg_pool *pool, void *mem);
 
 static inline int padding_bytes(unsigned int len_out)
 {
@@ -26,6 +26,7 @@
 #include <netdb.h>
 #include <glib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <netinet/in.h>
 #include <argp.h>
@@ -35,11 +36,20 @@
 #include <event.h>
 #include <net/if.h>
 #include <ifaddrs.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <linux/mempolicy.h>
 
 #include "iscsi.h"
 #include "target.h"
 #include "parameters.h"
 #include "scsi_cmd_codes.h"
+#include "uring.h"
 
 #define ISCSI_VENDOR	"Hail"
 #define ISCSI_PRODUCT	"ISCSI BLKDEV"
@@ -49,27 +59,143 @@ uint32_t iscsi_debug_level = 0;
 
 static bool server_running = true;
 static bool opt_strict_free = false;
+static bool opt_sendfile = false;
+static bool opt_uring = false;
+
+enum {
+	RAM_PAGES_BASE,			/* the system page size */
+	RAM_PAGES_THP,			/* transparent huge pages */
+	RAM_PAGES_HUGETLB,		/* MAP_HUGETLB, of ram_huge_shift */
+};
+
+enum {
+	RAM_NODE_ANY		= -1,	/* wherever first touched */
+	RAM_NODE_INTERLEAVE	= -2,
+};
 
 static char *file_map_fn;
-static int file_map_fd = -1;
-static void *file_map;
-static size_t file_map_size;
+static char *config_fn;
+static uint64_t ram_size = 100 * 1024 * 1024;
+static unsigned int n_direct;		/* LUN_DIRECT logical units */
+static unsigned int n_mapped;		/* LUN_MAP logical units */
+static uint64_t ram_limit;		/* bytes of RAM LUN chunks, or 0 */
+static uint64_t ram_used;		/* bytes of RAM LUN chunks written */
+static int ram_pages = RAM_PAGES_BASE;
+static unsigned int ram_huge_shift;	/* RAM_PAGES_HUGETLB page size */
+static int ram_node = RAM_NODE_ANY;
+static uint32_t block_size = 512;	/* unless the LUN has its own */
+static unsigned int flush_age = 5000;	/* ms; dirty data written back, */
+static uint64_t flush_dirty = 64 << 20;	/* or once this much is dirty */
+static targv_t tv;
+
+enum {
+	MAX_BLOCK_SIZE	= 4096,
+	PHYS_BLOCK_SIZE	= 4096,		/* as memory and files are paged */
+};
+
+enum {
+	RAM_CHUNK_SHIFT	= 16,		/* RAM LUNs are allocated 64KB at once, */
+	RAM_CHUNK_SIZE	= 1 << RAM_CHUNK_SHIFT,
+	RAM_THP_SHIFT	= 21,		/* or a huge page at once */
+};
+
+enum {
+	DIRTY_SHIFT	= 20,		/* files track writes per 1MB region */
+	FLUSH_WINDOW	= 64 << DIRTY_SHIFT,	/* written back at once */
+	FLUSH_TICK_MS	= 100,		/* flusher checks thresholds */
+};
 
-void *data_mem = NULL;
+enum {
+	UNMAP_MAX_DESC	= 32,		/* block descriptors per UNMAP */
+	UNMAP_PARAM_MAX	= 8 + (16 * UNMAP_MAX_DESC),
+	WRITE_SAME_MAX	= 32 << 20,	/* bytes per WRITE SAME */
+	FILL_BUF_SIZE	= 1 << 20,	/* io_uring WRITE SAME, at once */
+};
 
 enum {
-	data_lba_size	= 512,
+	URING_ENTRIES	= 256,		/* SQEs per event loop */
+	URING_BUFS	= 32,		/* registered buffers per event loop */
+	URING_BUF_SIZE	= 256 * 1024,
+	URING_ALIGN	= 4096,		/* O_DIRECT buffer alignment */
+};
+
+/*
+ * --io-uring backend state, one per event loop.  READ and WRITE data
+ * is staged in the registered buffers when it fits, or in a buffer of
+ * its own otherwise.
+ */
+struct dev_ring {
+	struct uring		ring;
+	int			efd;		/* signalled on completions */
+	struct event		ev;
+
+	uint8_t			*bufs;
+	bool			fixed_bufs;	/* registered with the ring */
+	bool			fixed_file;
+	unsigned int		buf_free[URING_BUFS];
+	unsigned int		n_buf_free;
+};
+
+/* a logical unit's backing store */
+struct dev_lun {
+	struct disc_lun		*dl;
+	uint8_t			*mem;		/* RAM, or the file mapped */
+	uint64_t		n_lba;
+	uint32_t		block_size;	/* logical block, in bytes */
+	int			fd;		/* backing file, or -1 */
+	int			file_index;	/* among io_uring fixed files */
+
+	/* RAM: a bit per chunk, set once the chunk has been written */
+	uint64_t		*chunk_map;
+	uint64_t		n_chunks;
+	unsigned int		chunk_shift;
+	size_t			map_len;	/* whole chunks */
+
+	/* files: a bit per region, set once written to since synced */
+	uint64_t		*dirty_map;
+	uint16_t		*flushing;	/* per region, flushes in flight */
+	uint64_t		n_dirty;	/* regions */
+	uint64_t		dirty_since;	/* ns, as the first was set */
 };
 
-static uint64_t data_mem_lba = (100 * 1024 * 1024) / data_lba_size;
+/*
+ * --file-map write-back: a thread flushing mapped files, a window of
+ * regions at a time, once their oldest dirty data reaches flush_age or
+ * flush_dirty bytes of regions are dirty in all.  Blocks rewritten
+ * meanwhile are written back once.
+ */
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;
+	bool			stop;
+	bool			running;
+	pthread_t		thread;
+
+	/* various statistics */
+	uint64_t		flushes;	/* msync calls */
+	uint64_t		bytes;		/* spanned by them */
+	uint64_t		ns;		/* time taken, in all */
+	uint64_t		ns_max;
+} flusher = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+	.wake	= PTHREAD_COND_INITIALIZER,
+};
 
 static struct globals gbls = {
 	.port		= 3260,
+	.queue_depth	= DEFAULT_TARGET_QUEUE_DEPTH,
+	.n_workers	= 1,
+	.tx_high	= DEFAULT_TARGET_TX_HIGH,
+	.tx_low		= DEFAULT_TARGET_TX_HIGH / 4,
 };
 
 const char *argp_program_version = PACKAGE_VERSION;
 
 static struct argp_option options[] = {
+	{ "config", 'c', "FILE", 0,
+	  "Serve the targets, and their LUNs, described in FILE, rather "
+	  "than a single target with one LUN set up by --file-map, "
+	  "--ram-size and --io-uring." },
 	{ "file-map", 'f', "FILE", 0,
 	  "Memory map FILE for backing store, rather than temporary RAM "
 	  "buffer. Default: do not map any file, and exclusively use "
@@ -82,8 +208,60 @@ static struct argp_option options[] = {
 	{ "strict-free", 1001, NULL, 0,
 	  "For memory-checker runs.  When shutting down server, free local "
 	  "heap, rather than simply exit(2)ing and letting OS clean up." },
+	{ "sendfile", 1002, NULL, 0,
+	  "With --file-map, transmit READ data from the file using "
+	  "sendfile(2), rather than from the memory map.  A READ sent "
+	  "this way may carry blocks a concurrent WRITE overwrites." },
+	{ "zerocopy", 1003, "BYTES", OPTION_ARG_OPTIONAL,
+	  "Transmit with MSG_ZEROCOPY when at least BYTES are sent at "
+	  "once.  Default: off; BYTES defaults to 65536." },
+	{ "queue-depth", 1004, "TASKS", 0,
+	  "Accept up to TASKS outstanding SCSI commands per session.  "
+	  "Default: 32" },
+	{ "threads", 1005, "N", 0,
+	  "Run N event loop threads, each accepting connections on its "
+	  "own listening socket.  Default: 1" },
+	{ "io-threads", 1006, "N", 0,
+	  "Run READ, WRITE and SYNCHRONIZE CACHE against the backing store "
+	  "on N storage threads, so that page faults and msync(2) do not "
+	  "stall the event loops.  Default: 0, run them inline" },
+	{ "io-uring", 1007, NULL, 0,
+	  "With --file-map, access FILE with O_DIRECT reads and writes "
+	  "through io_uring, rather than memory mapping it." },
+	{ "net-uring", 1008, NULL, 0,
+	  "Receive and send on session sockets through io_uring: multishot "
+	  "receives into provided buffers, and sends batched per event "
+	  "loop iteration." },
+	{ "backlog", 1009, "BYTES", 0,
+	  "Stop reading commands from a session while more than BYTES of "
+	  "its responses wait to be sent, resuming below a quarter of "
+	  "that.  0 disables.  Default: 16777216" },
+	{ "ram-limit", 1010, "VALUE", 0,
+	  "RAM storage is allocated in 64KB chunks as it is first written.  "
+	  "Fail WRITEs needing more than VALUE of it in all, allowing "
+	  "RAM LUNs larger than memory.  Default: no limit" },
+	{ "ram-pages", 1011, "SIZE", 0,
+	  "Back RAM storage with pages of SIZE: 4k; thp, for transparent "
+	  "huge pages; or 2m or 1g, for hugetlbfs pages, which must be "
+	  "reserved beforehand, eg. in /proc/sys/vm/nr_hugepages.  With "
+	  "huge pages, RAM storage is allocated a page at a time.  "
+	  "Default: 4k" },
+	{ "numa", 1012, "POLICY", 0,
+	  "Place RAM storage on NUMA node N, or spread it across all nodes "
+	  "with 'interleave'.  Default: on the node first writing to it" },
+	{ "block-size", 1013, "BYTES", 0,
+	  "Logical block size of LUNs not configured with their own: 512 "
+	  "or 4096.  Either way, 4096-byte physical blocks are reported.  "
+	  "Default: 512" },
+	{ "flush-age", 1014, "MS", 0,
+	  "Write back data written to mapped files once it has been dirty "
+	  "for MS milliseconds.  0 leaves it to the kernel.  Default: "
+	  "5000" },
+	{ "flush-dirty", 1015, "VALUE", 0,
+	  "Write back data written to mapped files once VALUE of them, "
+	  "in 1MB regions, is dirty.  0 disables.  Default: 64m" },
 	{ "trace", 'T', "TRACE-LIST", 0,
-	  "Comma-separated list of one or more of: net, iscsi, scsi, osd, all"},
+	  "Comma-separated list of one or more of: net, iscsi, scsi, osd, mem, all"},
 
 	{ }
 };
@@ -127,7 +305,7 @@ static const uint8_t def_fmt_dev_mpage[FMT_DEV_MPAGE_LEN] = {
 	FMT_DEV_MPAGE,
 	FMT_DEV_MPAGE_LEN - 2,
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	data_lba_size >> 8, data_lba_size & 0xff,
+	0, 0,		/* bytes per sector, filled in */
 	0, 0, 0, 0, 0, 0,
 	(1 << 6),	/* HSEC=1 */
 	0, 0, 0
@@ -251,6 +429,13 @@ static void scsierr_inval(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
 	scsi_cmd->length = sense_inval_field(false, buf);
 }
 
+static void scsierr_lun(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
+{
+	/* "Logical unit not supported" */
+	scsi_cmd->status = SCSI_CHECK_CONDITION;
+	scsi_cmd->length = sense_fill(false, buf, SKEY_ILLEGAL_REQUEST, 0x25, 0x0);
+}
+
 static void scsierr_opcode(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
 {
 	/* unknown SCSI opcode */
@@ -258,13 +443,70 @@ static void scsierr_opcode(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
 	scsi_cmd->length = sense_fill(false, buf, SKEY_ILLEGAL_REQUEST, 0x20, 0x0);
 }
 
-static int device_id;
+static void scsierr_space(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
+{
+	/* space allocation failed write protect */
+	scsi_cmd->status = SCSI_CHECK_CONDITION;
+	scsi_cmd->length = sense_fill(false, buf, SKEY_DATA_PROTECT, 0x27, 0x7);
+}
 
-int device_init(struct globals *a, targv_t * b, struct disc_target *c)
+static void scsierr_write(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
 {
-	return ++device_id;
+	/* write error */
+	scsi_cmd->status = SCSI_CHECK_CONDITION;
+	scsi_cmd->length = sense_fill(false, buf, SKEY_MEDIUM_ERROR, 0xc, 0x0);
+}
+
+/*
+ * LUNs below 256 are reported with peripheral device addressing, as
+ * most initiators expect, and larger ones with flat space addressing.
+ */
+static uint64_t lun_encode(uint32_t lun)
+{
+	if (lun < 256)
+		return (uint64_t) lun << 48;
+
+	return (uint64_t) (0x4000 | lun) << 48;
+}
+
+static bool lun_decode(uint64_t v, uint32_t *plun)
+{
+	if (v & 0xffffffffffffULL)	/* second level and below */
+		return false;
+
+	switch (v >> 62) {
+	case 0:			/* peripheral device, bus 0 */
+		if ((v >> 56) & 0x3f)
+			return false;
+		*plun = (v >> 48) & 0xff;
+		return true;
+	case 1:			/* flat space */
+		*plun = (v >> 48) & 0x3fff;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* the session's target's logical unit; NULL if there is no such LUN */
+static struct dev_lun *lun_find(struct target_session *sess, uint64_t v)
+{
+	lunv_t *lv = &sess->globals->tv->v[sess->d].luns;
+	uint32_t lun;
+	int i;
+
+	if (!lun_decode(v, &lun))
+		return NULL;
+
+	for (i = 0; i < lv->c; i++)
+		if (lv->v[i].lun == lun)
+			return lv->v[i].dev;
+
+	return NULL;
 }
 
+static int device_id;
+
 static void scsiop_inquiry_std(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *rbuf)
 {
 	const uint8_t versions[] = {
@@ -306,6 +548,8 @@ static void scsiop_inquiry_list(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *r
 	const uint8_t pages[] = {
 		0x00,   /* page 0x00, list of pages (this page) */
 		0x83,   /* page 0x83, device ident page */
+		0xb0,   /* page 0xb0, block limits */
+		0xb2,   /* page 0xb2, logical block provisioning */
 	};
 
 	rbuf[3] = sizeof(pages);	/* number of supported VPD pages */
@@ -315,16 +559,64 @@ static void scsiop_inquiry_list(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *r
 	scsi_cmd->input = 1;
 }
 
-static void scsiop_inquiry_devid(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
+static void scsiop_inquiry_limits(struct dev_lun *lu,
+				  struct iscsi_scsi_cmd_args *scsi_cmd,
+				  uint8_t *buf)
+{
+	uint32_t *buf32 = (uint32_t *) buf;
+	uint32_t gran;
+
+	/* RAM is released a chunk at a time, files a page at a time */
+	if (lu->dl->backend == LUN_RAM)
+		gran = (1U << lu->chunk_shift) / lu->block_size;
+	else
+		gran = PHYS_BLOCK_SIZE / lu->block_size;
+
+	buf[0] = TYPE_DISK;
+	buf[1] = 0xb0;		/* our page code */
+	buf[3] = 0x3c;		/* page length */
+
+	/* optimal transfer length granularity: a physical block */
+	buf[7] = PHYS_BLOCK_SIZE / lu->block_size;
+
+	buf32[5] = htonl(0xffffffff);		/* max UNMAP LBA count */
+	buf32[6] = htonl(UNMAP_MAX_DESC);	/* max UNMAP descriptors */
+	buf32[7] = htonl(gran);			/* optimal UNMAP granularity */
+	buf32[10] = htonl(WRITE_SAME_MAX / lu->block_size); /* max WRITE SAME */
+
+	scsi_cmd->length = 0x3c + 4;
+	scsi_cmd->input = 1;
+}
+
+static void scsiop_inquiry_lbp(struct iscsi_scsi_cmd_args *scsi_cmd,
+			       uint8_t *buf)
+{
+	buf[0] = TYPE_DISK;
+	buf[1] = 0xb2;		/* our page code */
+	buf[3] = 4;		/* page length */
+
+	/* UNMAP, WRITE SAME(16) with UNMAP, unmapped blocks read zero */
+	buf[5] = (1 << 7) | (1 << 6) | (1 << 2);
+	buf[6] = 0x2;		/* thin provisioned */
+
+	scsi_cmd->length = 4 + 4;
+	scsi_cmd->input = 1;
+}
+
+static void scsiop_inquiry_devid(struct target_session *sess,
+				 struct dev_lun *lu,
+				 struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
 {
 	uint16_t *page_len = (uint16_t *) (buf + 2);
 	uint16_t i = 4;
-	char s[64];
+	char s[256];
 
 	buf[0] = TYPE_DISK;
 	buf[1] = 0x83;		/* our page code */
 
-	sprintf(s, "%s %s", ISCSI_PRODUCT, ISCSI_FWREV);
+	/* unique across the targets and LUNs served */
+	snprintf(s, sizeof(s), "%s %s %s,%u", ISCSI_PRODUCT, ISCSI_FWREV,
+		 sess->globals->tv->v[sess->d].iqn, lu->dl->lun);
 
 	/* !PIV, LUN assoc., ASCII identifier, type=vendor-specific */
 	buf[i + 0] = INQUIRY_DEVICE_CODESET_UTF8;
@@ -345,10 +637,11 @@ static unsigned int msense_ctl_mode(uint8_t *buf)
 	return sizeof(def_control_mpage);
 }
 
-static unsigned int msense_cache(uint8_t *buf)
+static unsigned int msense_cache(struct dev_lun *lu, uint8_t *buf)
 {
 	memcpy(buf, def_cache_mpage, sizeof(def_cache_mpage));
-	if (file_map) {
+	/* both file backends complete WRITEs before they are on media */
+	if (lu->dl->backend != LUN_RAM) {
 		buf[2] = (1 << 2);	/* WCE */
 	} else {
 		buf[2] = (1 << 0);	/* RCD */
@@ -357,9 +650,11 @@ static unsigned int msense_cache(uint8_t *buf)
 	return sizeof(def_cache_mpage);
 }
 
-static unsigned int msense_fmt_dev(uint8_t *buf)
+static unsigned int msense_fmt_dev(struct dev_lun *lu, uint8_t *buf)
 {
 	memcpy(buf, def_fmt_dev_mpage, sizeof(def_fmt_dev_mpage));
+	buf[12] = lu->block_size >> 8;
+	buf[13] = lu->block_size & 0xff;
 	return sizeof(def_fmt_dev_mpage);
 }
 
@@ -375,7 +670,8 @@ static unsigned int msense_medium_types(uint8_t *buf)
 	return sizeof(def_medium_types_mpage);
 }
 
-static void scsiop_mode_sense(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *rbuf,
+static void scsiop_mode_sense(struct dev_lun *lu,
+			      struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *rbuf,
 			      bool six_byte)
 {
 	const uint8_t *scsicmd = scsi_cmd->cdb;
@@ -383,7 +679,7 @@ static void scsiop_mode_sense(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *rbu
 	const uint8_t blk_desc[] = {
 		0, 0, 0, 0,	/* number of blocks */
 		0,		/* density code */
-		0, 0x2, 0x0	/* block length: 512 bytes */
+		0, lu->block_size >> 8, lu->block_size & 0xff /* block length */
 	};
 	uint8_t pg, spg;
 	unsigned int ebd, page_control;
@@ -426,11 +722,11 @@ static void scsiop_mode_sense(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *rbu
 		break;
 
 	case FMT_DEV_MPAGE:
-		p += msense_fmt_dev(p);
+		p += msense_fmt_dev(lu, p);
 		break;
 
 	case CACHE_MPAGE:
-		p += msense_cache(p);
+		p += msense_cache(lu, p);
 		break;
 
 	case CONTROL_MPAGE:
@@ -443,8 +739,8 @@ static void scsiop_mode_sense(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *rbu
 
 	case ALL_MPAGES:
 		p += msense_rw_recovery(p);
-		p += msense_fmt_dev(p);
-		p += msense_cache(p);
+		p += msense_fmt_dev(lu, p);
+		p += msense_cache(lu, p);
 		p += msense_ctl_mode(p);
 		p += msense_medium_types(p);
 		break;
@@ -453,7 +749,7 @@ static void scsiop_mode_sense(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *rbu
 		goto invalid_fld;
 	}
 
-	dpofua = 0;
+	dpofua = 0x10;		/* DPO and FUA are honoured */
 
 	if (six_byte) {
 		rbuf[0] = p - rbuf - 1;
@@ -489,33 +785,44 @@ saving_not_supp:
 	return;
 }
 
-static void scsiop_read_cap(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf,
+static void scsiop_read_cap(struct dev_lun *lu,
+			    struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf,
 			    bool short_form)
 {
 	uint32_t *buf32 = (uint32_t *) buf;
 
 	if (short_form) {
-		buf32[0] = htonl(data_mem_lba - 1);
-		buf32[1] = htonl(data_lba_size);
+		buf32[0] = htonl(MIN(lu->n_lba - 1, 0xffffffff));
+		buf32[1] = htonl(lu->block_size);
 
 		scsi_cmd->length = 4 * 2;
 	} else {
-		*((uint64_t *)buf) = GUINT64_TO_BE((uint64_t)data_mem_lba - 1);
-		buf32[2] = htonl(data_lba_size);
+		*((uint64_t *)buf) = GUINT64_TO_BE(lu->n_lba - 1);
+		buf32[2] = htonl(lu->block_size);
+		/* logical blocks per physical block exponent */
+		buf[13] = __builtin_ctz(PHYS_BLOCK_SIZE / lu->block_size);
+		buf[14] = (1 << 7) | (1 << 6);	/* LBPME, LBPRZ */
 
-		scsi_cmd->length = 4 * 3;
+		scsi_cmd->length = 32;
 	}
 
 	scsi_cmd->input = 1;
 }
 
-static void scsiop_report_luns(struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
+static void scsiop_report_luns(struct target_session *sess,
+			       struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
 {
+	lunv_t *lv = &sess->globals->tv->v[sess->d].luns;
 	uint32_t *buf32 = (uint32_t *) buf;
+	uint64_t *luns = (uint64_t *) (buf + 8);
+	int i;
 
-	*buf32 = htonl(1 * 8);		/* one LUN, whose value is zero */
+	*buf32 = htonl(lv->c * 8);
 
-	scsi_cmd->length = 8 + (1 * 8);
+	for (i = 0; i < lv->c; i++)
+		luns[i] = GUINT64_TO_BE(lun_encode(lv->v[i].lun));
+
+	scsi_cmd->length = 8 + (lv->c * 8);
 	scsi_cmd->input = 1;
 }
 
@@ -539,15 +846,12 @@ err_out:
 	scsierr_inval(scsi_cmd, buf);
 }
 
-static void scsiop_data_xfer(struct target_session *sess,
-			     struct target_cmd *tc,
-			     struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf,
-			     bool is_write, int byte_size)
+/* a READ/WRITE CDB's LBA range; false if out of range */
+static bool scsi_xfer_range(struct dev_lun *lu, const uint8_t *cdb,
+			    int byte_size, uint64_t *plba, uint32_t *plen)
 {
-	const uint8_t *cdb = scsi_cmd->cdb;
 	uint64_t lba = 0;
 	uint32_t len = 0;
-	void *mem;
 
 	switch (byte_size) {
 	case 6:		scsi_6_lba_len(cdb, &lba, &len); break;
@@ -555,219 +859,1668 @@ static void scsiop_data_xfer(struct target_session *sess,
 	case 16:	scsi_16_lba_len(cdb, &lba, &len); break;
 	}
 
-	if ((len > data_mem_lba) ||
-	    ((lba + len) > data_mem_lba) ||
+	if ((len > lu->n_lba) ||
+	    ((lba + len) > lu->n_lba) ||
 	    ((lba + len) < lba))
-		goto err_out;
+		return false;
 
-	mem = data_mem + (lba * data_lba_size);
+	*plba = lba;
+	*plen = len;
+	return true;
+}
 
-	if (is_write) {
-		scsi_cmd->output = 1;
-		scsi_cmd->recv_data = mem;
+/* map a READ/WRITE CDB's LBA range onto the LUN; NULL if out of range */
+static void *scsi_xfer_mem(struct dev_lun *lu, const uint8_t *cdb,
+			   int byte_size, uint32_t *plen)
+{
+	uint64_t lba;
+	uint32_t len;
 
-		if (target_transfer_data(sess, scsi_cmd) < 0)
-			goto err_out;	/* FIXME: improve err-case sense */
-		if (!sess->want_data_pdu && (device_commit(sess, tc) < 0))
-			goto err_out;	/* FIXME: improve err-case sense */
-	} else {
-		scsi_cmd->input = 1;
-		scsi_cmd->send_data = mem;
-	}
+	if (!scsi_xfer_range(lu, cdb, byte_size, &lba, &len))
+		return NULL;
 
-	return;
+	if (plen)
+		*plen = len;
 
-err_out:
-	scsierr_inval(scsi_cmd, buf);
+	return lu->mem + (lba * lu->block_size);
 }
 
-static void scsiop_sync_cache(struct target_session *sess,
-			     struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
+/*
+ * RAM LUNs are anonymous mappings, so that a chunk costs memory only
+ * once written; until then it reads as zeros.  Chunks are counted
+ * against --ram-limit as WRITEs first reach them.  Event loops and
+ * storage threads may race here, so the map and total are atomic.
+ */
+static bool ram_alloc(struct dev_lun *lu, uint64_t lba, uint64_t len)
 {
-	const uint8_t *cdb = scsi_cmd->cdb;
-	bool immed = cdb[1] & (1 << 1);		/* IMMED bit */
+	uint64_t c, last, bit, old, size = 1ULL << lu->chunk_shift;
+	uint64_t *word;
 
-	/* if RAM-only, nothing to do */
-	if (!file_map)
-		return;
+	if ((lu->dl->backend != LUN_RAM) || !len)
+		return true;
 
-	if (msync(file_map, file_map_size, immed ? MS_ASYNC : MS_SYNC) == 0)
-		return;
+	c = (lba * lu->block_size) >> lu->chunk_shift;
+	last = ((lba + len) * lu->block_size - 1) >> lu->chunk_shift;
 
-	iscsi_trace_error(__FILE__, __LINE__,
-			  "msync failed: %s\n",
-			  strerror(errno));
+	for (; c <= last; c++) {
+		word = &lu->chunk_map[c / 64];
+		bit = 1ULL << (c % 64);
 
-	scsi_cmd->status = SCSI_CHECK_CONDITION;
-	scsi_cmd->length = sense_fill(false, buf,
-				      SKEY_MEDIUM_ERROR, 0xc, 0x2);
-				      /* write error - auto realloc failed */
+		if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+			continue;
+
+		if (__atomic_add_fetch(&ram_used, size,
+				       __ATOMIC_RELAXED) > ram_limit &&
+		    ram_limit) {
+			__atomic_sub_fetch(&ram_used, size, __ATOMIC_RELAXED);
+			return false;
+		}
+
+		old = __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+		if (old & bit)		/* lost a race; already counted */
+			__atomic_sub_fetch(&ram_used, size, __ATOMIC_RELAXED);
+	}
+
+	return true;
 }
 
-int device_commit(struct target_session *sess, struct target_cmd *tc)
+static bool ram_chunk_written(struct dev_lun *lu, uint64_t c)
 {
-	int i;
-	struct iscsi_scsi_cmd_args *scsi_cmd = tc->scsi_cmd;
-	void *p = scsi_cmd->recv_data;
+	return __atomic_load_n(&lu->chunk_map[c / 64], __ATOMIC_RELAXED) &
+	       (1ULL << (c % 64));
+}
+
+/* zero [start, end) of a RAM LUN, skipping chunks never written */
+static void ram_zero(struct dev_lun *lu, uint64_t start, uint64_t end)
+{
+	uint64_t next;
 
-	for (i = 0; i < sess->n_iov; i++) {
-		struct iovec *iov;
+	for (; start < end; start = next) {
+		next = MIN(((start >> lu->chunk_shift) + 1) << lu->chunk_shift,
+			   end);
+		if (ram_chunk_written(lu, start >> lu->chunk_shift))
+			memset(lu->mem + start, 0, next - start);
+	}
+}
+
+/*
+ * Give back the memory behind bytes [off, off+len) of a RAM LUN, which
+ * reads as zeros again.  Whole chunks are released; the ends of the
+ * range, within partly covered chunks, are zeroed.
+ */
+static int ram_release(struct dev_lun *lu, uint64_t off, uint64_t len)
+{
+	uint64_t size = lu->n_lba * lu->block_size, end = off + len;
+	unsigned int shift = lu->chunk_shift;
+	uint64_t c, c_end, bit, n = 0;
+	uint64_t *word;
 
-		iov = &sess->iov[i];
-		memcpy(p, iov->iov_base, iov->iov_len);
-		p += iov->iov_len;
+	c = (off + (1ULL << shift) - 1) >> shift;
+	c_end = (end == size) ? lu->n_chunks : end >> shift;
 
-		free(iov->iov_base);
+	if (c >= c_end) {
+		ram_zero(lu, off, end);
+		return 0;
 	}
 
-	scsi_cmd->recv_data = NULL;
-	sess->n_iov = 0;
+	ram_zero(lu, off, c << shift);
+	ram_zero(lu, MIN(c_end << shift, end), end);
+
+	if (madvise(lu->mem + (c << shift), (c_end - c) << shift,
+		    MADV_DONTNEED) < 0)
+		return -1;
+
+	for (; c < c_end; c++) {
+		word = &lu->chunk_map[c / 64];
+		bit = 1ULL << (c % 64);
+
+		if (__atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED) & bit)
+			n++;
+	}
+	__atomic_sub_fetch(&ram_used, n << shift, __ATOMIC_RELAXED);
 
 	return 0;
 }
 
-int device_command(struct target_session *sess, struct target_cmd *tc)
+/*
+ * Deallocate a range of blocks, which read as zeros afterwards.  Files
+ * have a hole punched, or where the file system cannot, are zeroed.
+ * Memory backends have the range claimed by the caller.
+ */
+static int lun_unmap(struct dev_lun *lu, uint64_t lba, uint64_t n)
 {
-	struct iscsi_scsi_cmd_args *scsi_cmd = tc->scsi_cmd;
-	const uint8_t *cdb = scsi_cmd->cdb;
-	uint8_t *buf;
-	bool is_write;
+	off_t off = lba * lu->block_size, len = n * lu->block_size;
 
-	switch (cdb[0]) {
-	case WRITE_6:
-	case WRITE_10:
-	case WRITE_16:
-		is_write = true;
-		break;
+	if (!n)
+		return 0;
 
-	default:
-		is_write = false;
-		break;
+	if (lu->dl->backend == LUN_RAM)
+		return ram_release(lu, off, len);
+
+	if (fallocate(lu->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      off, len) == 0)
+		return 0;
+	if (errno != EOPNOTSUPP)
+		return -1;
+
+	if (lu->dl->backend == LUN_MAP) {
+		memset(lu->mem + off, 0, len);
+		return 0;
 	}
 
-	scsi_cmd->status = SCSI_SUCCESS;
+	return fallocate(lu->fd, FALLOC_FL_ZERO_RANGE, off, len);
+}
 
-	if (!is_write)
-		scsi_cmd->length = 0;
+/* WRITE SAME: write one block of data over a range of blocks */
+static int lun_fill(struct dev_lun *lu, uint64_t lba, uint64_t n,
+		    const uint8_t *block)
+{
+	uint8_t *p;
+	uint64_t i;
+	size_t len;
+	off_t off;
+
+	if (lu->dl->backend != LUN_DIRECT) {
+		for (i = 0; i < n; i++)
+			memcpy(lu->mem + (lba + i) * lu->block_size, block,
+			       lu->block_size);
+		return 0;
+	}
 
-	scsi_cmd->send_data = buf = sess->outbuf;
+	if (posix_memalign((void **) &p, URING_ALIGN, RAM_CHUNK_SIZE))
+		return -1;
+	for (i = 0; i < RAM_CHUNK_SIZE / lu->block_size; i++)
+		memcpy(p + i * lu->block_size, block, lu->block_size);
+
+	off = lba * lu->block_size;
+	for (; n; n -= len / lu->block_size, off += len) {
+		len = MIN(n * lu->block_size, RAM_CHUNK_SIZE);
+		if (pwrite(lu->fd, p, len, off) != len) {
+			free(p);
+			return -1;
+		}
+	}
 
-	memset(buf, 0, sizeof(sess->outbuf));
+	free(p);
+	return 0;
+}
 
-	switch (cdb[0]) {
-	case FORMAT_UNIT:
-		/* format, iff FMTDATA, CMPLST and defect list format == 0 */
-		if ((cdb[1] & 0x1f) == 0)
-			memset(data_mem, 0, data_mem_lba * data_lba_size);
-		else
-			scsierr_inval(scsi_cmd, buf);
-		break;
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
 
-	case INQUIRY:
-		if (cdb[1] & (1 << 1))			/* CmdDt set? */
-			scsierr_inval(scsi_cmd, buf);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-		else if (!(cdb[1] & (1 << 0)))		/* EVPD clear? */
-			scsiop_inquiry_std(scsi_cmd, buf);
+/*
+ * File LUNs note which regions have been written since last synced, so
+ * that SYNCHRONIZE CACHE, and the flusher, write back only those.  A region is marked once
+ * the write has completed: a flush that clears the bit cannot then miss
+ * the data, and a write completing after the bit is cleared sets it
+ * again.
+ */
+static void lun_dirty(struct dev_lun *lu, uint64_t off, uint64_t len)
+{
+	uint64_t r, last, bit;
+	uint64_t *word;
 
-		else
-			switch (cdb[2]) {		/* EVPD page */
-			case 0x00:	scsiop_inquiry_list(scsi_cmd, buf); break;
-			case 0x83:	scsiop_inquiry_devid(scsi_cmd, buf); break;
-			default:	scsierr_inval(scsi_cmd, buf); break;
-			}
-		break;
+	if (!lu->dirty_map || !len)
+		return;
 
-	case MAINTENANCE_IN:
-		switch (cdb[1] & 0x1f) {	/* service action */
-		case SAI_SUPPORTED_TMF:
-			scsiop_supported_tmf(scsi_cmd, buf);
-			break;
+	r = off >> DIRTY_SHIFT;
+	last = (off + len - 1) >> DIRTY_SHIFT;
 
-		default:
-			scsierr_opcode(scsi_cmd, buf);
-			break;
-		}
-		break;
+	for (; r <= last; r++) {
+		word = &lu->dirty_map[r / 64];
+		bit = 1ULL << (r % 64);
 
-	case MODE_SELECT_6:
-	case MODE_SELECT_10:
-		/* unconditionally return invalid-field-in-CDB */
-		scsierr_inval(scsi_cmd, buf);
-		break;
+		if ((__atomic_load_n(word, __ATOMIC_ACQUIRE) & bit) ||
+		    (__atomic_fetch_or(word, bit, __ATOMIC_RELEASE) & bit))
+			continue;
 
-	case MODE_SENSE:
-		scsiop_mode_sense(scsi_cmd, buf, true);
-		break;
+		if (!__atomic_fetch_add(&lu->n_dirty, 1, __ATOMIC_RELAXED))
+			__atomic_store_n(&lu->dirty_since, now_ns(),
+					 __ATOMIC_RELAXED);
+	}
+}
 
-	case MODE_SENSE_10:
-		scsiop_mode_sense(scsi_cmd, buf, false);
-		break;
+/*
+ * Narrow bytes [*poff, *poff+*plen) to span the regions written since
+ * last synced, or still being written back by another flush; syncing
+ * those waits for that writeback.  False if there are none.
+ */
+static bool lun_flush_span(struct dev_lun *lu, uint64_t *poff,
+			   uint64_t *plen)
+{
+	uint64_t size = lu->n_lba * lu->block_size;
+	uint64_t off = *poff, end = off + *plen;
+	uint64_t r, last, bit, start, stop;
+	uint64_t first = end, final = off;
 
-	case READ_CAPACITY:
-		scsiop_read_cap(scsi_cmd, buf, true);
-		break;
+	if (!*plen)
+		return false;
 
-	case REPORT_LUNS:
-		scsiop_report_luns(scsi_cmd, buf);
-		break;
+	r = off >> DIRTY_SHIFT;
+	last = (end - 1) >> DIRTY_SHIFT;
 
-	case REQUEST_SENSE:
-		scsi_cmd->length = sense_fill(cdb[1] & (1 << 0), buf, 0, 0, 0);
-		scsi_cmd->input = 1;
-		break;
+	for (; r <= last; r++) {
+		bit = 1ULL << (r % 64);
 
-	case SEEK_10:
-		/* provided a valid range, seek is a no-op */
-		if (scsi_d32(cdb + 2) >= data_mem_lba)
-			scsierr_inval(scsi_cmd, buf);
-		break;
+		/* a flush marks its regions in flight, then clean */
+		if (!(__atomic_load_n(&lu->dirty_map[r / 64],
+				      __ATOMIC_ACQUIRE) & bit) &&
+		    !__atomic_load_n(&lu->flushing[r], __ATOMIC_ACQUIRE))
+			continue;
 
-	case SEND_DIAGNOSTIC:
-		/* default test immediately succeeds. all others invalid. */
-		if (scsi_d16(cdb + 3) || !(cdb[1] & (1 << 2)))
-			scsierr_inval(scsi_cmd, buf);
-		break;
+		start = r << DIRTY_SHIFT;
+		stop = MIN(start + (1ULL << DIRTY_SHIFT), size);
+		first = MIN(first, MAX(start, off));
+		final = MIN(stop, end);
+	}
 
-	case SERVICE_ACTION_IN:
-		switch (cdb[1] & 0x1f) {	/* service action */
-		case SAI_READ_CAPACITY_16:
-			scsiop_read_cap(scsi_cmd, buf, false);
-			break;
+	if (first >= final)
+		return false;
 
-		default:
-			scsierr_opcode(scsi_cmd, buf);
-			break;
-		}
-		break;
+	*poff = first;
+	*plen = final - first;
+	return true;
+}
 
-	case SYNC_CACHE:
+/*
+ * Start flushing a range: narrow it as lun_flush_span() does, and mark
+ * the regions wholly within it clean, but in flight until the flush
+ * ends.  Meanwhile, other flushes of the range wait on this one, and
+ * writes completing mark their regions dirty again.
+ */
+static bool lun_flush_begin(struct dev_lun *lu, uint64_t *poff,
+			    uint64_t *plen)
+{
+	uint64_t size = lu->n_lba * lu->block_size;
+	uint64_t r, last, bit, start, stop, end;
+
+	if (!lun_flush_span(lu, poff, plen))
+		return false;
+
+	end = *poff + *plen;
+	r = *poff >> DIRTY_SHIFT;
+	last = (end - 1) >> DIRTY_SHIFT;
+
+	for (; r <= last; r++) {
+		start = r << DIRTY_SHIFT;
+		stop = MIN(start + (1ULL << DIRTY_SHIFT), size);
+		if ((start < *poff) || (stop > end))
+			continue;
+
+		bit = 1ULL << (r % 64);
+		__atomic_add_fetch(&lu->flushing[r], 1, __ATOMIC_RELEASE);
+		if (__atomic_fetch_and(&lu->dirty_map[r / 64], ~bit,
+				       __ATOMIC_ACQ_REL) & bit)
+			__atomic_sub_fetch(&lu->n_dirty, 1, __ATOMIC_RELAXED);
+	}
+
+	return true;
+}
+
+/* the flush of a range begun is done; unless ok, it is dirty again */
+static void lun_flush_end(struct dev_lun *lu, uint64_t off, uint64_t len,
+			  bool ok)
+{
+	uint64_t size = lu->n_lba * lu->block_size;
+	uint64_t r, last, start, stop, end = off + len;
+
+	if (!ok)
+		lun_dirty(lu, off, len);
+
+	r = off >> DIRTY_SHIFT;
+	last = (end - 1) >> DIRTY_SHIFT;
+
+	for (; r <= last; r++) {
+		start = r << DIRTY_SHIFT;
+		stop = MIN(start + (1ULL << DIRTY_SHIFT), size);
+		if ((start >= off) && (stop <= end))
+			__atomic_sub_fetch(&lu->flushing[r], 1,
+					   __ATOMIC_RELEASE);
+	}
+}
+
+/* SYNCHRONIZE CACHE: the bytes to flush; false if out of range */
+static bool sync_cache_range(struct dev_lun *lu, const uint8_t *cdb,
+			     uint64_t *poff, uint64_t *plen)
+{
+	uint64_t lba;
+	uint32_t n;
+
+	if (cdb[0] == SYNC_CACHE_16)
+		scsi_16_lba_len(cdb, &lba, &n);
+	else
+		scsi_10_lba_len(cdb, &lba, &n);
+
+	if ((lba > lu->n_lba) || (n > lu->n_lba - lba))
+		return false;
+	if (!n)			/* to the last block */
+		n = lu->n_lba - lba;
+
+	*poff = lba * lu->block_size;
+	*plen = (uint64_t) n * lu->block_size;
+	return true;
+}
+
+/* CDB length of a WRITE; 0 if not a WRITE */
+static int scsi_write_cdb_len(uint8_t op)
+{
+	switch (op) {
+	case WRITE_6:	return 6;
+	case WRITE_10:	return 10;
+	case WRITE_16:	return 16;
+	default:	return 0;
+	}
+}
+
+enum {
+	CDB_FUA		= 1 << 3,	/* READ/WRITE(10/16) byte 1 */
+	CDB_DPO		= 1 << 4,
+};
+
+/* the FUA and DPO bits of a READ or WRITE; the 6-byte CDBs have none */
+static uint8_t scsi_cache_bits(const uint8_t *cdb)
+{
+	switch (cdb[0]) {
+	case READ_10:
+	case READ_16:
+	case WRITE_10:
+	case WRITE_16:
+		return cdb[1] & (CDB_FUA | CDB_DPO);
+	default:
+		return 0;
+	}
+}
+
+/* write bytes [off, off+len) of a mapped file through to the medium */
+static int lun_msync(struct dev_lun *lu, uint64_t off, uint64_t len)
+{
+	uint64_t pg = getpagesize();
+
+	len += off & (pg - 1);
+	off &= ~(pg - 1);
+
+	return msync(lu->mem + off, len, MS_SYNC);
+}
+
+/* DPO: bytes [off, off+len) of a mapped file are first to be evicted */
+static void lun_cold(struct dev_lun *lu, uint64_t off, uint64_t len)
+{
+	uint64_t pg = getpagesize();
+
+	len += off & (pg - 1);
+	off &= ~(pg - 1);
+
+	madvise(lu->mem + off, len, MADV_COLD);
+}
+
+static int dev_buf_get(struct dev_ring *dr, struct target_io *io,
+		       uint32_t len)
+{
+	io->buf_len = len;
+
+	if ((len <= URING_BUF_SIZE) && dr->n_buf_free) {
+		io->buf_index = dr->buf_free[--dr->n_buf_free];
+		io->buf = dr->bufs + (size_t) io->buf_index * URING_BUF_SIZE;
+		return 0;
+	}
+
+	io->buf_index = -1;
+	if (posix_memalign(&io->buf, URING_ALIGN, len)) {
+		io->buf = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void dev_buf_put(struct dev_ring *dr, struct target_io *io)
+{
+	if (io->buf_index >= 0)
+		dr->buf_free[dr->n_buf_free++] = io->buf_index;
+	else
+		free(io->buf);
+
+	io->buf = NULL;
+}
+
+/* the task is done with its staging buffer */
+static void dev_ring_release(struct target_cmd *tc)
+{
+	struct target_io *io = &tc->task->io;
+
+	dev_buf_put(io->sess->worker->dev, io);
+}
+
+static void dev_ring_sqe_file(struct dev_ring *dr, struct dev_lun *lu,
+			      struct io_uring_sqe *sqe)
+{
+	if (dr->fixed_file && (lu->dl->backend == LUN_DIRECT)) {
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = lu->file_index;
+	} else {
+		sqe->fd = lu->fd;
+	}
+}
+
+/*
+ * Queue a READ into, or a WRITE of parked data from, a staging buffer.
+ * It is submitted by device_flush(), along with everything else queued
+ * while handling the same socket event.
+ */
+static int dev_ring_rw(struct target_session *sess, struct dev_lun *lu,
+		       struct target_cmd *tc, bool is_write, uint64_t off,
+		       uint32_t len)
+{
+	struct dev_ring *dr = sess->worker->dev;
+	struct target_task *task = tc->task;
+	struct target_io *io = &task->io;
+	struct io_uring_sqe *sqe;
+	unsigned int i;
+
+	if (dev_buf_get(dr, io, len) < 0)
+		return -1;
+
+	sqe = uring_get_sqe(&dr->ring);
+	if (!sqe) {
+		dev_buf_put(dr, io);
+		return -1;
+	}
+
+	if (is_write) {
+		for (i = 0; i < task->n_parked; i++) {
+			struct target_seg *seg = &task->parked[i];
+
+			memcpy(io->buf + seg->off, seg->base, seg->len);
+		}
+	} else {
+		tc->scsi_cmd->send_data = io->buf;
+	}
+
+	if (dr->fixed_bufs && (io->buf_index >= 0)) {
+		sqe->opcode = is_write ? IORING_OP_WRITE_FIXED :
+					 IORING_OP_READ_FIXED;
+		sqe->buf_index = 0;
+	} else {
+		sqe->opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	dev_ring_sqe_file(dr, lu, sqe);
+	sqe->addr = (uintptr_t) io->buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = (uintptr_t) io;
+
+	/* FUA: the write completes once on the medium */
+	if (is_write && (scsi_cache_bits(tc->scsi_cmd->cdb) & CDB_FUA))
+		sqe->rw_flags = RWF_DSYNC;
+
+	target_io_begin(sess, tc, dev_ring_release);
+
+	return 0;
+}
+
+/*
+ * Queue an fsync of bytes [off, off+len) of a file LUN, direct or
+ * mapped; unless waited for, the command completes right away.
+ */
+static int dev_ring_fsync(struct target_session *sess, struct dev_lun *lu,
+			  struct target_cmd *tc, uint64_t off, uint64_t len,
+			  bool wait)
+{
+	struct dev_ring *dr = sess->worker->dev;
+	struct target_io *io = &tc->task->io;
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&dr->ring);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_FSYNC;
+	dev_ring_sqe_file(dr, lu, sqe);
+	sqe->off = off;
+	sqe->len = (len > UINT32_MAX) ? 0 : len;	/* 0: to the end */
+
+	if (wait) {
+		io->buf_len = 0;
+		io->off = off;
+		io->len = len;
+		sqe->user_data = (uintptr_t) io;
+		target_io_begin(sess, tc, NULL);
+	}
+
+	return 0;
+}
+
+/* a WRITE has completed, or its FUA flush failed: note it as dirty */
+static void dev_ring_dirty(struct target_io *io)
+{
+	struct iscsi_scsi_cmd_args *scsi_cmd = &io->cmd.task->scsi_cmd;
+	int cdb_len = scsi_write_cdb_len(scsi_cmd->cdb[0]);
+	struct dev_lun *lu;
+	uint64_t lba;
+	uint32_t n;
+
+	lu = lun_find(io->sess, scsi_cmd->lun);
+	if (lu && cdb_len &&
+	    scsi_xfer_range(lu, scsi_cmd->cdb, cdb_len, &lba, &n))
+		lun_dirty(lu, lba * lu->block_size, scsi_cmd->trans_len);
+}
+
+static void dev_fill_cqe(struct target_io *io, int res);
+
+static void dev_ring_cqe(void *data, uint64_t user_data, int res,
+			 uint32_t flags)
+{
+	struct target_io *io = (struct target_io *)(uintptr_t) user_data;
+	struct iscsi_scsi_cmd_args *scsi_cmd;
+	struct dev_lun *lu;
+	bool is_sync, fua, ok;
+
+	if (!io) {
+		if (res < 0)
+			iscsi_trace_error(__FILE__, __LINE__,
+					  "io_uring fsync failed: %s\n",
+					  strerror(-res));
+		return;
+	}
+
+	scsi_cmd = &io->cmd.task->scsi_cmd;
+	if ((scsi_cmd->cdb[0] == UNMAP) || (scsi_cmd->cdb[0] == WRITE_SAME_16)) {
+		dev_fill_cqe(io, res);
+		return;
+	}
+
+	is_sync = (scsi_cmd->cdb[0] == SYNC_CACHE) ||
+		  (scsi_cmd->cdb[0] == SYNC_CACHE_16);
+	fua = scsi_cache_bits(scsi_cmd->cdb) & CDB_FUA;
+	ok = (res >= 0) && ((uint32_t) res == io->buf_len);
+
+	if (!ok) {
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "io_uring op 0x%x failed: %s\n",
+				  scsi_cmd->cdb[0],
+				  res < 0 ? strerror(-res) : "short transfer");
+
+		scsi_cmd->status = SCSI_CHECK_CONDITION;
+		if (scsi_cmd->input)	/* unrecovered read error */
+			scsi_cmd->length = sense_fill(false, io->sense,
+						      SKEY_MEDIUM_ERROR,
+						      0x11, 0x0);
+		else			/* write error */
+			scsi_cmd->length = sense_fill(false, io->sense,
+						      SKEY_MEDIUM_ERROR,
+						      0xc, 0x0);
+		scsi_cmd->send_data = io->sense;
+
+		if (fua)
+			dev_ring_dirty(io);
+	} else if (!scsi_cmd->input && !is_sync && !fua) {
+		dev_ring_dirty(io);
+	}
+
+	if (is_sync && (lu = lun_find(io->sess, scsi_cmd->lun)))
+		lun_flush_end(lu, io->off, io->len, ok);
+
+	target_io_end(io);
+}
+
+static void dev_ring_event(int fd, short events, void *userdata)
+{
+	struct dev_ring *dr = userdata;
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		iscsi_trace_error(__FILE__, __LINE__, "eventfd read: %s\n",
+				  strerror(errno));
+
+	uring_reap(&dr->ring, dev_ring_cqe, dr);
+}
+
+void device_flush(struct target_worker *w)
+{
+	struct dev_ring *dr = w->dev;
+	int rc;
+
+	if (!dr || !uring_queued(&dr->ring))
+		return;
+
+	rc = uring_submit(&dr->ring, 0);
+	if (rc < 0)
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "io_uring_enter failed: %s\n",
+				  strerror(-rc));
+}
+
+void device_io_wait(struct target_worker *w)
+{
+	struct dev_ring *dr = w->dev;
+	int rc;
+
+	if (!dr)
+		return;
+
+	rc = uring_submit(&dr->ring, 1);
+	if (rc < 0)
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "io_uring_enter failed: %s\n",
+				  strerror(-rc));
+
+	uring_reap(&dr->ring, dev_ring_cqe, dr);
+}
+
+/* storage thread: fault READ data in, for the event loop to send */
+static void device_io_read(struct target_cmd *tc)
+{
+	struct iscsi_scsi_cmd_args *scsi_cmd = tc->scsi_cmd;
+	const volatile uint8_t *p = scsi_cmd->send_data;
+	size_t pgsz = getpagesize();
+	uintptr_t start = (uintptr_t) p & ~(pgsz - 1);
+	size_t off, len = scsi_cmd->trans_len;
+
+	if (!len)
+		return;
+
+	madvise((void *) start, (uintptr_t) p + len - start, MADV_WILLNEED);
+
+	for (off = 0; off < len; off += pgsz)
+		(void) p[off];
+	(void) p[len - 1];
+}
+
+/*
+ * --io-uring: the transfer starts at the CDB's LBA and, as with the
+ * memory backends, is trans_len long.  O_DIRECT needs whole blocks.
+ */
+static bool ring_xfer_range(struct dev_lun *lu, const uint8_t *cdb,
+			    int byte_size, uint64_t trans_len, uint64_t *poff)
+{
+	uint64_t lba;
+	uint32_t len;
+
+	if (!scsi_xfer_range(lu, cdb, byte_size, &lba, &len) ||
+	    (trans_len % lu->block_size) ||
+	    (lba + trans_len / lu->block_size > lu->n_lba))
+		return false;
+
+	*poff = lba * lu->block_size;
+	return true;
+}
+
+static void scsiop_ring_xfer(struct target_session *sess, struct dev_lun *lu,
+			     struct target_cmd *tc,
+			     struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf,
+			     bool is_write, int byte_size)
+{
+	uint64_t off;
+
+	if (!ring_xfer_range(lu, scsi_cmd->cdb, byte_size, scsi_cmd->trans_len,
+			     &off))
+		goto err_out;
+
+	if (is_write) {
+		scsi_cmd->output = 1;
+		scsi_cmd->recv_data = NULL;	/* never received in place */
+
+		if (target_transfer_data(sess, tc) < 0)
+			goto err_out;	/* FIXME: improve err-case sense */
+		if (!tc->task->want_data_pdu && (device_commit(sess, tc) < 0))
+			goto err_out;	/* FIXME: improve err-case sense */
+	} else {
+		scsi_cmd->input = 1;
+
+		if (scsi_cmd->trans_len &&
+		    (dev_ring_rw(sess, lu, tc, false, off,
+				 scsi_cmd->trans_len) < 0))
+			goto err_out;
+	}
+
+	return;
+
+err_out:
+	scsierr_inval(scsi_cmd, buf);
+}
+
+static void scsiop_data_xfer(struct target_session *sess, struct dev_lun *lu,
+			     struct target_cmd *tc,
+			     struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf,
+			     bool is_write, int byte_size)
+{
+	uint64_t lba;
+	uint32_t len;
+	void *mem;
+
+	if (lu->dl->backend == LUN_DIRECT) {
+		scsiop_ring_xfer(sess, lu, tc, scsi_cmd, buf, is_write,
+				 byte_size);
+		return;
+	}
+
+	if (!scsi_xfer_range(lu, scsi_cmd->cdb, byte_size, &lba, &len))
+		goto err_out;
+	mem = lu->mem + (lba * lu->block_size);
+
+	if (is_write) {
+		if (!ram_alloc(lu, lba, len)) {
+			scsierr_space(scsi_cmd, buf);
+			return;
+		}
+
+		scsi_cmd->output = 1;
+		scsi_cmd->recv_data = mem;
+
+		if (target_transfer_data(sess, tc) < 0)
+			goto err_out;	/* FIXME: improve err-case sense */
+		if (!tc->task->want_data_pdu && (device_commit(sess, tc) < 0))
+			goto err_out;	/* FIXME: improve err-case sense */
+	} else {
+		scsi_cmd->input = 1;
+		scsi_cmd->send_data = mem;
+		tc->send_ref = true;
+
+		if (opt_sendfile && (lu->dl->backend == LUN_MAP)) {
+			tc->send_file = true;
+			tc->send_fd = lu->fd;
+			tc->send_off = mem - (void *) lu->mem;
+		}
+
+		if ((lu->dl->backend == LUN_MAP) && scsi_cmd->trans_len &&
+		    (scsi_cache_bits(scsi_cmd->cdb) & CDB_DPO))
+			lun_cold(lu, mem - (void *) lu->mem,
+				 scsi_cmd->trans_len);
+
+		if (gbls.n_io_threads)
+			target_io_submit(sess, tc, device_io_read);
+	}
+
+	return;
+
+err_out:
+	scsierr_inval(scsi_cmd, buf);
+}
+
+/*
+ * Flush what has been written to a mapped file within the CDB's range.
+ * With IMMED, writeback is only started, by sync_file_range(2) since
+ * msync(MS_ASYNC) does nothing; the regions stay dirty for a later
+ * SYNCHRONIZE CACHE to wait on.
+ */
+static void scsi_sync_cache(struct dev_lun *lu,
+			    struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
+{
+	const uint8_t *cdb = scsi_cmd->cdb;
+	bool immed = cdb[1] & (1 << 1);		/* IMMED bit */
+	uint64_t off, len;
+
+	if (!sync_cache_range(lu, cdb, &off, &len))
+		return;
+	if (immed) {
+		if (sync_file_range(lu->fd, off, len, SYNC_FILE_RANGE_WRITE))
+			iscsi_trace_warning(__FILE__, __LINE__,
+					    "sync_file_range failed: %s\n",
+					    strerror(errno));
+		return;
+	}
+	if (!lun_flush_begin(lu, &off, &len))
+		return;
+
+	if (lun_msync(lu, off, len) == 0) {
+		lun_flush_end(lu, off, len, true);
+		return;
+	}
+
+	iscsi_trace_error(__FILE__, __LINE__,
+			  "msync failed: %s\n",
+			  strerror(errno));
+	lun_flush_end(lu, off, len, false);
+
+	scsi_cmd->status = SCSI_CHECK_CONDITION;
+	scsi_cmd->length = sense_fill(false, buf,
+				      SKEY_MEDIUM_ERROR, 0xc, 0x2);
+				      /* write error - auto realloc failed */
+}
+
+/* storage thread: sense data goes to the task, not the shared outbuf */
+static void device_io_sync(struct target_cmd *tc)
+{
+	struct dev_lun *lu = lun_find(tc->task->io.sess, tc->scsi_cmd->lun);
+
+	scsi_sync_cache(lu, tc->scsi_cmd, tc->task->io.sense);
+}
+
+/*
+ * Only the regions of the range written since last synced, or being
+ * written back, are flushed, off the event loop: by an io_uring fsync
+ * of the span they cover, or else on a storage thread.  Unless IMMED,
+ * the response waits for it; with IMMED, the regions stay dirty, since
+ * the fsync's outcome goes unseen.
+ */
+static void scsiop_sync_cache(struct target_session *sess, struct dev_lun *lu,
+			      struct target_cmd *tc,
+			      struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
+{
+	bool immed = scsi_cmd->cdb[1] & (1 << 1);	/* IMMED bit */
+	uint64_t off, len;
+
+	if (!sync_cache_range(lu, scsi_cmd->cdb, &off, &len)) {
+		scsierr_inval(scsi_cmd, buf);
+		return;
+	}
+
+	/* if RAM-only, nothing to do */
+	if (lu->dl->backend == LUN_RAM)
+		return;
+
+	if (sess->worker->dev && immed) {
+		if (lun_flush_span(lu, &off, &len) &&
+		    (dev_ring_fsync(sess, lu, tc, off, len, false) < 0))
+			scsierr_inval(scsi_cmd, buf);
+		return;
+	}
+	if (sess->worker->dev) {
+		if (!lun_flush_begin(lu, &off, &len))
+			return;
+		if (dev_ring_fsync(sess, lu, tc, off, len, true) < 0) {
+			lun_flush_end(lu, off, len, false);
+			scsierr_inval(scsi_cmd, buf);
+		}
+		return;
+	}
+
+	if (gbls.n_io_threads) {
+		scsi_cmd->send_data = tc->task->io.sense;
+		target_io_submit(sess, tc, device_io_sync);
+	} else {
+		scsi_sync_cache(lu, scsi_cmd, buf);
+	}
+}
+
+/*
+ * UNMAP and WRITE SAME take a parameter list or a block of data, which
+ * is received into parked segments before device_commit() runs them.
+ */
+static void scsiop_param_xfer(struct target_session *sess,
+			      struct target_cmd *tc,
+			      struct iscsi_scsi_cmd_args *scsi_cmd,
+			      uint8_t *buf)
+{
+	scsi_cmd->output = 1;
+	scsi_cmd->recv_data = NULL;	/* never received in place */
+
+	if (target_transfer_data(sess, tc) < 0)
+		goto err_out;
+	if (!tc->task->want_data_pdu && (device_commit(sess, tc) < 0))
+		goto err_out;
+
+	return;
+
+err_out:
+	scsierr_inval(scsi_cmd, buf);
+}
+
+static void scsiop_unmap(struct target_session *sess, struct dev_lun *lu,
+			 struct target_cmd *tc,
+			 struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *buf)
+{
+	const uint8_t *cdb = scsi_cmd->cdb;
+
+	/* no ANCHOR; a parameter list no longer than we can take */
+	if ((cdb[1] & 0x1) || (scsi_d16(cdb + 7) > UNMAP_PARAM_MAX) ||
+	    (scsi_cmd->trans_len > UNMAP_PARAM_MAX)) {
+		scsierr_inval(scsi_cmd, buf);
+		return;
+	}
+
+	if (scsi_cmd->trans_len)
+		scsiop_param_xfer(sess, tc, scsi_cmd, buf);
+}
+
+static void scsiop_write_same(struct target_session *sess, struct dev_lun *lu,
+			      struct target_cmd *tc,
+			      struct iscsi_scsi_cmd_args *scsi_cmd,
+			      uint8_t *buf)
+{
+	const uint8_t *cdb = scsi_cmd->cdb;
+	uint64_t lba;
+	uint32_t len;
+
+	scsi_16_lba_len(cdb, &lba, &len);
+
+	/*
+	 * no ANCHOR, PBDATA or LBDATA; exactly one block of data, for no
+	 * more than the maximum length, counting a length of 0 as to the
+	 * last block
+	 */
+	if ((cdb[1] & 0x16) || (scsi_cmd->trans_len != lu->block_size) ||
+	    (lba >= lu->n_lba) || (len > lu->n_lba - lba) ||
+	    ((len ? len : lu->n_lba - lba) > WRITE_SAME_MAX / lu->block_size)) {
+		scsierr_inval(scsi_cmd, buf);
+		return;
+	}
+
+	scsiop_param_xfer(sess, tc, scsi_cmd, buf);
+}
+
+/* copy the first size bytes of a command's parked data to buf */
+static void param_gather(struct target_task *task, uint8_t *buf,
+			 uint32_t size)
+{
+	int i;
+
+	memset(buf, 0, size);
+
+	for (i = 0; i < task->n_parked; i++) {
+		struct target_seg *seg = &task->parked[i];
+
+		if (seg->base && (seg->off < size))
+			memcpy(buf + seg->off, seg->base,
+			       MIN(seg->len, size - seg->off));
+	}
+}
+
+/*
+ * On the event loop: a command parked by target_mem_claim(), its range
+ * now clear of queued READ data, tries again.
+ */
+static void device_resume(struct target_cmd *tc)
+{
+	struct target_session *sess = tc->task->io.sess;
+	struct iscsi_scsi_cmd_args *scsi_cmd = tc->scsi_cmd;
+	struct target_cmd cmd = *tc;	/* tc is in the task's io */
+	int rc;
+
+	if (scsi_cmd->cdb[0] == FORMAT_UNIT)
+		rc = device_command(sess, &cmd);
+	else
+		rc = device_commit(sess, &cmd);
+
+	if (rc < 0) {
+		scsi_cmd->send_data = cmd.task->io.sense;
+		scsierr_write(scsi_cmd, cmd.task->io.sense);
+	}
+}
+
+/*
+ * Make way for a range of blocks to be overwritten, or unmapped: 0 if
+ * it may be now, 1 if tc is parked until it may.
+ */
+static int lun_claim(struct target_session *sess, struct target_cmd *tc,
+		     struct dev_lun *lu, uint64_t lba, uint64_t n)
+{
+	if (lu->dl->backend == LUN_DIRECT)
+		return 0;
+
+	return target_mem_claim(sess, tc, lu->mem + lba * lu->block_size,
+				n * lu->block_size, device_resume);
+}
+
+/*
+ * The ranges of blocks an UNMAP or WRITE SAME writes, and with what.  A
+ * block of zeros is written by unmapping the range, since unmapped
+ * blocks read as zeros, whether or not the UNMAP bit asked for it.
+ */
+struct dev_fill {
+	uint64_t	lba[UNMAP_MAX_DESC];
+	uint32_t	n[UNMAP_MAX_DESC];
+	unsigned int	n_ranges;
+	bool		zero;
+	uint8_t		block[MAX_BLOCK_SIZE];
+
+	/* io_uring: the op in flight */
+	unsigned int	i;		/* range */
+	uint64_t	done;		/* bytes of it */
+	int		mode;		/* fallocate(); 0 to write buf */
+	uint8_t		*buf;		/* the block, repeated */
+	uint32_t	buf_len;
+};
+
+/* the command's ranges, if all are within the LUN */
+static bool dev_fill_parse(struct dev_lun *lu, struct target_cmd *tc,
+			   struct dev_fill *f, uint8_t *sense)
+{
+	struct iscsi_scsi_cmd_args *scsi_cmd = tc->scsi_cmd;
+	uint8_t param[UNMAP_PARAM_MAX];
+	const uint8_t *desc;
+	uint64_t lba;
+	uint32_t n;
+	int i, n_desc;
+
+	if (scsi_cmd->cdb[0] == WRITE_SAME_16) {
+		scsi_16_lba_len(scsi_cmd->cdb, &lba, &n);
+		if (!n)		/* to the last block */
+			n = lu->n_lba - lba;
+		f->lba[0] = lba;
+		f->n[0] = n;
+		f->n_ranges = 1;
+
+		param_gather(tc->task, f->block, lu->block_size);
+		f->zero = true;
+		for (i = 0; i < lu->block_size; i++)
+			if (f->block[i]) {
+				f->zero = false;
+				break;
+			}
+		return true;
+	}
+
+	param_gather(tc->task, param, sizeof(param));
+	f->zero = true;
+
+	n_desc = 0;
+	if (scsi_cmd->trans_len >= 8)
+		n_desc = MIN(scsi_d16(param + 2),
+			     scsi_cmd->trans_len - 8) / 16;
+
+	for (i = 0; i < n_desc; i++) {
+		desc = param + 8 + (i * 16);
+		lba = GUINT64_FROM_BE(*((uint64_t *)(void *) desc));
+		n = scsi_d32(desc + 8);
+
+		if ((lba > lu->n_lba) || (n > lu->n_lba - lba)) {
+			/* logical block address out of range */
+			scsi_cmd->status = SCSI_CHECK_CONDITION;
+			scsi_cmd->length = sense_fill(false, sense,
+						      SKEY_ILLEGAL_REQUEST,
+						      0x21, 0x0);
+			return false;
+		}
+
+		if (n) {
+			f->lba[f->n_ranges] = lba;
+			f->n[f->n_ranges++] = n;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * On the event loop: room for the data, and no queued READ data left to
+ * send from the ranges.  -1 if the command failed, 1 if it is parked.
+ */
+static int dev_fill_claim(struct target_session *sess, struct dev_lun *lu,
+			  struct target_cmd *tc, struct dev_fill *f,
+			  uint8_t *sense)
+{
+	struct iscsi_scsi_cmd_args *scsi_cmd = tc->scsi_cmd;
+	unsigned int i;
+
+	for (i = 0; i < f->n_ranges; i++) {
+		if (!f->zero && !ram_alloc(lu, f->lba[i], f->n[i])) {
+			scsi_cmd->status = SCSI_CHECK_CONDITION;
+			scsi_cmd->length = sense_fill(false, sense,
+						      SKEY_DATA_PROTECT,
+						      0x27, 0x7);
+			return -1;
+		}
+
+		if (lun_claim(sess, tc, lu, f->lba[i], f->n[i]))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void dev_fill_run(struct dev_lun *lu, struct dev_fill *f,
+			 struct iscsi_scsi_cmd_args *scsi_cmd, uint8_t *sense)
+{
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < f->n_ranges; i++) {
+		rc = f->zero ? lun_unmap(lu, f->lba[i], f->n[i]) :
+			       lun_fill(lu, f->lba[i], f->n[i], f->block);
+		/* even a failed one may have written part of the range */
+		lun_dirty(lu, f->lba[i] * lu->block_size,
+			  (uint64_t) f->n[i] * lu->block_size);
+		if (rc < 0) {
+			iscsi_trace_error(__FILE__, __LINE__,
+					  "%s failed: %s\n",
+					  f->zero ? "unmap" : "fill",
+					  strerror(errno));
+			scsierr_write(scsi_cmd, sense);
+			return;
+		}
+	}
+}
+
+/* storage thread: carry out an UNMAP or WRITE SAME */
+static void device_io_fill(struct target_cmd *tc)
+{
+	struct target_io *io = &tc->task->io;
+	struct dev_lun *lu = lun_find(io->sess, tc->scsi_cmd->lun);
+
+	dev_fill_run(lu, io->buf, tc->scsi_cmd, io->sense);
+	free(io->buf);
+	io->buf = NULL;
+}
+
+/* the task is done with its fill */
+static void dev_fill_release(struct target_cmd *tc)
+{
+	struct target_io *io = &tc->task->io;
+	struct dev_fill *f = io->buf;
+
+	free(f->buf);
+	free(f);
+	io->buf = NULL;
+}
+
+/* queue the next op of an UNMAP or WRITE SAME on a direct LUN */
+static int dev_fill_next(struct dev_ring *dr, struct dev_lun *lu,
+			 struct target_io *io)
+{
+	struct dev_fill *f = io->buf;
+	uint64_t len = (uint64_t) f->n[f->i] * lu->block_size - f->done;
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&dr->ring);
+	if (!sqe)
+		return -1;
+
+	dev_ring_sqe_file(dr, lu, sqe);
+	sqe->off = f->lba[f->i] * lu->block_size + f->done;
+	if (f->mode) {
+		sqe->opcode = IORING_OP_FALLOCATE;
+		sqe->addr = len;
+		sqe->len = f->mode;
+	} else {
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->addr = (uintptr_t) f->buf;
+		sqe->len = MIN(len, f->buf_len);
+	}
+	sqe->user_data = (uintptr_t) io;
+
+	return 0;
+}
+
+/*
+ * UNMAP or WRITE SAME on a direct LUN, carried out by the ring an op at
+ * a time, each completion queueing the next: a fallocate() per range,
+ * or writes of a buffer of the block repeated.
+ */
+static int dev_ring_fill(struct target_session *sess, struct dev_lun *lu,
+			 struct target_cmd *tc, struct dev_fill *f)
+{
+	struct target_io *io = &tc->task->io;
+	unsigned int i;
+
+	if (f->zero) {
+		f->mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+	} else {
+		f->buf_len = MIN((uint64_t) f->n[0] * lu->block_size,
+				 FILL_BUF_SIZE);
+		if (posix_memalign((void **) &f->buf, URING_ALIGN,
+				   f->buf_len)) {
+			free(f);
+			return -1;
+		}
+		for (i = 0; i < f->buf_len / lu->block_size; i++)
+			memcpy(f->buf + i * lu->block_size, f->block,
+			       lu->block_size);
+	}
+
+	io->buf = f;
+	if (dev_fill_next(sess->worker->dev, lu, io) < 0) {
+		dev_fill_release(tc);
+		return -1;
+	}
+
+	target_io_begin(sess, tc, dev_fill_release);
+
+	return 0;
+}
+
+/* an op of an UNMAP or WRITE SAME has completed */
+static void dev_fill_cqe(struct target_io *io, int res)
+{
+	struct iscsi_scsi_cmd_args *scsi_cmd = &io->cmd.task->scsi_cmd;
+	struct dev_ring *dr = io->sess->worker->dev;
+	struct dev_lun *lu = lun_find(io->sess, scsi_cmd->lun);
+	struct dev_fill *f = io->buf;
+	uint64_t len = (uint64_t) f->n[f->i] * lu->block_size;
+
+	/* as lun_unmap(), zero what cannot be deallocated */
+	if ((res == -EOPNOTSUPP) && (f->mode & FALLOC_FL_PUNCH_HOLE)) {
+		f->mode = FALLOC_FL_ZERO_RANGE;
+		if (dev_fill_next(dr, lu, io) == 0)
+			return;
+		res = -EBUSY;
+	}
+
+	if ((res < 0) || (!f->mode && !res))
+		goto err_out;
+	f->done = f->mode ? len : f->done + res;
+
+	if (f->done == len) {
+		lun_dirty(lu, f->lba[f->i] * lu->block_size, len);
+		f->i++;
+		f->done = 0;
+		if (f->zero)
+			f->mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+	}
+
+	if (f->i < f->n_ranges) {
+		if (dev_fill_next(dr, lu, io) == 0)
+			return;
+		res = -EBUSY;
+		goto err_out;
+	}
+
+	target_io_end(io);
+	return;
+
+err_out:
+	iscsi_trace_error(__FILE__, __LINE__, "io_uring %s failed: %s\n",
+			  f->zero ? "unmap" : "fill",
+			  res < 0 ? strerror(-res) : "short write");
+	lun_dirty(lu, f->lba[f->i] * lu->block_size, len);
+	scsierr_write(scsi_cmd, io->sense);
+	target_io_end(io);
+}
+
+/*
+ * UNMAP and WRITE SAME, once their data is in, are checked and their
+ * ranges claimed on the event loop, then carried out like a WRITE: by
+ * the ring for a direct LUN, or else on a storage thread, if any.
+ */
+static int device_fill(struct target_session *sess, struct dev_lun *lu,
+		       struct target_cmd *tc)
+{
+	struct iscsi_scsi_cmd_args *scsi_cmd = tc->scsi_cmd;
+	struct target_io *io = &tc->task->io;
+	struct dev_fill *f;
+
+	scsi_cmd->send_data = io->sense;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return -1;
+
+	/* a parked one is parsed again as it resumes */
+	if (!dev_fill_parse(lu, tc, f, io->sense) ||
+	    dev_fill_claim(sess, lu, tc, f, io->sense) || !f->n_ranges) {
+		free(f);
+		return 0;
+	}
+
+	if (lu->dl->backend == LUN_DIRECT)
+		return dev_ring_fill(sess, lu, tc, f);
+
+	if (gbls.n_io_threads) {
+		io->buf = f;
+		return target_io_submit(sess, tc, device_io_fill);
+	}
+
+	dev_fill_run(lu, f, scsi_cmd, io->sense);
+	free(f);
+	return 0;
+}
+
+/*
+ * storage thread: copy parked WRITE data into the backing store.  The
+ * segments, already claimed, are released with the task.
+ */
+static void device_io_commit(struct target_cmd *tc)
+{
+	struct iscsi_scsi_cmd_args *scsi_cmd = tc->scsi_cmd;
+	struct target_task *task = tc->task;
+	void *p = scsi_cmd->recv_data;
+	struct dev_lun *lu = lun_find(task->io.sess, scsi_cmd->lun);
+	uint64_t off = (uint8_t *) p - lu->mem;
+	int i;
+
+	for (i = 0; i < task->n_parked; i++) {
+		struct target_seg *seg = &task->parked[i];
+
+		if (seg->base)
+			memcpy(p + seg->off, seg->base, seg->len);
+	}
+
+	if (!(scsi_cache_bits(scsi_cmd->cdb) & CDB_FUA) || !lu->dirty_map ||
+	    !scsi_cmd->trans_len) {
+		lun_dirty(lu, off, scsi_cmd->trans_len);
+		return;
+	}
+
+	if (lun_msync(lu, off, scsi_cmd->trans_len) < 0) {
+		iscsi_trace_error(__FILE__, __LINE__, "msync failed: %s\n",
+				  strerror(errno));
+		lun_dirty(lu, off, scsi_cmd->trans_len);
+		scsi_cmd->send_data = task->io.sense;
+		scsierr_write(scsi_cmd, task->io.sense);
+	}
+}
+
+int device_commit(struct target_session *sess, struct target_cmd *tc)
+{
+	int i;
+	struct iscsi_scsi_cmd_args *scsi_cmd = tc->scsi_cmd;
+	struct target_task *task = tc->task;
+	void *p = scsi_cmd->recv_data;
+	struct dev_lun *lu;
+	uint64_t off;
+
+	lu = lun_find(sess, scsi_cmd->lun);
+	if (!lu)
+		return -1;
+
+	switch (scsi_cmd->cdb[0]) {
+	case UNMAP:
+	case WRITE_SAME_16:
+		return device_fill(sess, lu, tc);
+	}
+
+	if (lu->dl->backend == LUN_DIRECT) {
+		if (!ring_xfer_range(lu, scsi_cmd->cdb,
+				     scsi_write_cdb_len(scsi_cmd->cdb[0]),
+				     scsi_cmd->trans_len, &off))
+			return -1;
+		if (!scsi_cmd->trans_len)
+			return 0;
+
+		return dev_ring_rw(sess, lu, tc, true, off,
+				   scsi_cmd->trans_len);
+	}
+
+	/* data received in place has no staging buffer, and was claimed */
+	for (i = 0; i < task->n_parked; i++) {
+		struct target_seg *seg = &task->parked[i];
+
+		if (seg->base &&
+		    target_mem_claim(sess, tc, p + seg->off, seg->len,
+				     device_resume))
+			return 0;
+	}
+
+	if (gbls.n_io_threads)
+		return target_io_submit(sess, tc, device_io_commit);
+
+	for (i = 0; i < task->n_parked; i++) {
+		struct target_seg *seg = &task->parked[i];
+
+		if (!seg->base)
+			continue;
+
+		memcpy(p + seg->off, seg->base, seg->len);
+		seg_put(&sess->segs, seg->base);
+		seg->base = NULL;
+	}
+
+	off = (uint8_t *) p - lu->mem;
+	scsi_cmd->recv_data = NULL;
+	task->n_parked = 0;
+
+	if (!(scsi_cache_bits(scsi_cmd->cdb) & CDB_FUA) || !lu->dirty_map ||
+	    !scsi_cmd->trans_len) {
+		lun_dirty(lu, off, scsi_cmd->trans_len);
+		return 0;
+	}
+
+	/* FUA: the response waits for the range to be flushed */
+	if (sess->worker->dev) {
+		if (dev_ring_fsync(sess, lu, tc, off, scsi_cmd->trans_len,
+				   true) < 0) {
+			lun_dirty(lu, off, scsi_cmd->trans_len);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (lun_msync(lu, off, scsi_cmd->trans_len) < 0) {
+		iscsi_trace_error(__FILE__, __LINE__, "msync failed: %s\n",
+				  strerror(errno));
+		lun_dirty(lu, off, scsi_cmd->trans_len);
+		scsi_cmd->send_data = task->io.sense;
+		scsierr_write(scsi_cmd, task->io.sense);
+	}
+
+	return 0;
+}
+
+/*
+ * Return the location in the backing store where the immediate data of
+ * a WRITE command may be received directly, or NULL if the command is
+ * not a WRITE, or is one that will be failed.  The expected data
+ * transfer length must match the CDB's, else the command could write
+ * past its blocks.
+ */
+void *device_recv_direct(struct target_session *sess, uint64_t lun,
+			 const uint8_t *cdb, uint32_t trans_len,
+			 uint32_t data_len)
+{
+	int cdb_len = scsi_write_cdb_len(cdb[0]);
+	struct dev_lun *lu;
+	uint32_t len;
+	void *mem;
+
+	if (!cdb_len)
+		return NULL;
+
+	lu = lun_find(sess, lun);
+	if (!lu || (lu->dl->backend == LUN_DIRECT))
+		return NULL;
+
+	mem = scsi_xfer_mem(lu, cdb, cdb_len, &len);
+	if (!mem || ((uint64_t) len * lu->block_size != trans_len) ||
+	    (data_len > trans_len))
+		return NULL;
+
+	if (!ram_alloc(lu, ((uint8_t *) mem - lu->mem) / lu->block_size,
+		       (data_len + lu->block_size - 1) / lu->block_size))
+		return NULL;
+
+	/* not while READ data queued from there is still unsent */
+	if (target_mem_busy(mem, data_len))
+		return NULL;
+
+	return mem;
+}
+
+int device_command(struct target_session *sess, struct target_cmd *tc)
+{
+	struct iscsi_scsi_cmd_args *scsi_cmd = tc->scsi_cmd;
+	const uint8_t *cdb = scsi_cmd->cdb;
+	struct dev_lun *lu;
+	uint8_t *buf;
+	bool is_write;
+
+	switch (cdb[0]) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_16:
+	case WRITE_SAME_16:
+	case UNMAP:
+		is_write = true;
+		break;
+
+	default:
+		is_write = false;
+		break;
+	}
+
+	scsi_cmd->status = SCSI_SUCCESS;
+
+	if (!is_write)
+		scsi_cmd->length = 0;
+
+	scsi_cmd->send_data = buf = sess->outbuf;
+
+	memset(buf, 0, sizeof(sess->outbuf));
+
+	lu = lun_find(sess, scsi_cmd->lun);
+	if (!lu) {
+		switch (cdb[0]) {
+		case INQUIRY:
+			if (cdb[1] & 0x3) {
+				scsierr_lun(scsi_cmd, buf);
+				break;
+			}
+			scsiop_inquiry_std(scsi_cmd, buf);
+			buf[0] = 0x7f;	/* no logical unit here */
+			break;
+
+		case REPORT_LUNS:
+			scsiop_report_luns(sess, scsi_cmd, buf);
+			break;
+
+		case REQUEST_SENSE:
+			scsi_cmd->length = sense_fill(cdb[1] & (1 << 0), buf,
+						      SKEY_ILLEGAL_REQUEST,
+						      0x25, 0x0);
+			scsi_cmd->input = 1;
+			break;
+
+		default:
+			scsierr_lun(scsi_cmd, buf);
+			break;
+		}
+
+		return 0;
+	}
+
+	switch (cdb[0]) {
+	case FORMAT_UNIT:
+		/* format, iff FMTDATA, CMPLST and defect list format == 0 */
+		if ((cdb[1] & 0x1f) != 0)
+			scsierr_inval(scsi_cmd, buf);
+		else if (lu->dl->backend == LUN_DIRECT) {
+			if (fallocate(lu->fd, FALLOC_FL_ZERO_RANGE, 0,
+				      lu->n_lba * lu->block_size) < 0)
+				scsierr_inval(scsi_cmd, buf);
+		} else if (target_mem_claim(sess, tc, lu->mem,
+					    lu->n_lba * lu->block_size,
+					    device_resume)) {
+			break;		/* parked; formats as it resumes */
+		} else if (lu->dl->backend == LUN_RAM) {
+			if (ram_release(lu, 0, lu->n_lba * lu->block_size) < 0)
+				scsierr_inval(scsi_cmd, buf);
+		} else
+			memset(lu->mem, 0, lu->n_lba * lu->block_size);
+
+		/* files are rewritten, in part if formatting failed */
+		if (!(cdb[1] & 0x1f))
+			lun_dirty(lu, 0, lu->n_lba * lu->block_size);
+		break;
+
+	case INQUIRY:
+		if (cdb[1] & (1 << 1))			/* CmdDt set? */
+			scsierr_inval(scsi_cmd, buf);
+
+		else if (!(cdb[1] & (1 << 0)))		/* EVPD clear? */
+			scsiop_inquiry_std(scsi_cmd, buf);
+
+		else
+			switch (cdb[2]) {		/* EVPD page */
+			case 0x00:	scsiop_inquiry_list(scsi_cmd, buf); break;
+			case 0x83:	scsiop_inquiry_devid(sess, lu, scsi_cmd, buf); break;
+			case 0xb0:	scsiop_inquiry_limits(lu, scsi_cmd, buf); break;
+			case 0xb2:	scsiop_inquiry_lbp(scsi_cmd, buf); break;
+			default:	scsierr_inval(scsi_cmd, buf); break;
+			}
+		break;
+
+	case MAINTENANCE_IN:
+		switch (cdb[1] & 0x1f) {	/* service action */
+		case SAI_SUPPORTED_TMF:
+			scsiop_supported_tmf(scsi_cmd, buf);
+			break;
+
+		default:
+			scsierr_opcode(scsi_cmd, buf);
+			break;
+		}
+		break;
+
+	case MODE_SELECT_6:
+	case MODE_SELECT_10:
+		/* unconditionally return invalid-field-in-CDB */
+		scsierr_inval(scsi_cmd, buf);
+		break;
+
+	case MODE_SENSE:
+		scsiop_mode_sense(lu, scsi_cmd, buf, true);
+		break;
+
+	case MODE_SENSE_10:
+		scsiop_mode_sense(lu, scsi_cmd, buf, false);
+		break;
+
+	case READ_CAPACITY:
+		scsiop_read_cap(lu, scsi_cmd, buf, true);
+		break;
+
+	case REPORT_LUNS:
+		scsiop_report_luns(sess, scsi_cmd, buf);
+		break;
+
+	case REQUEST_SENSE:
+		scsi_cmd->length = sense_fill(cdb[1] & (1 << 0), buf, 0, 0, 0);
+		scsi_cmd->input = 1;
+		break;
+
+	case SEEK_10:
+		/* provided a valid range, seek is a no-op */
+		if (scsi_d32(cdb + 2) >= lu->n_lba)
+			scsierr_inval(scsi_cmd, buf);
+		break;
+
+	case SEND_DIAGNOSTIC:
+		/* default test immediately succeeds. all others invalid. */
+		if (scsi_d16(cdb + 3) || !(cdb[1] & (1 << 2)))
+			scsierr_inval(scsi_cmd, buf);
+		break;
+
+	case SERVICE_ACTION_IN:
+		switch (cdb[1] & 0x1f) {	/* service action */
+		case SAI_READ_CAPACITY_16:
+			scsiop_read_cap(lu, scsi_cmd, buf, false);
+			break;
+
+		default:
+			scsierr_opcode(scsi_cmd, buf);
+			break;
+		}
+		break;
+
+	case SYNC_CACHE:
 	case SYNC_CACHE_16:
-		scsiop_sync_cache(sess, scsi_cmd, buf);
+		scsiop_sync_cache(sess, lu, tc, scsi_cmd, buf);
+		break;
+
+	case UNMAP:
+		scsiop_unmap(sess, lu, tc, scsi_cmd, buf);
+		break;
+
+	case WRITE_SAME_16:
+		scsiop_write_same(sess, lu, tc, scsi_cmd, buf);
 		break;
 
 	case READ_6:
-		scsiop_data_xfer(sess, tc, scsi_cmd, buf, false, 6);
+		scsiop_data_xfer(sess, lu, tc, scsi_cmd, buf, false, 6);
 		break;
 
 	case READ_10:
-		scsiop_data_xfer(sess, tc, scsi_cmd, buf, false, 10);
+		scsiop_data_xfer(sess, lu, tc, scsi_cmd, buf, false, 10);
 		break;
 
 	case READ_16:
-		scsiop_data_xfer(sess, tc, scsi_cmd, buf, false, 16);
+		scsiop_data_xfer(sess, lu, tc, scsi_cmd, buf, false, 16);
 		break;
 
 	case WRITE_6:
-		scsiop_data_xfer(sess, tc, scsi_cmd, buf, true, 6);
+		scsiop_data_xfer(sess, lu, tc, scsi_cmd, buf, true, 6);
 		break;
 
 	case WRITE_10:
-		scsiop_data_xfer(sess, tc, scsi_cmd, buf, true, 10);
+		scsiop_data_xfer(sess, lu, tc, scsi_cmd, buf, true, 10);
 		break;
 
 	case WRITE_16:
-		scsiop_data_xfer(sess, tc, scsi_cmd, buf, true, 16);
+		scsiop_data_xfer(sess, lu, tc, scsi_cmd, buf, true, 16);
 		break;
 
 	case PREFETCH_10:
@@ -875,21 +2628,156 @@ static void net_free_socket(struct server_socket *sock)
 	free(sock);
 }
 
+/* the files of the LUN_DIRECT logical units, in file_index order */
+static int *dev_ring_files(void)
+{
+	struct disc_lun *dl;
+	int i, j, *fds;
+
+	fds = calloc(n_direct, sizeof(*fds));
+	if (!fds)
+		return NULL;
+
+	for (i = 0; i < tv.c; i++)
+		for (j = 0; j < tv.v[i].luns.c; j++) {
+			dl = &tv.v[i].luns.v[j];
+			if (dl->backend == LUN_DIRECT)
+				fds[dl->dev->file_index] = dl->dev->fd;
+		}
+
+	return fds;
+}
+
+/* staging buffers, and the files, for READ and WRITE of LUN_DIRECT */
+static int dev_ring_init_direct(struct dev_ring *dr)
+{
+	struct iovec iov;
+	unsigned int i;
+	int *fds;
+
+	if (posix_memalign((void **) &dr->bufs, URING_ALIGN,
+			   (size_t) URING_BUFS * URING_BUF_SIZE))
+		return -ENOMEM;
+	for (i = 0; i < URING_BUFS; i++)
+		dr->buf_free[dr->n_buf_free++] = URING_BUFS - 1 - i;
+
+	/* registration only saves work per I/O; do without if refused */
+	iov.iov_base = dr->bufs;
+	iov.iov_len = (size_t) URING_BUFS * URING_BUF_SIZE;
+	dr->fixed_bufs = (uring_register(&dr->ring, IORING_REGISTER_BUFFERS,
+					 &iov, 1) == 0);
+	fds = dev_ring_files();
+	dr->fixed_file = fds && (uring_register(&dr->ring,
+						IORING_REGISTER_FILES,
+						fds, n_direct) == 0);
+	free(fds);
+	if (!dr->fixed_bufs || !dr->fixed_file)
+		iscsi_trace_warning(__FILE__, __LINE__,
+				    "io_uring: cannot register %s\n",
+				    dr->fixed_bufs ? "file" : "buffers");
+
+	return 0;
+}
+
+static int dev_ring_init(struct target_worker *w)
+{
+	struct dev_ring *dr;
+	int rc;
+
+	dr = calloc(1, sizeof(*dr));
+	if (!dr)
+		return -ENOMEM;
+
+	rc = uring_init(&dr->ring, URING_ENTRIES);
+	if (rc) {
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "io_uring_setup failed: %s\n",
+				  strerror(-rc));
+		goto err_out;
+	}
+
+	/* mapped files only have their flushes queued here */
+	if (n_direct) {
+		rc = dev_ring_init_direct(dr);
+		if (rc)
+			goto err_out_ring;
+	}
+
+	dr->efd = eventfd(0, EFD_NONBLOCK);
+	if (dr->efd < 0) {
+		rc = -errno;
+		goto err_out_bufs;
+	}
+
+	rc = uring_register(&dr->ring, IORING_REGISTER_EVENTFD, &dr->efd, 1);
+	if (rc)
+		goto err_out_efd;
+
+	event_set(&dr->ev, dr->efd, EV_READ | EV_PERSIST, dev_ring_event, dr);
+	event_base_set(w->base, &dr->ev);
+	if (event_add(&dr->ev, NULL)) {
+		rc = -EIO;
+		goto err_out_efd;
+	}
+
+	w->dev = dr;
+	return 0;
+
+err_out_efd:
+	close(dr->efd);
+err_out_bufs:
+	free(dr->bufs);
+err_out_ring:
+	uring_exit(&dr->ring);
+err_out:
+	free(dr);
+	return rc;
+}
+
+static void dev_ring_exit(struct target_worker *w)
+{
+	struct dev_ring *dr = w->dev;
+
+	if (!dr)
+		return;
+
+	event_del(&dr->ev);
+	close(dr->efd);
+	uring_exit(&dr->ring);
+	free(dr->bufs);
+	free(dr);
+	w->dev = NULL;
+}
+
 static void net_exit(void)
 {
 	struct list_head *tmp, *iter;
 	struct server_socket *sock;
+	struct target_worker *w;
+	unsigned int i;
 
 	if (!opt_strict_free)
 		return;
 
-	list_for_each_safe(tmp, iter, &gbls.sockets) {
-		sock = list_entry(tmp, struct server_socket, sockets_node);
-		net_free_socket(sock);
+	for (i = 0; i < gbls.n_workers; i++) {
+		w = &gbls.workers[i];
+
+		list_for_each_safe(tmp, iter, &w->sockets) {
+			sock = list_entry(tmp, struct server_socket,
+					  sockets_node);
+			net_free_socket(sock);
+		}
+
+		dev_ring_exit(w);
+		target_worker_exit(w);
+		event_base_free(w->base);
 	}
+
+	free(gbls.workers);
 }
 
-static int net_open_socket(int addr_fam, int sock_type, int sock_prot,
+static int net_open_socket(struct target_worker *w, int addr_fam,
+			   int sock_type, int sock_prot,
 			   int addr_len, void *addr_ptr)
 {
 	struct server_socket *sock;
@@ -911,6 +2799,17 @@ static int net_open_socket(int addr_fam, int sock_type, int sock_prot,
 		return -rc;
 	}
 
+	/* each thread listens on its own socket; the kernel spreads
+	 * incoming connections among them
+	 */
+	if ((gbls.n_workers > 1) &&
+	    (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)) {
+		rc = errno;
+		applogerr("setsockopt(SO_REUSEPORT)");
+		close(fd);
+		return -rc;
+	}
+
 	if (bind(fd, addr_ptr, addr_len) < 0) {
 		rc = errno;
 		applogerr("tcp bind");
@@ -940,6 +2839,7 @@ static int net_open_socket(int addr_fam, int sock_type, int sock_prot,
 	INIT_LIST_HEAD(&sock->sockets_node);
 
 	sock->fd = fd;
+	sock->worker = w;
 
 	sock->addrlen = addr_len;
 	memcpy(&sock->addr, addr_ptr, addr_len);
@@ -956,6 +2856,7 @@ static int net_open_socket(int addr_fam, int sock_type, int sock_prot,
 		 gbls.host, gbls.port);
 
 	event_set(&sock->ev, fd, EV_READ | EV_PERSIST, tcp_srv_event, sock);
+	event_base_set(w->base, &sock->ev);
 
 	if (event_add(&sock->ev, NULL)) {
 		close(fd);
@@ -963,12 +2864,12 @@ static int net_open_socket(int addr_fam, int sock_type, int sock_prot,
 		return -EIO;
 	}
 
-	list_add_tail(&sock->sockets_node, &gbls.sockets);
+	list_add_tail(&sock->sockets_node, &w->sockets);
 
 	return fd;
 }
 
-static int net_open_known(int port_num)
+static int net_open_known(struct target_worker *w, int port_num)
 {
 	int ipv6_found;
 	int rc;
@@ -1006,73 +2907,367 @@ static int net_open_known(int port_num)
 			ipv6_found = 1;
 	}
 
-	for (res = res0; res; res = res->ai_next) {
-		char listen_host[65], listen_serv[65];
+	for (res = res0; res; res = res->ai_next) {
+		char listen_host[65], listen_serv[65];
+
+		if (ipv6_found && res->ai_family == PF_INET)
+			continue;
+
+		rc = net_open_socket(w, res->ai_family, res->ai_socktype,
+				     res->ai_protocol,
+				     res->ai_addrlen, res->ai_addr);
+		if (rc < 0)
+			goto err_out;
+		getnameinfo(res->ai_addr, res->ai_addrlen,
+			    listen_host, sizeof(listen_host),
+			    listen_serv, sizeof(listen_serv),
+			    NI_NUMERICHOST | NI_NUMERICSERV);
+
+		applog(LOG_INFO, "Thread %u listening on %s port %s\n",
+		       w->id, listen_host, listen_serv);
+	}
+
+	freeaddrinfo(res0);
+	return 0;
+
+err_out:
+	freeaddrinfo(res0);
+err_addr:
+	return rc;
+}
+
+static int net_init(void)
+{
+	struct target_worker *w;
+	unsigned int i;
+	int rc;
+
+	gbls.workers = calloc(gbls.n_workers, sizeof(*gbls.workers));
+	if (!gbls.workers)
+		return -ENOMEM;
+
+	for (i = 0; i < gbls.n_workers; i++) {
+		w = &gbls.workers[i];
+		w->id = i;
+
+		w->base = event_base_new();
+		if (!w->base)
+			return -ENOMEM;
+
+		rc = target_worker_init(&gbls, w);
+		if (rc)
+			return rc;
+
+		/* --io-uring needs the ring; mapped files can do without */
+		if (n_direct || n_mapped) {
+			rc = dev_ring_init(w);
+			if (rc && n_direct)
+				return rc;
+		}
+
+		rc = net_open_known(w, gbls.port);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+static void *net_worker(void *userdata)
+{
+	struct target_worker *w = userdata;
+
+	/* work queued by each iteration's handlers is submitted at once */
+	while (!w->stop) {
+		event_base_loop(w->base, EVLOOP_ONCE);
+		target_worker_flush(w);
+	}
+
+	return NULL;
+}
+
+static int net_start(void)
+{
+	sigset_t set, oldset;
+	unsigned int i;
+	int rc = 0;
+
+	/* signals are left to the main thread's event loop */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+	for (i = 0; i < gbls.n_workers; i++) {
+		rc = pthread_create(&gbls.workers[i].thread, NULL,
+				    net_worker, &gbls.workers[i]);
+		if (rc) {
+			applog(LOG_ERR, "pthread_create: %s\n", strerror(rc));
+			gbls.n_workers = i;
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	return rc;
+}
+
+static void net_stop(void)
+{
+	struct target_worker *w;
+	unsigned int i;
+
+	for (i = 0; i < gbls.n_workers; i++) {
+		w = &gbls.workers[i];
+		w->stop = true;
+		target_worker_wake(w);
+		pthread_join(w->thread, NULL);
+	}
+}
+
+/* the target and LUN of the command line, without a configuration file */
+static int default_config(targv_t *tvp)
+{
+	struct disc_target *tp;
+	struct disc_lun *dl;
+
+	memset(tvp, 0, sizeof(*tvp));
+
+	ALLOC(struct disc_target, tvp->v, tvp->size, tvp->c, 14, 14,
+	      "default_config", return -1);
+
+	tp = &tvp->v[tvp->c++];
+	memset(tp, 0, sizeof(*tp));
+	tp->de.type = DE_DEVICE;
+	tp->de.u.dp = NULL;
+	tp->target = strdup("iqn.2010-04.us.yyz.bd.itd");
+	tp->iqn = strdup("iqn.2010-04.us.yyz.bd.itd:target0");
+	tp->mask = strdup("0/0");
+
+	ALLOC(struct disc_lun, tp->luns.v, tp->luns.size, tp->luns.c, 1, 1,
+	      "default_config", return -1);
+
+	dl = &tp->luns.v[tp->luns.c++];
+	memset(dl, 0, sizeof(*dl));
+	dl->lun = 0;
+	if (!file_map_fn) {
+		dl->backend = LUN_RAM;
+		dl->size = ram_size;
+	} else {
+		dl->backend = opt_uring ? LUN_DIRECT : LUN_MAP;
+		dl->path = strdup(file_map_fn);
+	}
+
+	return 0;
+}
 
-		if (ipv6_found && res->ai_family == PF_INET)
+/* write back the regions of a mapped file dirty so far */
+static void flusher_lun(struct dev_lun *lu)
+{
+	uint64_t size = lu->n_lba * lu->block_size;
+	uint64_t pos, off, len, start, t;
+
+	start = now_ns();
+
+	for (pos = 0; pos < size; pos += FLUSH_WINDOW) {
+		off = pos;
+		len = MIN((uint64_t) FLUSH_WINDOW, size - pos);
+		if (!lun_flush_begin(lu, &off, &len))
 			continue;
 
-		rc = net_open_socket(res->ai_family, res->ai_socktype,
-				     res->ai_protocol,
-				     res->ai_addrlen, res->ai_addr);
-		if (rc < 0)
-			goto err_out;
-		getnameinfo(res->ai_addr, res->ai_addrlen,
-			    listen_host, sizeof(listen_host),
-			    listen_serv, sizeof(listen_serv),
-			    NI_NUMERICHOST | NI_NUMERICSERV);
+		/* regions, so pages, are aligned */
+		t = now_ns();
+		if (msync(lu->mem + off, len, MS_SYNC) < 0) {
+			iscsi_trace_error(__FILE__, __LINE__,
+					  "msync failed: %s\n",
+					  strerror(errno));
+			lun_flush_end(lu, off, len, false);
+			return;
+		}
+		t = now_ns() - t;
+		lun_flush_end(lu, off, len, true);
 
-		applog(LOG_INFO, "Listening on %s port %s\n",
-		       listen_host, listen_serv);
+		flusher.flushes++;
+		flusher.bytes += len;
+		flusher.ns += t;
+		flusher.ns_max = MAX(flusher.ns_max, t);
 	}
 
-	freeaddrinfo(res0);
-	return 0;
+	/* what was written meanwhile is no older than the pass */
+	if (__atomic_load_n(&lu->n_dirty, __ATOMIC_RELAXED))
+		__atomic_store_n(&lu->dirty_since, start, __ATOMIC_RELAXED);
+}
 
-err_out:
-	freeaddrinfo(res0);
-err_addr:
-	return rc;
+/* bytes of mapped files' regions dirty, in all */
+static uint64_t flusher_dirty(void)
+{
+	uint64_t n = 0;
+	struct dev_lun *lu;
+	int i, j;
+
+	for (i = 0; i < tv.c; i++)
+		for (j = 0; j < tv.v[i].luns.c; j++) {
+			lu = tv.v[i].luns.v[j].dev;
+			if (lu && (lu->dl->backend == LUN_MAP))
+				n += __atomic_load_n(&lu->n_dirty,
+						     __ATOMIC_RELAXED);
+		}
+
+	return n << DIRTY_SHIFT;
 }
 
-static int net_init(void)
+static void flusher_pass(void)
+{
+	uint64_t now = now_ns();
+	struct dev_lun *lu;
+	bool all;
+	int i, j;
+
+	all = flush_dirty && (flusher_dirty() >= flush_dirty);
+
+	for (i = 0; i < tv.c; i++)
+		for (j = 0; j < tv.v[i].luns.c; j++) {
+			lu = tv.v[i].luns.v[j].dev;
+			if (!lu || (lu->dl->backend != LUN_MAP) ||
+			    !__atomic_load_n(&lu->n_dirty, __ATOMIC_RELAXED))
+				continue;
+
+			if (all || (flush_age &&
+				    (now - __atomic_load_n(&lu->dirty_since,
+							   __ATOMIC_RELAXED) >=
+				     (uint64_t) flush_age * 1000000)))
+				flusher_lun(lu);
+		}
+}
+
+static void *flusher_thread(void *userdata)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&flusher.lock);
+	while (!flusher.stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += FLUSH_TICK_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&flusher.wake, &flusher.lock, &ts);
+		if (flusher.stop)
+			break;
+
+		pthread_mutex_unlock(&flusher.lock);
+		flusher_pass();
+		pthread_mutex_lock(&flusher.lock);
+	}
+	pthread_mutex_unlock(&flusher.lock);
+
+	return NULL;
+}
+
+static int flusher_start(void)
 {
+	sigset_t set, oldset;
 	int rc;
 
-	rc = net_open_known(gbls.port);
+	if (!n_mapped || (!flush_age && !flush_dirty))
+		return 0;
+
+	/* signals are for the event loops */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+	rc = pthread_create(&flusher.thread, NULL, flusher_thread, NULL);
 	if (rc)
-		return rc;
+		iscsi_trace_error(__FILE__, __LINE__, "pthread_create: %s\n",
+				  strerror(rc));
+	else
+		flusher.running = true;
 
-	return 0;
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	return rc ? -1 : 0;
 }
 
-static targv_t tv;
+static void flusher_stop(void)
+{
+	if (!flusher.running)
+		return;
+
+	pthread_mutex_lock(&flusher.lock);
+	flusher.stop = true;
+	pthread_cond_signal(&flusher.wake);
+	pthread_mutex_unlock(&flusher.lock);
+
+	pthread_join(flusher.thread, NULL);
+	flusher.running = false;
+}
 
 static int master_iscsi_init(void)
 {
-	targv_t *tvp = &tv;
-	char tgt[256] = "iqn.2010-04.us.yyz.bd.itd";
-	char iqn[256] = "iqn.2010-04.us.yyz.bd.itd:target0";
+	if (config_fn) {
+		if (config_read(config_fn, &tv) < 0)
+			return -1;
+	} else if (default_config(&tv) < 0)
+		return -1;
 
-	memset(&tv, 0, sizeof(tv));
+	if (target_init(&gbls, &tv, "iqn.2010-04.us.yyz.bd.itd") < 0)
+		return -1;
 
-	ALLOC(struct disc_target, tvp->v, tvp->size, tvp->c, 14, 14,
-	      "master_iscsi_init", exit(EXIT_FAILURE));
+	return flusher_start();
+}
+
+/*
+ * Describe the pages the kernel actually backs RAM storage with, as
+ * /proc/self/smaps reports them for its mapping.
+ */
+static void ram_page_info(struct dev_lun *lu, char *buf, size_t size)
+{
+	unsigned long start, end, kps = 0, thp = 0;
+	bool ours = false;
+	int n;
+	char line[256];
+	FILE *f;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (!f) {
+		snprintf(buf, size, "unknown page size");
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			if (ours)
+				break;
+			ours = (start == (uintptr_t) lu->mem);
+		} else if (ours) {
+			sscanf(line, "KernelPageSize: %lu kB", &kps);
+			sscanf(line, "THPeligible: %lu", &thp);
+		}
+	}
+
+	fclose(f);
 
-	tvp->v[tvp->c].de.type = DE_DEVICE;
-	tvp->v[tvp->c].de.u.dp = NULL;
-	tvp->v[tvp->c].target = strdup(tgt);
-	tvp->v[tvp->c].iqn = strdup(iqn);
-	tvp->v[tvp->c].mask = strdup("0/0");
-	tvp->c += 1;
+	n = snprintf(buf, size, "%luKB pages", kps);
+	if (ram_pages == RAM_PAGES_THP)
+		n += snprintf(buf + n, size - n, thp ? ", THP eligible" :
+						       ", THP not available");
 
-	return target_init(&gbls, tvp, tgt);
+	if (ram_node == RAM_NODE_INTERLEAVE)
+		snprintf(buf + n, size - n, ", interleaved across NUMA nodes");
+	else if (ram_node >= 0)
+		snprintf(buf + n, size - n, ", on NUMA node %d", ram_node);
 }
 
-static void show_mem_info(const char *stype)
+static void show_mem_info(struct disc_target *tp, struct dev_lun *lu,
+			  const char *stype)
 {
+	char pages[96] = "";
+
 	const char *suffix;
-	unsigned long long pr_len, alloc_len = data_mem_lba * data_lba_size;
+	unsigned long long pr_len, alloc_len = lu->n_lba * lu->block_size;
 
 	if (alloc_len >= (1024 * 1024 * 1024)) {
 		suffix = "GB";
@@ -1085,110 +3280,357 @@ static void show_mem_info(const char *stype)
 		pr_len = alloc_len / 1024;
 	}
 
-	fprintf(stderr, "Initialized %llu%s of %s storage\n",
-		pr_len, suffix, stype);
+	if (lu->dl->backend == LUN_RAM)
+		ram_page_info(lu, pages, sizeof(pages));
+
+	fprintf(stderr, "Initialized %llu%s of %s storage for %s LUN %u, "
+		"%u-byte blocks%s%s\n",
+		pr_len, suffix, stype, tp->iqn, lu->dl->lun, lu->block_size,
+		*pages ? ", " : "", pages);
 }
 
-static int mem_init(void)
+/* the --numa policy, as a mode and node mask: 1, or 0 if none, or -1 */
+static int ram_policy(int *pmode, unsigned long *pmask)
 {
-	unsigned long long alloc_len = data_mem_lba * data_lba_size;
+	if (ram_node == RAM_NODE_ANY)
+		return 0;
 
-	data_mem = calloc(1, alloc_len);
-	if (!data_mem) {
-		iscsi_trace_error(__FILE__, __LINE__,
-				  "Out of memory allocating %llu bytes "
-				  "for RAM storage\n",
-				  alloc_len);
-		return -1;
+	if (ram_node >= 0) {
+		*pmode = MPOL_BIND;
+		*pmask = 1UL << ram_node;
+		return 1;
 	}
 
-	show_mem_info("RAM");
+	/* the kernel refuses nodes it was not built for: only those there are */
+	*pmode = MPOL_INTERLEAVE;
+	*pmask = 0;
+	if (syscall(__NR_get_mempolicy, NULL, pmask, sizeof(*pmask) * 8 + 1,
+		    NULL, MPOL_F_MEMS_ALLOWED) < 0)
+		return -1;
+
+	return 1;
+}
 
-	return 0;
+/* make the --numa policy the thread's, or with !on, drop it again */
+static int ram_policy_set(bool on)
+{
+	unsigned long mask;
+	int mode, rc;
+
+	if (!on)
+		return syscall(__NR_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+
+	rc = ram_policy(&mode, &mask);
+	if (rc <= 0)
+		return rc;
+
+	return syscall(__NR_set_mempolicy, mode, &mask, sizeof(mask) * 8 + 1);
 }
 
-static void mem_exit(void)
+/*
+ * Map RAM storage, aligned to the chunk size so that transparent huge
+ * pages can back it.  Only address space is reserved, see ram_alloc(),
+ * except that hugetlbfs pages are set aside now, failing early if too
+ * few were reserved.  Those are counted against the nodes the thread's
+ * policy allows, so the caller makes that the --numa one meanwhile;
+ * otherwise pages reserved on another node fault as SIGBUS under a bind.
+ */
+static void *ram_map(size_t len, size_t align)
 {
-	free(data_mem);
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	uint8_t *p, *start;
+
+	if (ram_pages == RAM_PAGES_HUGETLB)
+		return mmap(NULL, len, PROT_READ | PROT_WRITE,
+			    flags | MAP_HUGETLB |
+			    (ram_huge_shift << MAP_HUGE_SHIFT), -1, 0);
+
+	p = mmap(NULL, len + align, PROT_READ | PROT_WRITE,
+		 flags | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return p;
+
+	start = (uint8_t *)(((uintptr_t) p + align - 1) & ~(align - 1));
+	if (start > p)
+		munmap(p, start - p);
+	munmap(start + len, p + align - start);
+
+	return start;
 }
 
-static int map_init(void)
+/* before any of it is touched, bind RAM storage by the --numa policy */
+static int ram_bind(void *p, size_t len)
+{
+	unsigned long mask;
+	int mode, rc;
+
+	rc = ram_policy(&mode, &mask);
+	if (rc <= 0)
+		return rc;
+
+	return syscall(__NR_mbind, p, len, mode, &mask,
+		       sizeof(mask) * 8 + 1, 0);
+}
+
+static int mem_init(struct dev_lun *lu)
 {
-	struct stat st;
 	unsigned long long alloc_len;
+	int err;
 
-	file_map_fd = open(file_map_fn, O_RDWR);
-	if (file_map_fd < 0) {
-		perror(file_map_fn);
-		goto err_out;
+	lu->n_lba = lu->dl->size / lu->block_size;
+	if (lu->n_lba < 1) {
+		fprintf(stderr, "RAM size too small, aborting\n");
+		return -1;
 	}
+	alloc_len = lu->n_lba * lu->block_size;
 
-	if (fstat(file_map_fd, &st) < 0) {
-		perror(file_map_fn);
-		goto err_out_fd;
+	switch (ram_pages) {
+	case RAM_PAGES_THP:
+		lu->chunk_shift = RAM_THP_SHIFT;
+		break;
+	case RAM_PAGES_HUGETLB:
+		lu->chunk_shift = MAX(ram_huge_shift, RAM_CHUNK_SHIFT);
+		break;
+	default:
+		lu->chunk_shift = RAM_CHUNK_SHIFT;
+		break;
+	}
+
+	lu->n_chunks = (alloc_len + (1ULL << lu->chunk_shift) - 1) >>
+		       lu->chunk_shift;
+	lu->map_len = lu->n_chunks << lu->chunk_shift;
+
+	if ((ram_pages == RAM_PAGES_HUGETLB) && (ram_policy_set(true) < 0)) {
+		fprintf(stderr, "Cannot apply NUMA policy to RAM storage: %s\n",
+			strerror(errno));
+		ram_policy_set(false);
+		return -1;
+	}
+
+	lu->mem = ram_map(lu->map_len, 1UL << lu->chunk_shift);
+	err = errno;
+	if (ram_pages == RAM_PAGES_HUGETLB)
+		ram_policy_set(false);
+	errno = err;
+
+	if (lu->mem == MAP_FAILED) {
+		lu->mem = NULL;
+		if (ram_pages == RAM_PAGES_HUGETLB)
+			fprintf(stderr, "Too few %uKB huge pages reserved "
+				"for %llu bytes of RAM storage%s: %s\n",
+				(1U << ram_huge_shift) / 1024, alloc_len,
+				(ram_node >= 0) ? " on its NUMA node" : "",
+				strerror(errno));
+		else
+			iscsi_trace_error(__FILE__, __LINE__,
+					  "Out of memory reserving %llu bytes "
+					  "for RAM storage\n",
+					  alloc_len);
+		return -1;
+	}
+
+	if ((ram_pages == RAM_PAGES_THP) &&
+	    (madvise(lu->mem, lu->map_len, MADV_HUGEPAGE) < 0))
+		perror("madvise(MADV_HUGEPAGE)");
+
+	if (ram_bind(lu->mem, lu->map_len) < 0) {
+		fprintf(stderr, "Cannot apply NUMA policy to RAM storage: %s\n",
+			strerror(errno));
+		goto err_out;
 	}
 
-	data_mem_lba = st.st_size / data_lba_size;
+	lu->chunk_map = calloc((lu->n_chunks + 63) / 64, sizeof(uint64_t));
+	if (!lu->chunk_map)
+		goto err_out;
+
+	return 0;
+
+err_out:
+	munmap(lu->mem, lu->map_len);
+	lu->mem = NULL;
+	return -1;
+}
+
+/* open a backing file or block device, and find its size */
+static int file_open(struct dev_lun *lu, int flags)
+{
+	const char *fn = lu->dl->path;
+	struct stat st;
+	uint64_t size, n;
+
+	lu->fd = open(fn, flags);
+	if (lu->fd < 0) {
+		perror(fn);
+		goto err_out;
+	}
 
-	if (data_mem_lba < 1) {
-		fprintf(stderr, "%s size too small, aborting\n", file_map_fn);
+	if (fstat(lu->fd, &st) < 0) {
+		perror(fn);
 		goto err_out_fd;
 	}
 
-	alloc_len = file_map_size = data_mem_lba * data_lba_size;
-	file_map = mmap(NULL, alloc_len,
-			PROT_READ | PROT_WRITE, MAP_SHARED, file_map_fd, 0);
-	if (file_map == MAP_FAILED) {
-		perror("mmap");
+	size = st.st_size;
+	if (S_ISBLK(st.st_mode) && (ioctl(lu->fd, BLKGETSIZE64, &size) < 0)) {
+		perror(fn);
 		goto err_out_fd;
 	}
 
-	data_mem = file_map;
+	lu->n_lba = size / lu->block_size;
+
+	if (lu->n_lba < 1) {
+		fprintf(stderr, "%s size too small, aborting\n", fn);
+		goto err_out_fd;
+	}
 
-	show_mem_info("file-backed mmap");
+	n = ((lu->n_lba * lu->block_size - 1) >> DIRTY_SHIFT) + 1;
+	lu->dirty_map = calloc((n - 1) / 64 + 1, sizeof(*lu->dirty_map));
+	lu->flushing = calloc(n, sizeof(*lu->flushing));
+	if (!lu->dirty_map || !lu->flushing) {
+		fprintf(stderr, "%s: out of memory\n", fn);
+		free(lu->dirty_map);
+		free(lu->flushing);
+		lu->dirty_map = NULL;
+		lu->flushing = NULL;
+		goto err_out_fd;
+	}
 
 	return 0;
 
 err_out_fd:
-	close(file_map_fd);
+	close(lu->fd);
+	lu->fd = -1;
 err_out:
-	return 1;
+	return -1;
 }
 
-static void map_exit(void)
+static int map_init(struct dev_lun *lu)
 {
-	munmap(file_map, file_map_size);
-	close(file_map_fd);
+	if (file_open(lu, O_RDWR) < 0)
+		return -1;
+
+	lu->mem = mmap(NULL, lu->n_lba * lu->block_size,
+		       PROT_READ | PROT_WRITE, MAP_SHARED, lu->fd, 0);
+	if (lu->mem == MAP_FAILED) {
+		perror("mmap");
+		lu->mem = NULL;
+		free(lu->dirty_map);
+		free(lu->flushing);
+		lu->dirty_map = NULL;
+		lu->flushing = NULL;
+		close(lu->fd);
+		lu->fd = -1;
+		return -1;
+	}
+
+	n_mapped++;
+	return 0;
 }
 
-static void master_iscsi_exit(void)
+static int direct_init(struct dev_lun *lu)
 {
-	targv_t *tvp = &tv;
+	if (file_open(lu, O_RDWR | O_DIRECT) < 0)
+		return -1;
 
-	target_shutdown(&gbls, opt_strict_free);
+	lu->file_index = n_direct++;
 
-	if (file_map) {
-		msync(file_map, file_map_size, MS_ASYNC);
+	return 0;
+}
 
-		if (opt_strict_free)
-			map_exit();
-	} else {
-		if (opt_strict_free)
-			mem_exit();
+int device_init(struct globals *gp, targv_t *tvp, struct disc_target *tp)
+{
+	static const char *stypes[] = {
+		[LUN_RAM]	= "sparse RAM",
+		[LUN_MAP]	= "file-backed mmap",
+		[LUN_DIRECT]	= "O_DIRECT io_uring",
+	};
+	struct disc_lun *dl;
+	struct dev_lun *lu;
+	int i, rc;
+
+	for (i = 0; i < tp->luns.c; i++) {
+		dl = &tp->luns.v[i];
+
+		lu = calloc(1, sizeof(*lu));
+		if (!lu)
+			return -1;
+		lu->dl = dl;
+		lu->fd = -1;
+		lu->block_size = dl->block_size ? dl->block_size : block_size;
+
+		switch (dl->backend) {
+		case LUN_RAM:		rc = mem_init(lu); break;
+		case LUN_MAP:		rc = map_init(lu); break;
+		case LUN_DIRECT:	rc = direct_init(lu); break;
+		default:		rc = -1; break;
+		}
+		if (rc < 0) {
+			free(lu);
+			return -1;
+		}
+
+		dl->dev = lu;
+		show_mem_info(tp, lu, stypes[dl->backend]);
 	}
 
-	if (opt_strict_free) {
-		free(tvp->v[0].target);
-		free(tvp->v[0].iqn);
-		free(tvp->v[0].mask);
-		free(tvp->v);
+	return ++device_id;
+}
+
+static void lun_exit(struct dev_lun *lu)
+{
+	switch (lu->dl->backend) {
+	case LUN_MAP:
+		msync(lu->mem, lu->n_lba * lu->block_size, MS_ASYNC);
+		if (opt_strict_free) {
+			munmap(lu->mem, lu->n_lba * lu->block_size);
+			close(lu->fd);
+			free(lu->dirty_map);
+			free(lu->flushing);
+		}
+		break;
+
+	case LUN_DIRECT:
+		fsync(lu->fd);
+		if (opt_strict_free) {
+			close(lu->fd);
+			free(lu->dirty_map);
+			free(lu->flushing);
+		}
+		break;
+
+	default:
+		if (opt_strict_free) {
+			munmap(lu->mem, lu->map_len);
+			free(lu->chunk_map);
+		}
+		break;
 	}
+
+	lu->dl->dev = NULL;
+	if (opt_strict_free)
+		free(lu);
+}
+
+static void master_iscsi_exit(void)
+{
+	int i, j;
+
+	target_shutdown(&gbls, opt_strict_free);
+	flusher_stop();
+
+	for (i = 0; i < tv.c; i++)
+		for (j = 0; j < tv.v[i].luns.c; j++)
+			if (tv.v[i].luns.v[j].dev)
+				lun_exit(tv.v[i].luns.v[j].dev);
+
+	if (opt_strict_free)
+		config_free(&tv);
 }
 
 static error_t parse_opt (int key, char *arg, struct argp_state *state)
 {
 	int v;
 	unsigned long long uv;
+	uint64_t uv64;
 	char *initial_str, *s, cv;
 
 	switch(key) {
@@ -1202,25 +3644,16 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 		break;
 
 	case 's':
-		if ((sscanf(arg, "%llu%c", &uv, &cv) == 2) && (uv > 0)) {
-			if (cv == 'k' || cv == 'K')
-				data_mem_lba = (uv * 1024) / data_lba_size;
-			else if (cv == 'm' || cv == 'M')
-				data_mem_lba = (uv * 1024 * 1024) / data_lba_size;
-			else if (cv == 'g' || cv == 'G')
-				data_mem_lba = (uv * 1024 * 1024 * 1024) / data_lba_size;
-			else {
-				fprintf(stderr, "Invalid memsize '%s'\n", arg);
-				argp_usage(state);
-			}
-		}
-
-		else {
+		if (config_parse_size(arg, &ram_size) < 0) {
 			fprintf(stderr, "Invalid memsize '%s'\n", arg);
 			argp_usage(state);
 		}
 		break;
 
+	case 'c':
+		config_fn = arg;
+		break;
+
 	case 'T':
 		initial_str = arg;
 		while ((s = strtok(initial_str, ", ")) != NULL) {
@@ -1248,11 +3681,138 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 	case 1001:
 		opt_strict_free = true;
 		break;
+	case 1002:
+		opt_sendfile = true;
+		break;
+	case 1003:
+		gbls.zerocopy_min = 65536;
+		if (arg) {
+			v = atoi(arg);
+			if (v <= 0) {
+				fprintf(stderr, "invalid zerocopy size: '%s'\n",
+					arg);
+				argp_usage(state);
+			}
+			gbls.zerocopy_min = v;
+		}
+		break;
+	case 1004:
+		v = atoi(arg);
+		if (v > 0 && v <= TARGET_MAX_QUEUE_DEPTH) {
+			gbls.queue_depth = v;
+		} else {
+			fprintf(stderr, "invalid queue depth: '%s'\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 1005:
+		v = atoi(arg);
+		if (v > 0 && v <= TARGET_MAX_WORKERS) {
+			gbls.n_workers = v;
+		} else {
+			fprintf(stderr, "invalid thread count: '%s'\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 1006:
+		v = atoi(arg);
+		if (v >= 0 && v <= TARGET_MAX_IO_THREADS) {
+			gbls.n_io_threads = v;
+		} else {
+			fprintf(stderr, "invalid storage thread count: '%s'\n",
+				arg);
+			argp_usage(state);
+		}
+		break;
+
+	case 1007:
+		opt_uring = true;
+		break;
+	case 1008:
+		gbls.net_uring = true;
+		break;
+	case 1009:
+		if (sscanf(arg, "%llu%c", &uv, &cv) != 1) {
+			fprintf(stderr, "invalid backlog: '%s'\n", arg);
+			argp_usage(state);
+		}
+		gbls.tx_high = uv;
+		gbls.tx_low = uv / 4;
+		break;
+	case 1010:
+		if (config_parse_size(arg, &ram_limit) < 0) {
+			fprintf(stderr, "Invalid RAM limit '%s'\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 1011:
+		if (!strcmp(arg, "thp")) {
+			ram_pages = RAM_PAGES_THP;
+			break;
+		}
+		if ((config_parse_size(arg, &uv64) < 0) ||
+		    (uv64 & (uv64 - 1)) || (uv64 < 4096)) {
+			fprintf(stderr, "Invalid page size '%s'\n", arg);
+			argp_usage(state);
+		}
+		if (uv64 == 4096) {
+			ram_pages = RAM_PAGES_BASE;
+		} else {
+			ram_pages = RAM_PAGES_HUGETLB;
+			ram_huge_shift = __builtin_ctzll(uv64);
+		}
+		break;
+	case 1012:
+		if (!strcmp(arg, "interleave"))
+			ram_node = RAM_NODE_INTERLEAVE;
+		else if ((sscanf(arg, "%llu%c", &uv, &cv) == 1) &&
+			 (uv < sizeof(unsigned long) * 8))
+			ram_node = uv;
+		else {
+			fprintf(stderr, "Invalid NUMA policy '%s'\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case 1013:
+		v = atoi(arg);
+		if ((v != 512) && (v != 4096)) {
+			fprintf(stderr, "Invalid block size '%s'\n", arg);
+			argp_usage(state);
+		}
+		block_size = v;
+		break;
+	case 1014:
+		if ((sscanf(arg, "%llu%c", &uv, &cv) != 1) || (uv > UINT_MAX)) {
+			fprintf(stderr, "Invalid flush age '%s'\n", arg);
+			argp_usage(state);
+		}
+		flush_age = uv;
+		break;
+	case 1015:
+		if (!strcmp(arg, "0"))
+			flush_dirty = 0;
+		else if (config_parse_size(arg, &flush_dirty) < 0) {
+			fprintf(stderr, "Invalid dirty limit '%s'\n", arg);
+			argp_usage(state);
+		}
+		break;
 
 	case ARGP_KEY_ARG:
 		argp_usage(state);	/* too many args */
 		break;
 	case ARGP_KEY_END:
+		if (opt_uring && !file_map_fn) {
+			fprintf(stderr, "--io-uring requires --file-map\n");
+			argp_usage(state);
+		}
+		if (config_fn && file_map_fn) {
+			fprintf(stderr, "--config excludes --file-map\n");
+			argp_usage(state);
+		}
+		if (gbls.net_uring && gbls.zerocopy_min) {
+			fprintf(stderr, "--net-uring excludes --zerocopy\n");
+			argp_usage(state);
+		}
 		break;
 	default:
 		return ARGP_ERR_UNKNOWN;
@@ -1267,14 +3827,43 @@ static void term_signal(int signo)
 	event_loopbreak();
 }
 
+static void stats_signal(int signo, short events, void *userdata)
+{
+	struct dev_ring *dr;
+	unsigned int i;
+
+	target_stats(stderr);
+
+	fprintf(stderr, "RAM storage: %" PRIu64 "KB written, %" PRIu64
+		"KB limit\n", __atomic_load_n(&ram_used, __ATOMIC_RELAXED) / 1024,
+		ram_limit / 1024);
+
+	if (flusher.running)
+		fprintf(stderr, "write-back: %" PRIu64 "KB dirty, %" PRIu64
+			" flushes of %" PRIu64 "KB, %" PRIu64 "us avg, %" PRIu64
+			"us max\n", flusher_dirty() / 1024, flusher.flushes,
+			flusher.bytes / 1024,
+			flusher.flushes ? flusher.ns / flusher.flushes / 1000 : 0,
+			flusher.ns_max / 1000);
+
+	for (i = 0; i < gbls.n_workers; i++) {
+		dr = gbls.workers[i].dev;
+		if (!dr)
+			continue;
+
+		fprintf(stderr, "thread %u: %" PRIu64 " io_uring SQEs in %"
+			PRIu64 " submissions\n", i, dr->ring.sqes_submitted,
+			dr->ring.submits);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	error_t aprc;
+	struct event stats_ev;
 
 	event_init();
 
-	INIT_LIST_HEAD(&gbls.sockets);
-
 	/*
 	 * parse command line
 	 */
@@ -1291,18 +3880,15 @@ int main(int argc, char *argv[])
 	signal(SIGINT, term_signal);
 	signal(SIGTERM, term_signal);
 
-	if (file_map_fn) {
-		if (map_init())
-			return 1;
-	} else {
-		if (mem_init())
-			return 1;
-	}
+	/* dump per-session statistics on demand */
+	signal_set(&stats_ev, SIGUSR1, stats_signal, NULL);
+	signal_add(&stats_ev, NULL);
 
-	if (net_init())
-		return 1;
+	/* the backing stores are opened first; io_uring registers them */
 	if (master_iscsi_init())
 		return 1;
+	if (net_init())
+		return 1;
 
 	/* the second opt_strict_free test is only redundant until
 	 * more options are added
@@ -1312,9 +3898,13 @@ int main(int argc, char *argv[])
 			opt_strict_free ? "strict-free" : "");
 	}
 
+	if (net_start())
+		server_running = false;
+
 	while (server_running)
 		event_dispatch();
 
+	net_stop();
 	master_iscsi_exit();
 	net_exit();
 
@@ -458,9 +458,7 @@ param_parse_security(struct iscsi_parameter *head,
 		     char *text_out, int *text_len_out, int textsize)
 {
 
-	static uint8_t  idData;
-	static uint8_t  chapdata[ISCSI_CHAP_DATA_LENGTH];
-	static uint8_t  respdata[ISCSI_CHAP_DATA_LENGTH];
+	uint8_t         respdata[ISCSI_CHAP_DATA_LENGTH];
 	char           *chapstring = NULL;
 	MD5_CTX        *context = NULL;
 	struct iscsi_parameter *param = NULL;
@@ -513,9 +511,9 @@ param_parse_security(struct iscsi_parameter *head,
 			}
 			param->tx_offer = 1;	/* sending an offer */
 			param->rx_offer = 0;	/* reset */
-			GenRandomData(&idData, 1);
+			GenRandomData(&cred->chap_id, 1);
 			snprintf(chapstring, ISCSI_CHAP_STRING_LENGTH,
-				 "%d", idData);
+				 "%d", cred->chap_id);
 			strlcpy(param->offer_tx, chapstring,
 				sizeof(param->offer_tx));
 			PARAM_TEXT_ADD(head, param->key, param->offer_tx,
@@ -527,8 +525,8 @@ param_parse_security(struct iscsi_parameter *head,
 			}
 			param->tx_offer = 1;	/* sending an offer */
 			param->rx_offer = 0;	/* reset */
-			GenRandomData(chapdata, ISCSI_CHAP_DATA_LENGTH);
-			HexDataToText(chapdata, ISCSI_CHAP_DATA_LENGTH,
+			GenRandomData(cred->chap_data, ISCSI_CHAP_DATA_LENGTH);
+			HexDataToText(cred->chap_data, ISCSI_CHAP_DATA_LENGTH,
 				      chapstring, ISCSI_CHAP_STRING_LENGTH);
 			strlcpy(param->offer_tx, chapstring,
 				sizeof(param->offer_tx));
@@ -539,7 +537,7 @@ param_parse_security(struct iscsi_parameter *head,
 		}
 	} else if (strcmp(param_in->key, "CHAP_I") == 0) {
 
-		idData =
+		cred->chap_id =
 		    driver_atoi((param_in->
 				 rx_offer) ? param_in->offer_rx : param_in->
 				answer_rx);
@@ -549,7 +547,7 @@ param_parse_security(struct iscsi_parameter *head,
 
 		HexTextToData((param_in->
 			       rx_offer) ? param_in->offer_rx : param_in->
-			      answer_rx, ISCSI_CHAP_STRING_LENGTH, chapdata,
+			      answer_rx, ISCSI_CHAP_STRING_LENGTH, cred->chap_data,
 			      ISCSI_CHAP_DATA_LENGTH);
 
 		if ((param = param_get(head, "CHAP_N")) == NULL) {
@@ -584,7 +582,7 @@ param_parse_security(struct iscsi_parameter *head,
 		param->tx_offer = 1;	/* sending an offer */
 		param->rx_offer = 0;	/* reset */
 		MD5_Init(context);
-		MD5_Update(context, &idData, 1);
+		MD5_Update(context, &cred->chap_id, 1);
 
 		if (cred->shared_secret == NULL) {
 			iscsi_trace_error(__FILE__, __LINE__,
@@ -595,11 +593,11 @@ param_parse_security(struct iscsi_parameter *head,
 				   strlen(cred->shared_secret));
 		}
 
-		HexDataToText(chapdata, ISCSI_CHAP_DATA_LENGTH,
+		HexDataToText(cred->chap_data, ISCSI_CHAP_DATA_LENGTH,
 			      param->offer_tx, ISCSI_CHAP_STRING_LENGTH);
-		MD5_Update(context, chapdata, ISCSI_CHAP_DATA_LENGTH);
-		MD5_Final(chapdata, context);
-		HexDataToText(chapdata, ISCSI_CHAP_DATA_LENGTH,
+		MD5_Update(context, cred->chap_data, ISCSI_CHAP_DATA_LENGTH);
+		MD5_Final(cred->chap_data, context);
+		HexDataToText(cred->chap_data, ISCSI_CHAP_DATA_LENGTH,
 			      param->offer_tx, ISCSI_CHAP_STRING_LENGTH);
 
 		PARAM_TEXT_ADD(head, param->key, param->offer_tx,
@@ -612,9 +610,9 @@ param_parse_security(struct iscsi_parameter *head,
 			}
 			param->tx_offer = 1;	/* sending an offer */
 			param->rx_offer = 0;	/* reset */
-			GenRandomData(&idData, 1);
+			GenRandomData(&cred->chap_id, 1);
 			snprintf(chapstring, ISCSI_CHAP_STRING_LENGTH,
-				 "%d", idData);
+				 "%d", cred->chap_id);
 			strlcpy(param->offer_tx, chapstring,
 				sizeof(param->offer_tx));
 			PARAM_TEXT_ADD(head, param->key, param->offer_tx,
@@ -626,8 +624,8 @@ param_parse_security(struct iscsi_parameter *head,
 			}
 			param->tx_offer = 1;	/* sending an offer */
 			param->rx_offer = 0;	/* reset */
-			GenRandomData(chapdata, ISCSI_CHAP_DATA_LENGTH);
-			HexDataToText(chapdata, ISCSI_CHAP_DATA_LENGTH,
+			GenRandomData(cred->chap_data, ISCSI_CHAP_DATA_LENGTH);
+			HexDataToText(cred->chap_data, ISCSI_CHAP_DATA_LENGTH,
 				      chapstring, ISCSI_CHAP_STRING_LENGTH);
 			strlcpy(param->offer_tx, chapstring,
 				sizeof(param->offer_tx));
@@ -653,11 +651,11 @@ param_parse_security(struct iscsi_parameter *head,
 
 		MD5_Init(context);
 
-		MD5_Update(context, &idData, 1);
+		MD5_Update(context, &cred->chap_id, 1);
 
-		HexDataToText(&idData, 1, param_in->offer_tx,
+		HexDataToText(&cred->chap_id, 1, param_in->offer_tx,
 			      ISCSI_CHAP_STRING_LENGTH);
-		HexDataToText(chapdata, ISCSI_CHAP_DATA_LENGTH, chapstring,
+		HexDataToText(cred->chap_data, ISCSI_CHAP_DATA_LENGTH, chapstring,
 			      ISCSI_CHAP_STRING_LENGTH);
 
 		if (cred->shared_secret == NULL) {
@@ -669,21 +667,21 @@ param_parse_security(struct iscsi_parameter *head,
 				   strlen(cred->shared_secret));
 		}
 
-		MD5_Update(context, chapdata, ISCSI_CHAP_DATA_LENGTH);
-		MD5_Final(chapdata, context);
+		MD5_Update(context, cred->chap_data, ISCSI_CHAP_DATA_LENGTH);
+		MD5_Final(cred->chap_data, context);
 
 		HexTextToData((param_in->
 			       rx_offer) ? param_in->offer_rx : param_in->
 			      answer_rx, ISCSI_CHAP_STRING_LENGTH, respdata,
 			      ISCSI_CHAP_DATA_LENGTH);
 
-		HexDataToText(chapdata, ISCSI_CHAP_DATA_LENGTH,
+		HexDataToText(cred->chap_data, ISCSI_CHAP_DATA_LENGTH,
 			      param_in->offer_rx, ISCSI_CHAP_STRING_LENGTH);
 
-		if (memcmp(respdata, chapdata, ISCSI_CHAP_DATA_LENGTH) != 0) {
+		if (memcmp(respdata, cred->chap_data, ISCSI_CHAP_DATA_LENGTH) != 0) {
 			iscsi_trace_error(__FILE__, __LINE__,
 					  "Initiator authentication failed %x %x\n",
-					  *chapdata, *respdata);
+					  *cred->chap_data, *respdata);
 			PPS_ERROR;
 		} else {
 			PPS_CLEANUP;
@@ -1461,6 +1459,7 @@ set_session_parameters(struct iscsi_parameter *head,
 	sess_params->first_burst = param_atoi(head, "FirstBurstLength");
 	sess_params->max_data_seg =
 	    param_atoi(head, "MaxRecvDataSegmentLength");
+	sess_params->max_r2t = param_atoi(head, "MaxOutstandingR2T");
 	sess_params->header_digest =
 	    (param_equiv(head, "HeaderDigest", "Yes")) ? 1 : 0;
 	sess_params->data_digest =
@@ -89,6 +89,8 @@ struct iscsi_cred {
 	char           *user;	/* user's name */
 	char           *auth_type;	/* preferred authentication type */
 	char           *shared_secret;	/* the shared secret which will be used */
+	uint8_t         chap_id;	/* CHAP exchange in progress */
+	uint8_t         chap_data[ISCSI_CHAP_DATA_LENGTH];
 };
 
 /*
@@ -99,6 +101,7 @@ struct iscsi_sess_param {
 	uint32_t        max_burst;
 	uint32_t        first_burst;
 	uint32_t        max_data_seg;
+	uint32_t        max_r2t;
 	struct iscsi_cred cred;
 	uint8_t         initial_r2t;
 	uint8_t         immediate_data;
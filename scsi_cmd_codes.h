@@ -52,6 +52,7 @@ enum {
 	VERIFY			= 0x2f,
 	PREFETCH_10		= 0x34,
 	SYNC_CACHE		= 0x35,
+	UNMAP			= 0x42,
 	LOG_SENSE		= 0x4d,
 	MODE_SELECT_10		= 0x55,
 	RESERVE_10		= 0x56,
@@ -63,6 +64,7 @@ enum {
 	WRITE_16		= 0x8a,
 	PREFETCH_16		= 0x90,
 	SYNC_CACHE_16		= 0x91,
+	WRITE_SAME_16		= 0x93,
 	SERVICE_ACTION_IN	= 0x9e,
 	REPORT_LUNS		= 0xa0,
 	MAINTENANCE_IN		= 0xa3,
@@ -158,7 +160,8 @@ enum {
 /* device return codes */
 enum {
 	SCSI_SUCCESS		= 0x0,
-	SCSI_CHECK_CONDITION	= 0x02
+	SCSI_CHECK_CONDITION	= 0x02,
+	SCSI_TASK_SET_FULL	= 0x28
 };
 
 /* sense keys */
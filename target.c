@@ -46,6 +46,7 @@
 
 #include <stdlib.h>
 #include <poll.h>
+#include <time.h>
 
 #ifdef HAVE_NETINET_TCP_H
 #include <netinet/tcp.h>
@@ -91,10 +92,13 @@
 #include <inttypes.h>
 #endif
 
+#include <sys/eventfd.h>
+
 #include "iscsi.h"
 #include "target.h"
 #include "parameters.h"
 #include "scsi_cmd_codes.h"
+#include "uring.h"
 
 enum {
 	TARGET_SHUT_DOWN = 0,
@@ -108,31 +112,702 @@ enum {
  ***********/
 
 static LIST_HEAD(session_list);
+static LIST_HEAD(nexus_list);
+
+/*
+ * Sessions stay on the worker thread that accepted them, and their event
+ * handlers run with the session's lock held.  Work reaching into other
+ * sessions -- task management, joining or leaving an iSCSI session --
+ * first drops the current session's lock, then takes the session list
+ * lock and each other session's lock in turn.  No thread holds two
+ * session locks at once.  Backing store claims take no session's lock
+ * but their own; see target_mem_claim().
+ */
+static pthread_rwlock_t sessions_lock;
+static __thread struct target_session *cur_sess;
+static __thread struct target_worker *cur_worker;
+
+/*
+ * Storage threads.  Device work that may block on the backing store,
+ * such as page faults and msync, is queued here rather than run on an
+ * event loop.
+ */
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;		/* queue not empty */
+	struct list_head	queue;
+	bool			stop;
+	unsigned int		n_threads;
+	pthread_t		*threads;
+} io_pool = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+	.work	= PTHREAD_COND_INITIALIZER,
+	.queue	= LIST_HEAD_INIT(io_pool.queue),
+};
+
+/*
+ * READ data queued by reference, straight from the backing store or as a
+ * range of its mapped file, indexed by address in 1MB regions.  A WRITE
+ * looks up only the regions it overwrites, under this lock alone.
+ */
+enum {
+	REF_REGION_SHIFT	= 20,
+	REF_HASH		= 1024,		/* buckets of regions */
+	REF_ZC_REAP_MS		= 10,		/* see sess_zc_watch() */
+};
+
+struct target_ref {
+	const uint8_t		*lo, *hi;	/* [lo, hi) of the store */
+	int			fd;		/* sent from fd, or -1 */
+	uint64_t		off;		/* ... its offset of lo */
+	struct target_session	*sess;		/* queued it */
+	bool			claimed;	/* a WRITE waits on it */
+	struct list_head	node;		/* on its bucket */
+	struct list_head	sess_node;	/* on sess->refs */
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	struct list_head	hash[REF_HASH];
+	unsigned int		n_refs;
+	uintptr_t		span;		/* most regions one spans */
+	struct list_head	waiters;	/* parked target_io */
+} refs = {
+	.lock	 = PTHREAD_MUTEX_INITIALIZER,
+	.waiters = LIST_HEAD_INIT(refs.waiters),
+};
+
+/*
+ * io_uring transport.  An event loop receives on all its sessions'
+ * sockets with multishot recvs into a ring of provided buffers, and
+ * sends PDUs with SENDMSG; the SQEs queued during one loop iteration
+ * go to the kernel together, from target_worker_flush().
+ *
+ * Completions are first only noted on their connection, by
+ * net_ring_cqe(), so that they may be reaped while some session's
+ * handler runs; net_ring_evt() then hands them to the sessions.
+ */
+enum {
+	NET_ENTRIES	= 256,		/* SQEs per event loop */
+	NET_BUFS	= 256,		/* receive buffers per event loop */
+	NET_BUF_SIZE	= 16 * 1024,
+
+	NET_CLOSE_WAIT_MS = 1000,	/* max wait for a cancelled send */
+
+	NET_OP_RECV	= 1,		/* low bits of user_data */
+	NET_OP_SEND	= 2,
+	NET_OP_MASK	= 3,
+};
+
+enum net_send_state {
+	NET_SEND_IDLE,
+	NET_SEND_BUSY,			/* with the kernel */
+	NET_SEND_DONE,			/* send_res not yet applied */
+};
+
+struct net_ring {
+	struct uring		ring;
+	int			efd;		/* signalled on completions */
+	struct event		ev;
+
+	struct io_uring_buf_ring *br;		/* provided buffers */
+	uint8_t			*bufs;
+	uint16_t		br_tail;
+	unsigned int		bufs_free;	/* with the kernel, or in CQEs */
+
+	struct list_head	ready;		/* conns with completions */
+	struct list_head	nobufs;		/* conns awaiting a buffer */
+	unsigned int		n_conns;
+
+	/* other threads wait here for sends to complete */
+	pthread_mutex_t		send_lock;
+	pthread_cond_t		send_done;
+	unsigned int		send_waiters;
+};
+
+/* a session's socket; outlives the session until its SQEs complete */
+struct net_conn {
+	struct target_session	*sess;		/* NULL once ended */
+	struct net_ring		*nr;
+	unsigned int		n_ops;		/* SQEs yet to complete */
+
+	bool			recv_armed;
+	bool			recv_nobufs;	/* on nr->nobufs */
+	int			recv_err;	/* -errno, or -EPIPE at EOF */
+	unsigned int		rxq_head;	/* buffers received */
+	unsigned int		rxq_tail;
+	uint16_t		rxq_bid[NET_BUFS];
+	uint32_t		rxq_len[NET_BUFS];
+
+	int			send_state;	/* enum net_send_state */
+	int			send_res;
+	struct msghdr		msg;
+	struct iovec		iov[ATCP_MAX_WR_IOV];
+
+	bool			on_ready;
+	struct list_head	ready_node;
+	struct list_head	nobufs_node;
+};
+
 static int target_data_pdu(struct target_session *sess);
+static void target_read_evt(struct target_session *sess);
+static void net_conn_close(struct target_session *sess);
+static bool sess_rx_pause(struct target_session *sess);
+static void sess_rx_stop(struct target_session *sess);
+static void sess_rx_resume(struct target_session *sess);
+static struct target_ref *sess_ref_add(struct target_session *sess,
+				       const uint8_t *buf, size_t len,
+				       int fd, uint64_t off);
+static bool target_ref_put(struct atcp_wr_state *wst, void *cb_data,
+			   bool done);
+static void sess_claims_cancel(struct target_session *sess);
+static void target_zc_evt(int fd, short events, void *userdata);
+static void sess_hold_watch(struct target_session *sess);
+static void target_hold_evt(int fd, short events, void *userdata);
 
 /*********************
  * Private Functions *
  *********************/
 
-static void pdu_cleanup(struct target_pdu *pdu)
+static void pdu_cleanup(struct target_session *sess, struct target_pdu *pdu)
 {
 	if (!pdu)
 		return;
 
-	free(pdu->ahs);
-	free(pdu->data);
+	seg_put(&sess->segs, pdu->ahs);
+	if (!pdu->data_direct && !pdu->data_in_rx)
+		seg_put(&sess->segs, pdu->data);
 
 	pdu->ahs = NULL;
 	pdu->data = NULL;
 }
 
-static void pdu_reinit(struct target_pdu *pdu)
+static void pdu_reinit(struct target_session *sess, struct target_pdu *pdu)
 {
-	pdu_cleanup(pdu);
+	pdu_cleanup(sess, pdu);
 
 	memset(pdu, 0, sizeof(*pdu));
 }
 
+static void sess_enter(struct target_session *sess)
+{
+	pthread_mutex_lock(&sess->lock);
+	cur_sess = sess;
+	cur_worker = sess->worker;
+}
+
+static void sess_leave(struct target_session *sess)
+{
+	cur_sess = NULL;
+	pthread_mutex_unlock(&sess->lock);
+}
+
+static void sessions_lock_begin(bool write)
+{
+	if (cur_sess)
+		pthread_mutex_unlock(&cur_sess->lock);
+
+	if (write)
+		pthread_rwlock_wrlock(&sessions_lock);
+	else
+		pthread_rwlock_rdlock(&sessions_lock);
+}
+
+static void sessions_lock_end(void)
+{
+	pthread_rwlock_unlock(&sessions_lock);
+
+	if (cur_sess)
+		pthread_mutex_lock(&cur_sess->lock);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * The CmdSN window is sized by the session's credit, less the tasks held
+ * in the task tables past their command PDU.  MaxCmdSN never moves
+ * backwards, so a smaller credit only holds it back while tasks finish.
+ *
+ * A new session gets the whole queue depth.  Under load the credit
+ * follows storage latency (see sess_window_sample()), and is halved
+ * while the connection's responses back up in its write queue.
+ */
+static void nexus_window_update(struct target_session *sess)
+{
+	struct target_nexus *nx = sess->nexus;
+	struct globals *gp = sess->globals;
+	unsigned int credit;
+	uint32_t max;
+
+	if (!nx->window)
+		nx->window = gp->queue_depth;
+
+	credit = nx->window;
+	if (gp->tx_high && (atcp_wunsent(&sess->wst) > gp->tx_low))
+		credit = MAX(credit / 2, 1);
+
+	max = nx->ExpCmdSN + credit - nx->n_tasks - 1;
+	if ((int32_t)(max - nx->MaxCmdSN) > 0)
+		nx->MaxCmdSN = max;
+}
+
+static void sess_window_update(struct target_session *sess)
+{
+	struct target_nexus *nx = sess->nexus;
+
+	pthread_mutex_lock(&nx->lock);
+	nexus_window_update(sess);
+	pthread_mutex_unlock(&nx->lock);
+}
+
+/*
+ * Feed back the storage latency of a command.  Latency well past the
+ * uncongested baseline means commands are queueing in the backing store:
+ * cut the credit by an eighth.  Otherwise, if the credit is all in use,
+ * grow it by one.  After an idle second nothing can still be queued, so
+ * the first command back gets the whole queue depth again, judged
+ * against a fresh average.
+ *
+ * The baseline is the least latency seen over the last one to two
+ * epochs, so that it follows a device that has become slower.
+ */
+static void sess_window_sample(struct target_session *sess, uint64_t ns)
+{
+	struct target_nexus *nx = sess->nexus;
+	unsigned int depth = sess->globals->queue_depth;
+	unsigned int floor = MIN(TARGET_MIN_WINDOW, depth);
+	uint64_t now = now_ns();
+
+	pthread_mutex_lock(&nx->lock);
+
+	if (now - nx->lat_last >= TARGET_IDLE_MS * 1000000ULL) {
+		nx->window = depth;
+		nx->lat_avg = 0;
+	}
+	nx->lat_last = now;
+
+	if (now - nx->lat_epoch >= TARGET_LAT_EPOCH_MS * 1000000ULL) {
+		nx->lat_min = nx->lat_min_next;
+		nx->lat_min_next = 0;
+		nx->lat_epoch = now;
+	}
+	if (!nx->lat_min_next || ns < nx->lat_min_next)
+		nx->lat_min_next = ns;
+	if (!nx->lat_min || ns < nx->lat_min)
+		nx->lat_min = ns;
+	nx->lat_avg = nx->lat_avg ? (nx->lat_avg * 7 + ns) / 8 : ns;
+
+	if (nx->lat_avg > 2 * nx->lat_min + TARGET_LAT_SLACK) {
+		if (nx->window > floor) {
+			nx->window -= MAX(nx->window / 8, 1);
+			nx->window = MAX(nx->window, floor);
+			nx->window_cuts++;
+		}
+	} else if ((nx->n_tasks + 1 >= nx->window) && (nx->window < depth))
+		nx->window++;
+
+	if (!nx->window_min || nx->window < nx->window_min)
+		nx->window_min = nx->window;
+
+	pthread_mutex_unlock(&nx->lock);
+}
+
+static void sess_window_get(struct target_session *sess, uint32_t *exp,
+			    uint32_t *max)
+{
+	struct target_nexus *nx = sess->nexus;
+
+	pthread_mutex_lock(&nx->lock);
+	*exp = nx->ExpCmdSN;
+	*max = nx->MaxCmdSN;
+	pthread_mutex_unlock(&nx->lock);
+}
+
+static bool nexus_cmdsn_test(struct target_nexus *nx, uint32_t CmdSN)
+{
+	uint32_t bit = CmdSN % TARGET_MAX_QUEUE_DEPTH;
+
+	return nx->cmdsn_seen[bit / 32] & (1U << (bit % 32));
+}
+
+/* is CmdSN within the window, and not received before?  nx->lock held */
+static bool nexus_cmdsn_valid(struct target_nexus *nx, uint32_t CmdSN)
+{
+	return ((int32_t)(CmdSN - nx->ExpCmdSN) >= 0) &&
+	       ((int32_t)(nx->MaxCmdSN - CmdSN) >= 0) &&
+	       !nexus_cmdsn_test(nx, CmdSN);
+}
+
+/*
+ * Commands sent over different connections of a session may arrive out
+ * of order, but are delivered to the SCSI layer in CmdSN order.  A
+ * non-immediate command ahead of ExpCmdSN is held, unexecuted, with
+ * reads stopped on its connection; sess_cmdsn_recv() wakes the
+ * connection once the commands before it have arrived.  A command
+ * outside the window, or a duplicate, is not held: it is refused.
+ */
+static bool sess_cmdsn_hold(struct target_session *sess)
+{
+	struct target_nexus *nx = sess->nexus;
+	uint8_t *header = (uint8_t *) &sess->pdu.header;
+	uint32_t CmdSN;
+	bool ahead;
+
+	if (sess->cmdsn_held)
+		return true;
+	if (!sess->IsFullFeature || (header[0] & 0x40))	/* Immediate */
+		return false;
+
+	switch (ISCSI_OPCODE(header)) {
+	case ISCSI_NOP_OUT:
+	case ISCSI_SCSI_CMD:
+	case ISCSI_TASK_CMD:
+	case ISCSI_TEXT_CMD:
+	case ISCSI_LOGOUT_CMD:
+		break;
+	default:
+		return false;
+	}
+
+	CmdSN = ntohl(*((uint32_t *) (void *)(header + 24)));
+
+	pthread_mutex_lock(&nx->lock);
+	ahead = ((int32_t)(CmdSN - nx->ExpCmdSN) > 0) &&
+		nexus_cmdsn_valid(nx, CmdSN);
+	if (ahead) {
+		sess->cmdsn_wait = CmdSN;
+		list_add_tail(&sess->cmdsn_node, &nx->cmdsn_waiters);
+	}
+	pthread_mutex_unlock(&nx->lock);
+
+	if (!ahead)
+		return false;
+
+	iscsi_trace(TRACE_ISCSI_CMD, __FILE__, __LINE__,
+		    "session %d: CmdSN %u held for ExpCmdSN %u\n",
+		    sess->id, CmdSN, nx->ExpCmdSN);
+	sess->cmdsn_held = true;
+	sess->cmdsn_holds++;
+	sess_rx_stop(sess);
+	sess_hold_watch(sess);
+	return true;
+}
+
+/*
+ * Account for a non-immediate command.  ExpCmdSN advances past each run
+ * of CmdSNs received, releasing the connections holding the commands
+ * that are now due.  A CmdSN outside the window, or received before, is
+ * refused.
+ */
+static int sess_cmdsn_recv(struct target_session *sess, uint32_t CmdSN)
+{
+	struct target_nexus *nx = sess->nexus;
+	uint32_t bit = CmdSN % TARGET_MAX_QUEUE_DEPTH;
+	struct target_session *conn, *tmp;
+
+	pthread_mutex_lock(&nx->lock);
+
+	if (!nexus_cmdsn_valid(nx, CmdSN)) {
+		iscsi_trace_warning(__FILE__, __LINE__,
+				    "session %d: CmdSN %u outside window "
+				    "[%u, %u] or duplicate\n", sess->id, CmdSN,
+				    nx->ExpCmdSN, nx->MaxCmdSN);
+		pthread_mutex_unlock(&nx->lock);
+		return -1;
+	}
+
+	nx->cmdsn_seen[bit / 32] |= 1U << (bit % 32);
+
+	while (nexus_cmdsn_test(nx, nx->ExpCmdSN)) {
+		bit = nx->ExpCmdSN++ % TARGET_MAX_QUEUE_DEPTH;
+		nx->cmdsn_seen[bit / 32] &= ~(1U << (bit % 32));
+	}
+
+	list_for_each_entry_safe(conn, tmp, &nx->cmdsn_waiters, cmdsn_node)
+		if ((int32_t)(conn->cmdsn_wait - nx->ExpCmdSN) <= 0) {
+			list_del_init(&conn->cmdsn_node);
+			target_worker_wake(conn->worker);
+		}
+
+	pthread_mutex_unlock(&nx->lock);
+	return 0;
+}
+
+static struct target_task *task_find(struct target_session *sess,
+				     uint32_t tag)
+{
+	struct target_task *task;
+
+	list_for_each_entry(task, &sess->task_hash[tag % TARGET_TASK_HASH],
+			    node) {
+		if (task->scsi_cmd.tag == tag)
+			return task;
+	}
+
+	return NULL;
+}
+
+static struct target_task *task_alloc(struct target_session *sess)
+{
+	struct target_task *task;
+	struct target_seg *parked;
+	uint32_t parked_size;
+
+	if (list_empty(&sess->task_free))
+		return NULL;
+
+	task = list_entry(sess->task_free.next, struct target_task, node);
+	list_del(&task->node);
+
+	/* keep the parking array for reuse */
+	parked = task->parked;
+	parked_size = task->parked_size;
+	memset(task, 0, sizeof(*task));
+	task->parked = parked;
+	task->parked_size = parked_size;
+	INIT_LIST_HEAD(&task->node);
+
+	return task;
+}
+
+/* the task outlives its command PDU, e.g. awaiting Data-Out */
+static void task_hold(struct target_session *sess, struct target_task *task)
+{
+	task->held = true;
+	pthread_mutex_lock(&sess->nexus->lock);
+	sess->nexus->n_tasks++;
+	pthread_mutex_unlock(&sess->nexus->lock);
+	if (++sess->n_tasks > sess->n_tasks_max)
+		sess->n_tasks_max = sess->n_tasks;
+}
+
+/* done with; reopen the CmdSN window before the response goes out */
+static void task_unhold(struct target_session *sess, struct target_task *task)
+{
+	if (!task->held)
+		return;
+
+	task->held = false;
+	sess->n_tasks--;
+
+	pthread_mutex_lock(&sess->nexus->lock);
+	sess->nexus->n_tasks--;
+	nexus_window_update(sess);
+	pthread_mutex_unlock(&sess->nexus->lock);
+}
+
+static void task_free(struct target_session *sess, struct target_task *task)
+{
+	/* still with a storage thread; target_io_done() finishes the job */
+	if (task->io.busy) {
+		task->io.aborted = true;
+		list_del_init(&task->node);
+		task_unhold(sess, task);
+		return;
+	}
+
+	if (task->io.release) {
+		task->io.release(&task->io.cmd);
+		task->io.release = NULL;
+	}
+
+	/* data never committed is dropped */
+	while (task->n_parked > 0)
+		seg_put(&sess->segs, task->parked[--task->n_parked].base);
+
+	list_del(&task->node);
+	list_add(&task->node, &sess->task_free);
+
+	task_unhold(sess, task);
+}
+
+static void task_free_all(struct target_session *sess)
+{
+	struct target_task *task, *tmp;
+	unsigned int i;
+
+	for (i = 0; i < TARGET_TASK_HASH; i++)
+		list_for_each_entry_safe(task, tmp, &sess->task_hash[i], node)
+			task_free(sess, task);
+}
+
+/*
+ * Task management reaches the tasks of every connection of the session.
+ * Those of other connections are aborted by their own worker, as it may
+ * be using them right now.  Until each has confirmed, the response is
+ * held, with reads stopped; target_wake_evt() sends it.  Returns the
+ * response, or -1 if it is held.
+ */
+static int sess_task_abort(struct target_session *sess, bool all,
+			   uint32_t tag)
+{
+	struct target_nexus *nx = sess->nexus;
+	struct target_session *conn;
+	struct target_abort *ab;
+	struct target_task *task;
+	bool found = false, full = false, posted;
+	int response;
+
+	if (all) {
+		task_free_all(sess);
+	} else if ((task = task_find(sess, tag)) != NULL) {
+		task_free(sess, task);
+		return ISCSI_TASK_RSP_FUNCTION_COMPLETE;
+	}
+
+	/* the connection's own count, so that none completes it early */
+	pthread_mutex_lock(&nx->lock);
+	sess->tmf_seq = ++nx->tmf_seq;
+	sess->tmf_waits = 1;
+	list_add_tail(&sess->tmf_node, &nx->tmf_waiters);
+	pthread_mutex_unlock(&nx->lock);
+
+	sessions_lock_begin(false);
+	list_for_each_entry(conn, &nx->conns, conns_node) {
+		if (conn == sess)
+			continue;
+
+		posted = false;
+		pthread_mutex_lock(&conn->lock);
+		if (!all && !task_find(conn, tag)) {
+			pthread_mutex_unlock(&conn->lock);
+			continue;
+		}
+		found = true;
+		if (conn->n_aborts < TARGET_ABORT_TAGS) {
+			ab = &conn->aborts[conn->n_aborts++];
+			ab->all = all;
+			ab->tag = tag;
+			ab->tmf_seq = sess->tmf_seq;
+			pthread_mutex_lock(&nx->lock);
+			sess->tmf_waits++;
+			pthread_mutex_unlock(&nx->lock);
+			posted = true;
+		} else
+			full = true;
+		pthread_mutex_unlock(&conn->lock);
+
+		if (posted)
+			target_worker_wake(conn->worker);
+		if (!all)
+			break;
+	}
+	sessions_lock_end();
+
+	if (full)
+		response = ISCSI_TASK_RSP_REJECTED;
+	else if (!all && !found)
+		response = ISCSI_TASK_RSP_NO_SUCH_TASK;
+	else
+		response = ISCSI_TASK_RSP_FUNCTION_COMPLETE;
+
+	pthread_mutex_lock(&nx->lock);
+	if (--sess->tmf_waits == 0)
+		list_del_init(&sess->tmf_node);
+	else
+		sess->tmf_held = true;
+	pthread_mutex_unlock(&nx->lock);
+
+	if (!sess->tmf_held)
+		return response;
+
+	sess->tmf_response = response;
+	sess_rx_stop(sess);
+	sess_hold_watch(sess);
+	return -1;
+}
+
+/* an abort posted for TMF seq is done; the last lets its response go */
+static void nexus_tmf_confirm(struct target_nexus *nx, uint32_t seq)
+{
+	struct target_session *conn;
+
+	pthread_mutex_lock(&nx->lock);
+	list_for_each_entry(conn, &nx->tmf_waiters, tmf_node)
+		if (conn->tmf_seq == seq) {
+			if (--conn->tmf_waits == 0) {
+				list_del_init(&conn->tmf_node);
+				target_worker_wake(conn->worker);
+			}
+			break;
+		}
+	pthread_mutex_unlock(&nx->lock);
+}
+
+/* carry out aborts posted by other connections */
+static void sess_abort_pending(struct target_session *sess)
+{
+	struct target_abort *ab;
+	struct target_task *task;
+
+	while (sess->n_aborts > 0) {
+		ab = &sess->aborts[--sess->n_aborts];
+		if (ab->all)
+			task_free_all(sess);
+		else if ((task = task_find(sess, ab->tag)) != NULL)
+			task_free(sess, task);
+		nexus_tmf_confirm(sess->nexus, ab->tmf_seq);
+	}
+}
+
+/*
+ * Park the current PDU's data segment, destined for offset off of the
+ * transfer, in task->parked until device_commit().  Data parsed in place
+ * from the receive buffer must be copied out, as the buffer is reused;
+ * data received into the backing store is parked with a NULL base.
+ */
+static int pdu_park_data(struct target_session *sess,
+			 struct target_task *task, uint32_t off,
+			 unsigned int len)
+{
+	struct target_pdu *pdu = &sess->pdu;
+	struct target_seg *seg;
+	void *data = pdu->data;
+	uint32_t n;
+
+	if (task->n_parked == task->parked_size) {
+		n = task->parked_size ? task->parked_size * 2 : 16;
+		RENEW(struct target_seg, task->parked, n, "pdu_park_data",
+		      return -1);
+		task->parked_size = n;
+	}
+
+	if (pdu->data_direct)
+		data = NULL;
+	else if (pdu->data_in_rx) {
+		data = seg_get(&sess->segs, len);
+		if (!data)
+			return -1;
+		memcpy(data, pdu->data, len);
+	}
+
+	pdu->data = NULL;
+	pdu->data_direct = false;
+	pdu->data_in_rx = false;
+
+	seg = &task->parked[task->n_parked++];
+	seg->base = data;
+	seg->off = off;
+	seg->len = len;
+
+	return 0;
+}
+
+/* follow a (re)negotiation of session parameters */
+static void sess_params_update(struct target_session *sess)
+{
+	set_session_parameters(sess->params, &sess->sess_params);
+
+	if (sess->sess_params.max_data_seg)
+		seg_pool_set_max(&sess->segs, sess->sess_params.max_data_seg);
+}
+
 static char *get_iqn(const struct target_session *sess, int t, char *buf,
 		     size_t size)
 {
@@ -155,11 +830,10 @@ static int reject_t(struct target_session *sess, const uint8_t * header,
 	reject.reason = reason;
 	reject.length = ISCSI_HEADER_LEN;
 	reject.StatSN = ++(sess->StatSN);
-	reject.ExpCmdSN = sess->ExpCmdSN;
-	reject.MaxCmdSN = sess->MaxCmdSN;
+	sess_window_get(sess, &reject.ExpCmdSN, &reject.MaxCmdSN);
 	reject.DataSN = 0;	/* SNACK not yet implemented */
 
-	rsp_header = header_get();
+	rsp_header = header_get(&sess->wst);
 	if (!rsp_header)
 		goto err_out;
 
@@ -179,7 +853,7 @@ static int reject_t(struct target_session *sess, const uint8_t * header,
 	return 0;
 
 err_out_hdr:
-	header_put(rsp_header);
+	header_put(&sess->wst, rsp_header);
 err_out:
 	return -1;
 }
@@ -187,13 +861,15 @@ err_out:
 /* send READ data from target (us) to initiator */
 static int send_read_data(struct target_session *sess,
 			  struct iscsi_scsi_cmd_args *scsi_cmd,
-			  uint32_t *DataSN)
+			  uint32_t *DataSN, const struct target_cmd *tc)
 {
 	struct iscsi_read_data data;
+	struct target_ref *ref;
 	uint8_t		*rsp_header;
 	uint32_t        offset, trans_len;
 	int             fragment_flag = 0;
 	int             offset_inc;
+	int		rc;
 
 	if (scsi_cmd->output) {
 		iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
@@ -248,12 +924,11 @@ static int send_read_data(struct target_session *sess,
 			return -1;
 		}
 		data.task_tag = scsi_cmd->tag;
-		data.ExpCmdSN = sess->ExpCmdSN;
-		data.MaxCmdSN = sess->MaxCmdSN;
+		sess_window_get(sess, &data.ExpCmdSN, &data.MaxCmdSN);
 		data.DataSN = (*DataSN)++;
 		data.offset = offset;
 
-		rsp_header = header_get();
+		rsp_header = header_get(&sess->wst);
 		if (!rsp_header)
 			goto err_out;
 
@@ -263,9 +938,31 @@ static int send_read_data(struct target_session *sess,
 			goto err_out_hdr;
 		}
 
-		if (iscsi_writev(&sess->wst, rsp_header, ISCSI_HEADER_LEN,
-				 scsi_cmd->send_data + offset, data.length)
-				    != ISCSI_HEADER_LEN + data.length) {
+		/* data sent by reference is indexed for WRITEs to find */
+		ref = NULL;
+		if (tc->send_ref)
+			ref = sess_ref_add(sess, scsi_cmd->send_data + offset,
+					   data.length,
+					   tc->send_file ? tc->send_fd : -1,
+					   tc->send_off + offset);
+
+		if (ref && tc->send_file)
+			rc = iscsi_writev_file(&sess->wst, rsp_header,
+					       ISCSI_HEADER_LEN, tc->send_fd,
+					       tc->send_off + offset,
+					       data.length, target_ref_put,
+					       ref);
+		else if (ref)
+			rc = iscsi_writev_ref(&sess->wst, rsp_header,
+					      ISCSI_HEADER_LEN,
+					      scsi_cmd->send_data + offset,
+					      data.length, target_ref_put, ref);
+		else
+			rc = iscsi_writev(&sess->wst, rsp_header,
+					  ISCSI_HEADER_LEN,
+					  scsi_cmd->send_data + offset,
+					  data.length);
+		if (rc != ISCSI_HEADER_LEN + data.length) {
 			iscsi_trace_error(__FILE__, __LINE__,
 					  "iscsi_writev() failed\n");
 			goto err_out_hdr;
@@ -284,15 +981,15 @@ static int send_read_data(struct target_session *sess,
 	return 0;
 
 err_out_hdr:
-	header_put(rsp_header);
+	header_put(&sess->wst, rsp_header);
 err_out:
 	return -1;
 }
 
 static int send_rsp_pdu(struct target_session *sess,
-			struct iscsi_scsi_cmd_args *scsi_cmd,
-			uint32_t *DataSN)
+			struct target_task *task)
 {
+	struct iscsi_scsi_cmd_args *scsi_cmd = &task->scsi_cmd;
 	uint8_t *rsp_header;
 	struct iscsi_scsi_rsp scsi_rsp;
 	bool send_it = false;
@@ -318,19 +1015,14 @@ static int send_rsp_pdu(struct target_session *sess,
 	memset(&scsi_rsp, 0x0, sizeof(scsi_rsp));
 	scsi_rsp.length = scsi_cmd->status ? scsi_cmd->length : 0;
 	scsi_rsp.tag = scsi_cmd->tag;
-	/* If r2t send, then the StatSN is already incremented */
-	if (sess->StatSN < scsi_cmd->ExpStatSN) {
-		++sess->StatSN;
-	}
-	scsi_rsp.StatSN = sess->StatSN;
-	scsi_rsp.ExpCmdSN = sess->ExpCmdSN;
-	scsi_rsp.MaxCmdSN = sess->MaxCmdSN;
+	scsi_rsp.StatSN = ++(sess->StatSN);
+	sess_window_get(sess, &scsi_rsp.ExpCmdSN, &scsi_rsp.MaxCmdSN);
 	scsi_rsp.ExpDataSN = (!scsi_cmd->status
-			      && scsi_cmd->input) ? (*DataSN) : 0;
+			      && scsi_cmd->input) ? task->DataSN : 0;
 	scsi_rsp.response = 0x00;	/* iSCSI response */
 	scsi_rsp.status = scsi_cmd->status;	/* SCSI status */
 
-	rsp_header = header_get();
+	rsp_header = header_get(&sess->wst);
 	if (!rsp_header)
 		goto err_out;
 
@@ -348,10 +1040,10 @@ static int send_rsp_pdu(struct target_session *sess,
 		goto err_out_hdr;
 	}
 
-	/* Make sure all data was transferred */
+	/* Make sure all data was transferred, unless the command failed */
 
-	if (scsi_cmd->output) {
-		scsi_cmd->bytes_recv = sess->xfer.bytes_recv;
+	if (scsi_cmd->output && !scsi_cmd->status) {
+		scsi_cmd->bytes_recv = task->xfer.bytes_recv;
 		RETURN_NOT_EQUAL("scsi_cmd->bytes_recv",
 				 scsi_cmd->bytes_recv,
 				 scsi_cmd->trans_len, , -1);
@@ -374,23 +1066,76 @@ static int send_rsp_pdu(struct target_session *sess,
 	return 0;
 
 err_out_hdr:
-	header_put(rsp_header);
+	header_put(&sess->wst, rsp_header);
 err_out:
 	return -1;
 }
 
-static int scsi_command_t(struct target_session *sess, const uint8_t * header,
-			  struct iscsi_scsi_cmd_args *scsi_cmd)
+/*
+ * With the task table full, the command is accepted into the CmdSN
+ * sequence but failed with TASK SET FULL.
+ */
+static int task_set_full(struct target_session *sess, const uint8_t *header)
 {
-	struct target_cmd cmd = {
-		.scsi_cmd	= scsi_cmd,
-	};
+	struct target_task task;
 
-	if (iscsi_scsi_cmd_decap(header, scsi_cmd) != 0) {
+	memset(&task, 0, sizeof(task));
+	if (iscsi_scsi_cmd_decap(header, &task.scsi_cmd) != 0) {
 		iscsi_trace_error(__FILE__, __LINE__,
 				  "iscsi_scsi_cmd_decap() failed\n");
 		return -1;
 	}
+
+	iscsi_trace_warning(__FILE__, __LINE__,
+			    "session %d: task set full (%u tasks), "
+			    "refusing CmdSN %u\n", sess->id, sess->n_tasks,
+			    task.scsi_cmd.CmdSN);
+	sess->task_set_full++;
+
+	if (!task.scsi_cmd.immediate)
+		sess_cmdsn_recv(sess, task.scsi_cmd.CmdSN);
+
+	task.scsi_cmd.input = task.scsi_cmd.output = 0;
+	task.scsi_cmd.status = SCSI_TASK_SET_FULL;
+	task.scsi_cmd.length = 0;
+
+	return send_rsp_pdu(sess, &task);
+}
+
+static int scsi_command_t(struct target_session *sess, const uint8_t * header)
+{
+	struct target_task *task;
+	struct iscsi_scsi_cmd_args *scsi_cmd;
+	struct target_cmd cmd;
+	uint64_t start;
+
+	task = task_alloc(sess);
+	if (!task)
+		return task_set_full(sess, header);
+
+	scsi_cmd = &task->scsi_cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.scsi_cmd = scsi_cmd;
+	cmd.task = task;
+
+	if (iscsi_scsi_cmd_decap(header, scsi_cmd) != 0) {
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "iscsi_scsi_cmd_decap() failed\n");
+		goto err_out;
+	}
+
+	/* the header is reused for the next PDU */
+	memcpy(task->cdb, scsi_cmd->cdb, sizeof(task->cdb));
+	scsi_cmd->cdb = task->cdb;
+
+	if (task_find(sess, scsi_cmd->tag)) {
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "session %d: ITT %#x already in use\n",
+				  sess->id, scsi_cmd->tag);
+		goto err_out;
+	}
+	list_add(&task->node,
+		 &sess->task_hash[scsi_cmd->tag % TARGET_TASK_HASH]);
 	iscsi_trace(TRACE_ISCSI_DEBUG | TRACE_SCSI_CMD, __FILE__, __LINE__,
 		    "session %d: SCSI Command (CmdSN %u, op %#x %s)\n", sess->id,
 		    scsi_cmd->CmdSN,
@@ -398,15 +1143,11 @@ static int scsi_command_t(struct target_session *sess, const uint8_t * header,
 
 	/* For Non-immediate commands, the CmdSN should be between ExpCmdSN  */
 	/* and MaxCmdSN, inclusive of both.  Otherwise, ignore the command */
-	if ((!scsi_cmd->immediate) && ((scsi_cmd->CmdSN < sess->ExpCmdSN)
-				      || (scsi_cmd->CmdSN > sess->MaxCmdSN))) {
+	if (!scsi_cmd->immediate && (sess_cmdsn_recv(sess, scsi_cmd->CmdSN) < 0)) {
 		iscsi_trace_error(__FILE__, __LINE__,
-				  "CmdSN(%d) of SCSI Command not valid, "
-				  "ExpCmdSN(%d) MaxCmdSN(%d). "
-				  "Ignoring the command\n",
-				  scsi_cmd->CmdSN, sess->ExpCmdSN,
-				  sess->MaxCmdSN);
-		return 0;
+				  "CmdSN(%u) of SCSI Command not valid. "
+				  "Ignoring the command\n", scsi_cmd->CmdSN);
+		goto out;
 	}
 
 	/* Arg check.   */
@@ -416,13 +1157,6 @@ static int scsi_command_t(struct target_session *sess, const uint8_t * header,
 	 * -1);
 	 */
 
-	/* Check Numbering */
-	if (scsi_cmd->CmdSN != sess->ExpCmdSN) {
-		iscsi_trace_warning(__FILE__, __LINE__,
-				    "Expected CmdSN %d, got %d. (ignoring and resetting expectations)\n",
-				    sess->ExpCmdSN, scsi_cmd->CmdSN);
-		sess->ExpCmdSN = scsi_cmd->CmdSN;
-	}
 	/* Check Transfer Lengths */
 	if (sess->sess_params.first_burst
 	    && (scsi_cmd->length > sess->sess_params.first_burst)) {
@@ -440,7 +1174,7 @@ static int scsi_command_t(struct target_session *sess, const uint8_t * header,
 				  "scsi_cmd->length (%u) > MaxRecvDataSegmentLength (%u)\n",
 				  scsi_cmd->length,
 				  sess->sess_params.max_data_seg);
-		return -1;
+		goto err_out;
 	}
 #if 0
 	/* commented out in original Intel reference code */
@@ -501,9 +1235,6 @@ static int scsi_command_t(struct target_session *sess, const uint8_t * header,
 		scsi_cmd->ahs = NULL;
 	}
 
-	sess->ExpCmdSN++;
-	sess->MaxCmdSN++;
-
 	/* Execute cdb.  device_command() will set scsi_cmd->input if */
 	/* there is input data and set the length of the input */
 	/* to either scsi_cmd->trans_len or scsi_cmd->bidi_trans_len, depending  */
@@ -514,80 +1245,132 @@ static int scsi_command_t(struct target_session *sess, const uint8_t * header,
 		scsi_cmd->input = 0;
 	}
 
+	start = now_ns();
 	if (device_command(sess, &cmd) != 0) {
 		iscsi_trace_error(__FILE__, __LINE__,
 				  "device_command() failed\n");
 		goto err_out;
 	}
 
+	/* a transfer done on the event loop has its storage latency too */
+	if (!task->io.busy && !task->want_data_pdu && !scsi_cmd->status &&
+	    (scsi_cmd->input || scsi_cmd->output))
+		sess_window_sample(sess, now_ns() - start);
+
+	if ((task->want_data_pdu || task->io.busy) && !scsi_cmd->status)
+		task_hold(sess, task);
+	else
+		task->want_data_pdu = false;
+	sess_window_update(sess);
+
+	/* AHS was only needed to execute the command */
+	scsi_cmd->ahs = NULL;
+	scsi_cmd->ext_cdb = NULL;
+
+	/* completed by target_io_done(), once a storage thread is done */
+	if (task->io.busy)
+		return 0;
+
 	/* Send any input data for READ commands */
 	scsi_cmd->bytes_sent = 0;
 	if (!scsi_cmd->status && scsi_cmd->input) {
-		if (send_read_data(sess, scsi_cmd, &sess->DataSN) < 0)
+		if (send_read_data(sess, scsi_cmd, &task->DataSN, &cmd) < 0)
 			goto err_out;
 	}
 
 	/* postpone response, if waiting on Data PDUs to arrive */
-	if (sess->want_data_pdu)
-		goto out;
+	if (task->held)
+		return 0;
 
 response:
 	/* Send response PDU, if required */
-	if (send_rsp_pdu(sess, scsi_cmd, &sess->DataSN) < 0)
+	if (send_rsp_pdu(sess, task) < 0)
 		goto err_out;
 
 out:
+	task_free(sess, task);
 	return 0;
 
 err_out:
+	task_free(sess, task);
 	return -1;
 }
 
-static int task_command_t(struct target_session *sess, const uint8_t *header)
+static int task_rsp_send(struct target_session *sess, uint32_t tag,
+			 uint8_t response)
 {
-	struct iscsi_task_cmd cmd;
 	struct iscsi_task_rsp rsp;
 	uint8_t	*rsp_header;
 
-	/* Get & check args */
+	memset(&rsp, 0x0, sizeof(rsp));
+	rsp.response = response;
+	rsp.tag = tag;
+	rsp.StatSN = ++(sess->StatSN);
+	sess_window_get(sess, &rsp.ExpCmdSN, &rsp.MaxCmdSN);
+
+	rsp_header = header_get(&sess->wst);
+	if (!rsp_header)
+		goto err_out;
+
+	if (iscsi_task_rsp_encap(rsp_header, &rsp) != 0) {
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "iscsi_task_cmd_decap() failed\n");
+		goto err_out_hdr;
+	}
+
+	atcp_writeq_wbuf(&sess->wst, rsp_header, ISCSI_HEADER_LEN);
+	atcp_write_start(&sess->wst);
+
+	return 0;
+
+err_out_hdr:
+	header_put(&sess->wst, rsp_header);
+err_out:
+	return -1;
+}
+
+static int task_command_t(struct target_session *sess, const uint8_t *header)
+{
+	struct iscsi_task_cmd cmd;
+	int response = ISCSI_TASK_RSP_FUNCTION_COMPLETE;
+
+	/* Get & check args */
 
 	if (iscsi_task_cmd_decap(header, &cmd) != 0) {
 		iscsi_trace_error(__FILE__, __LINE__,
 				  "iscsi_task_cmd_decap() failed\n");
 		return -1;
 	}
-	if (cmd.CmdSN != sess->ExpCmdSN) {
-		iscsi_trace_warning(__FILE__, __LINE__,
-				    "Expected CmdSN %d, got %d. (ignoring and resetting expectations)\n",
-				    cmd.CmdSN, sess->ExpCmdSN);
-		sess->ExpCmdSN = cmd.CmdSN;
-	}
-	sess->MaxCmdSN++;
-
-	memset(&rsp, 0x0, sizeof(rsp));
-	rsp.response = ISCSI_TASK_RSP_FUNCTION_COMPLETE;
+	if (!cmd.immediate)
+		sess_cmdsn_recv(sess, cmd.CmdSN);
 
 	switch (cmd.function) {
 	case ISCSI_TASK_CMD_ABORT_TASK:
 		printf("ISCSI_TASK_CMD_ABORT_TASK\n");
+		response = sess_task_abort(sess, false, cmd.ref_tag);
 		break;
 	case ISCSI_TASK_CMD_ABORT_TASK_SET:
 		printf("ISCSI_TASK_CMD_ABORT_TASK_SET\n");
+		response = sess_task_abort(sess, true, 0);
 		break;
 	case ISCSI_TASK_CMD_CLEAR_ACA:
 		printf("ISCSI_TASK_CMD_CLEAR_ACA\n");
 		break;
 	case ISCSI_TASK_CMD_CLEAR_TASK_SET:
 		printf("ISCSI_TASK_CMD_CLEAR_TASK_SET\n");
+		response = sess_task_abort(sess, true, 0);
 		break;
 	case ISCSI_TASK_CMD_LOGICAL_UNIT_RESET:
 		printf("ISCSI_TASK_CMD_LOGICAL_UNIT_RESET\n");
+		response = sess_task_abort(sess, true, 0);
 		break;
 	case ISCSI_TASK_CMD_TARGET_WARM_RESET:
 		printf("ISCSI_TASK_CMD_TARGET_WARM_RESET\n");
+		response = sess_task_abort(sess, true, 0);
 		break;
 	case ISCSI_TASK_CMD_TARGET_COLD_RESET:
 		printf("ISCSI_TASK_CMD_TARGET_COLD_RESET\n");
+		response = sess_task_abort(sess, true, 0);
 		break;
 	case ISCSI_TASK_CMD_TARGET_REASSIGN:
 		printf("ISCSI_TASK_CMD_TARGET_REASSIGN\n");
@@ -595,34 +1378,18 @@ static int task_command_t(struct target_session *sess, const uint8_t *header)
 	default:
 		iscsi_trace_error(__FILE__, __LINE__,
 				  "Unknown task function %d\n", cmd.function);
-		rsp.response = ISCSI_TASK_RSP_REJECTED;
+		response = ISCSI_TASK_RSP_REJECTED;
 	}
 
-	rsp.tag = cmd.tag;
-	rsp.StatSN = ++(sess->StatSN);
-	rsp.ExpCmdSN = sess->ExpCmdSN;
-	rsp.MaxCmdSN = sess->MaxCmdSN;
-
-	rsp_header = header_get();
-	if (!rsp_header)
-		goto err_out;
+	sess_window_update(sess);
 
-	if (iscsi_task_rsp_encap(rsp_header, &rsp) != 0) {
-		iscsi_trace_error(__FILE__, __LINE__,
-				  "iscsi_task_cmd_decap() failed\n");
-		goto err_out_hdr;
+	/* held until other connections have aborted their tasks */
+	if (response < 0) {
+		sess->tmf_tag = cmd.tag;
+		return 0;
 	}
 
-	atcp_writeq(&sess->wst, rsp_header, ISCSI_HEADER_LEN,
-		   hdr_cb_free, rsp_header);
-	atcp_write_start(&sess->wst);
-
-	return 0;
-
-err_out_hdr:
-	header_put(rsp_header);
-err_out:
-	return -1;
+	return task_rsp_send(sess, cmd.tag, response);
 }
 
 static int nop_out_t(struct target_session *sess, const uint8_t *header)
@@ -635,15 +1402,10 @@ static int nop_out_t(struct target_session *sess, const uint8_t *header)
 				  "iscsi_nop_out_decap() failed\n");
 		return -1;
 	}
-	if (nop_out.CmdSN != sess->ExpCmdSN) {
-		iscsi_trace_warning(__FILE__, __LINE__,
-				    "Expected CmdSN %d, got %d. (ignoring and resetting expectations)\n",
-				    nop_out.CmdSN, sess->ExpCmdSN);
-		sess->ExpCmdSN = nop_out.CmdSN;
+	if (!nop_out.immediate) {
+		sess_cmdsn_recv(sess, nop_out.CmdSN);
+		sess_window_update(sess);
 	}
-	/* TODO Clarify whether we need to update the CmdSN */
-	/* sess->ExpCmdSN++;  */
-	/* sess->MaxCmdSN++;  */
 
 	if (nop_out.length) {
 		iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
@@ -662,10 +1424,9 @@ static int nop_out_t(struct target_session *sess, const uint8_t *header)
 		nop_in.tag = nop_out.tag;
 		nop_in.transfer_tag = 0xffffffff;
 		nop_in.StatSN = ++(sess->StatSN);
-		nop_in.ExpCmdSN = sess->ExpCmdSN;
-		nop_in.MaxCmdSN = sess->MaxCmdSN;
+		sess_window_get(sess, &nop_in.ExpCmdSN, &nop_in.MaxCmdSN);
 
-		rsp_header = header_get();
+		rsp_header = header_get(&sess->wst);
 		if (!rsp_header)
 			goto err_out;
 
@@ -690,7 +1451,7 @@ static int nop_out_t(struct target_session *sess, const uint8_t *header)
 	return 0;
 
 err_out_hdr:
-	header_put(rsp_header);
+	header_put(&sess->wst, rsp_header);
 err_out:
 	return -1;
 }
@@ -720,11 +1481,9 @@ static int text_command_t(struct target_session *sess, const uint8_t *header)
 	}
 	/* Check args & update numbering */
 	RETURN_NOT_EQUAL("Continue", text_cmd.cont, 0, NO_CLEANUP, -1);
-	RETURN_NOT_EQUAL("CmdSN", text_cmd.CmdSN, sess->ExpCmdSN, NO_CLEANUP,
-			 -1);
-
-	sess->ExpCmdSN++;
-	sess->MaxCmdSN++;
+	if (!text_cmd.immediate && (sess_cmdsn_recv(sess, text_cmd.CmdSN) < 0))
+		return -1;
+	sess_window_update(sess);
 
 	if ((text_out = malloc(2048)) == NULL) {
 		iscsi_trace_error(__FILE__, __LINE__, "malloc() failed\n");
@@ -815,7 +1574,7 @@ static int text_command_t(struct target_session *sess, const uint8_t *header)
 		}
 	}
 	if (sess->IsFullFeature) {
-		set_session_parameters(sess->params, &sess->sess_params);
+		sess_params_update(sess);
 	}
 	/* Send response */
 
@@ -826,10 +1585,9 @@ static int text_command_t(struct target_session *sess, const uint8_t *header)
 	text_rsp.tag = text_cmd.tag;
 	text_rsp.transfer_tag = (text_rsp.final) ? 0xffffffff : 0x1234;
 	text_rsp.StatSN = ++(sess->StatSN);
-	text_rsp.ExpCmdSN = sess->ExpCmdSN;
-	text_rsp.MaxCmdSN = sess->MaxCmdSN;
+	sess_window_get(sess, &text_rsp.ExpCmdSN, &text_rsp.MaxCmdSN);
 
-	rsp_header = header_get();
+	rsp_header = header_get(&sess->wst);
 	if (!rsp_header)
 		goto err_out;
 
@@ -839,8 +1597,7 @@ static int text_command_t(struct target_session *sess, const uint8_t *header)
 		goto err_out_hdr;
 	}
 
-	atcp_writeq(&sess->wst, rsp_header, ISCSI_HEADER_LEN,
-		   hdr_cb_free, rsp_header);
+	atcp_writeq_wbuf(&sess->wst, rsp_header, ISCSI_HEADER_LEN);
 
 	if (len_out) {
 		atcp_writeq(&sess->wst, text_out, len_out,
@@ -857,7 +1614,7 @@ static int text_command_t(struct target_session *sess, const uint8_t *header)
 	return 0;
 
 err_out_hdr:
-	header_put(rsp_header);
+	header_put(&sess->wst, rsp_header);
 err_out:
 	free(text_in);
 	free(text_out);
@@ -892,6 +1649,145 @@ static int find_target_tsih(struct globals *globals, int tsih)
 	return -1;
 }
 
+/*
+ * A session is named by its initiator's InitiatorName and ISID, the
+ * target's name, and its TSIH.  A NULL initiator or negative target
+ * matches any, for checks made before the login text is parsed; a
+ * negative TSIH matches any, to find a session to reinstate.
+ */
+static struct target_nexus *nexus_find(const char *initiator, uint64_t isid,
+				       int d, int tsih)
+{
+	struct target_nexus *nx;
+
+	list_for_each_entry(nx, &nexus_list, nexus_node)
+		if ((nx->isid == isid) && ((tsih < 0) || (nx->tsih == tsih)) &&
+		    ((d < 0) || (nx->d == d)) &&
+		    (!initiator || !strcmp(nx->initiator, initiator)))
+			return nx;
+
+	return NULL;
+}
+
+/*
+ * Move a connection logging in with a non-zero TSIH from its private
+ * nexus into the session it names.
+ */
+static void sess_nexus_join(struct target_session *sess,
+			    struct target_nexus *nx)
+{
+	struct target_nexus *old = sess->nexus;
+
+	list_del(&sess->conns_node);
+	if (--old->n_conns == 0) {
+		pthread_mutex_destroy(&old->lock);
+		free(old);
+	}
+
+	sess->nexus = nx;
+	list_add_tail(&sess->conns_node, &nx->conns);
+	nx->n_conns++;
+}
+
+/* a new session, led by this connection */
+static void sess_nexus_lead(struct target_session *sess, int d,
+			    uint32_t CmdSN)
+{
+	struct target_nexus *nx = sess->nexus;
+
+	strlcpy(nx->initiator, param_val(sess->params, "InitiatorName"),
+		sizeof(nx->initiator));
+	nx->isid = sess->isid;
+	nx->tsih = sess->tsih;
+	nx->d = d;
+	nx->ExpCmdSN = nx->MaxCmdSN = CmdSN;
+	memset(nx->cmdsn_seen, 0, sizeof(nx->cmdsn_seen));
+	nx->max_conns = MIN(MAX(param_atoi(sess->params, "MaxConnections"), 1),
+			    TARGET_MAX_CONNS);
+	list_add_tail(&nx->nexus_node, &nexus_list);
+}
+
+/* close every connection of the session but this one */
+static void nexus_close_others(struct target_session *sess)
+{
+	struct target_session *conn;
+
+	list_for_each_entry(conn, &sess->nexus->conns, conns_node)
+		if ((conn != sess) && (conn->fd >= 0))
+			shutdown(conn->fd, SHUT_RDWR);
+}
+
+/*
+ * A new session with the InitiatorName and ISID of an existing one
+ * reinstates it.  The old session's connections are closed, which ends
+ * its tasks, and it can no longer be joined.
+ */
+static void nexus_reinstate(struct target_nexus *nx)
+{
+	struct target_session *conn;
+
+	iscsi_trace_warning(__FILE__, __LINE__,
+			    "Reinstating session ISID %" PRIu64 ", TSIH %d "
+			    "of %s\n", nx->isid, nx->tsih, nx->initiator);
+
+	list_for_each_entry(conn, &nx->conns, conns_node)
+		if (conn->fd >= 0)
+			shutdown(conn->fd, SHUT_RDWR);
+	list_del_init(&nx->nexus_node);
+}
+
+/*
+ * At the end of login, join the session named by a non-zero TSIH, or
+ * lead a new one.  Returns a login status detail, 0 on success.  Called
+ * with the session list locked for writing.
+ */
+static int sess_login_nexus(struct target_session *sess,
+			    const struct iscsi_login_cmd_args *cmd, int d,
+			    bool normal)
+{
+	struct target_session *conn;
+	struct target_nexus *nx;
+	bool reinstate = false;
+
+	if (!normal || !cmd->tsih) {
+		if (normal &&
+		    (nx = nexus_find(param_val(sess->params, "InitiatorName"),
+				     cmd->isid, d, -1)) != NULL)
+			nexus_reinstate(nx);
+		sess->globals->tv->v[d].tsih = sess->tsih =
+		    ++sess->globals->last_tsih;
+		sess_nexus_lead(sess, d, cmd->CmdSN);
+		return 0;
+	}
+
+	nx = nexus_find(param_val(sess->params, "InitiatorName"), cmd->isid,
+			d, cmd->tsih);
+	if (!nx) {
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "No session with ISID %" PRIu64 ", TSIH %u on target %d for %s\n",
+				  cmd->isid, cmd->tsih, d,
+				  param_val(sess->params, "InitiatorName"));
+		return ISCSI_LOGIN_DETAIL_SESSION_NOT_FOUND;
+	}
+
+	/* a connection reusing its CID replaces the old one */
+	list_for_each_entry(conn, &nx->conns, conns_node)
+		if ((conn->cid == cmd->cid) && (conn->fd >= 0)) {
+			shutdown(conn->fd, SHUT_RDWR);
+			reinstate = true;
+		}
+	if (!reinstate && (nx->n_conns >= nx->max_conns)) {
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "TSIH %u already has %u connections\n",
+				  nx->tsih, nx->n_conns);
+		return ISCSI_LOGIN_DETAIL_TOO_MANY_CONNECTIONS;
+	}
+
+	sess->tsih = nx->tsih;
+	sess_nexus_join(sess, nx);
+	return 0;
+}
+
 /*
  * login_command_t() handles login requests and replies.
  */
@@ -908,6 +1804,7 @@ static int login_command_t(struct target_session *sess, const uint8_t *header)
 	int             len_out = 0;
 	int             status = 0;
 	int             i;
+	struct target_nexus *nx;
 
 	/* Initialize response */
 
@@ -952,9 +1849,16 @@ static int login_command_t(struct target_session *sess, const uint8_t *header)
 		rsp.version_active = ISCSI_VERSION;
 		goto response;
 	} else if (cmd.tsih != 0) {
-		iscsi_trace_error(__FILE__, __LINE__,
-				  "Bad cmd.tsih (%u). Expected 0.\n", cmd.tsih);
-		goto response;
+		sessions_lock_begin(false);
+		nx = nexus_find(NULL, cmd.isid, -1, cmd.tsih);
+		sessions_lock_end();
+		if (!nx) {
+			iscsi_trace_error(__FILE__, __LINE__,
+					  "No session with ISID %" PRIu64 ", TSIH %u\n",
+					  cmd.isid, cmd.tsih);
+			rsp.status_detail = ISCSI_LOGIN_DETAIL_SESSION_NOT_FOUND;
+			goto response;
+		}
 	}
 	/* Parse text parameters and build response */
 
@@ -1066,13 +1970,6 @@ static int login_command_t(struct target_session *sess, const uint8_t *header)
 							    "TargetName"));
 				goto response;
 			}
-			if (cmd.tsih != 0
-			    && find_target_tsih(sess->globals, cmd.tsih) != i) {
-				iscsi_trace_error(__FILE__, __LINE__,
-						  "target tsih expected %d, cmd.tsih %d, i %d\n",
-						  sess->globals->tv->v[i].tsih,
-						  cmd.tsih, i);
-			}
 			sess->d = i;
 		} else if ((i = find_target_tsih(sess->globals, cmd.tsih)) < 0) {
 			iscsi_trace_error(__FILE__, __LINE__,
@@ -1084,20 +1981,19 @@ static int login_command_t(struct target_session *sess, const uint8_t *header)
 					  "SessionType not specified\n");
 			goto response;
 		}
-		sess->ExpCmdSN = sess->MaxCmdSN = cmd.CmdSN;
 		sess->cid = cmd.cid;
 		sess->isid = cmd.isid;
 
-		sess->globals->tv->v[i].tsih = sess->tsih =
-		    ++sess->globals->last_tsih;
+		sessions_lock_begin(true);
+		rsp.status_detail = sess_login_nexus(sess, &cmd, i,
+				param_equiv(sess->params, "SessionType", "Normal"));
+		sessions_lock_end();
+		if (rsp.status_detail)
+			goto response;
 		sess->IsFullFeature = 1;
 
 		sess->IsLoggedIn = 1;
-		if (!param_equiv(sess->params, "SessionType", "Discovery")) {
-			strlcpy(param_val(sess->params, "MaxConnections"), "1",
-				2);
-		}
-		set_session_parameters(sess->params, &sess->sess_params);
+		sess_params_update(sess);
 	} else {
 		if ((i = find_target_tsih(sess->globals, cmd.tsih)) < 0) {
 			iscsi_trace_error(__FILE__, __LINE__,
@@ -1113,13 +2009,15 @@ static int login_command_t(struct target_session *sess, const uint8_t *header)
 	/* Send login response */
 
 response:
-	sess->ExpCmdSN = sess->MaxCmdSN = cmd.CmdSN;
+	/* the window of an established session is left alone */
+	if (!sess->IsFullFeature)
+		sess->nexus->ExpCmdSN = sess->nexus->MaxCmdSN = cmd.CmdSN;
+	sess_window_update(sess);
 	rsp.isid = cmd.isid;
 	rsp.StatSN = cmd.ExpStatSN;	/* debug  */
 	rsp.tag = cmd.tag;
 	rsp.cont = cmd.cont;
-	rsp.ExpCmdSN = sess->ExpCmdSN;
-	rsp.MaxCmdSN = sess->MaxCmdSN;
+	sess_window_get(sess, &rsp.ExpCmdSN, &rsp.MaxCmdSN);
 	if (!rsp.status_class) {
 		if (rsp.transit && (rsp.nsg == ISCSI_LOGIN_STAGE_FULL_FEATURE)) {
 			rsp.version_max = ISCSI_VERSION;
@@ -1129,7 +2027,7 @@ response:
 		}
 	}
 
-	rsp_header = header_get();
+	rsp_header = header_get(&sess->wst);
 	if (!rsp_header)
 		goto err_out;
 
@@ -1183,7 +2081,7 @@ response:
 	return 0;
 
 err_out_hdr:
-	header_put(rsp_header);
+	header_put(&sess->wst, rsp_header);
 err_out:
 	LC_CLEANUP;
 	return -1;
@@ -1208,28 +2106,27 @@ static int logout_command_t(struct target_session *sess, const uint8_t *header)
 	    && (param_equiv(sess->params, "ErrorRecoveryLevel", "0"))) {
 		rsp.response = ISCSI_LOGOUT_STATUS_NO_RECOVERY;
 	}
-	RETURN_NOT_EQUAL("CmdSN", cmd.CmdSN, sess->ExpCmdSN, NO_CLEANUP, -1);
+	if (!cmd.immediate && (sess_cmdsn_recv(sess, cmd.CmdSN) < 0))
+		return -1;
 	RETURN_NOT_EQUAL("ExpStatSN", cmd.ExpStatSN, sess->StatSN, NO_CLEANUP,
 			 -1);
 
 	rsp.tag = cmd.tag;
 	rsp.StatSN = sess->StatSN;
-	rsp.ExpCmdSN = ++sess->ExpCmdSN;
-	rsp.MaxCmdSN = sess->MaxCmdSN;
+	sess_window_get(sess, &rsp.ExpCmdSN, &rsp.MaxCmdSN);
 
-	rsp_header = header_get();
+	rsp_header = header_get(&sess->wst);
 	if (!rsp_header)
 		return -1;
 
 	if (iscsi_logout_rsp_encap(rsp_header, &rsp) != 0) {
 		iscsi_trace_error(__FILE__, __LINE__,
 				  "iscsi_logout_rsp_encap() failed\n");
-		header_put(rsp_header);
+		header_put(&sess->wst, rsp_header);
 		return -1;
 	}
 
-	atcp_writeq(&sess->wst, rsp_header, ISCSI_HEADER_LEN,
-		   hdr_cb_free, rsp_header);
+	atcp_writeq_wbuf(&sess->wst, rsp_header, ISCSI_HEADER_LEN);
 	atcp_write_start(&sess->wst);
 
 	iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
@@ -1255,13 +2152,25 @@ static int logout_command_t(struct target_session *sess, const uint8_t *header)
 		sess->sess_params.cred.user = NULL;
 	}
 
-	if ((i = find_target_tsih(sess->globals, sess->tsih)) < 0) {
+	sessions_lock_begin(true);
+
+	/* closing the session takes its other connections down too */
+	if (cmd.reason == ISCSI_LOGOUT_CLOSE_SESSION) {
+		nexus_close_others(sess);
+		list_del_init(&sess->nexus->nexus_node);
+	}
+
+	if (sess->nexus->n_conns > 1) {
+		/* the session carries on over its other connections */
+	} else if ((i = find_target_tsih(sess->globals, sess->tsih)) < 0) {
 		iscsi_trace_error(__FILE__, __LINE__,
 				  "logout sess->tsih %d not found\n",
 				  sess->tsih);
 	} else {
 		sess->globals->tv->v[i].tsih = 0;
 	}
+
+	sessions_lock_end();
 	sess->tsih = 0;
 
 	return 0;
@@ -1293,7 +2202,7 @@ static int verify_cmd_t(struct target_session *sess, const uint8_t *header)
 		rsp.version_max = ISCSI_VERSION;
 		rsp.version_active = ISCSI_VERSION;
 
-		rsp_header = header_get();
+		rsp_header = header_get(&sess->wst);
 		if (!rsp_header)
 			goto err_out;
 
@@ -1320,7 +2229,7 @@ static int verify_cmd_t(struct target_session *sess, const uint8_t *header)
 	return 0;
 
 err_out_hdr:
-	header_put(rsp_header);
+	header_put(&sess->wst, rsp_header);
 err_out:
 	return -1;
 }
@@ -1337,14 +2246,6 @@ static int execute_t(struct target_session *sess, const uint8_t *header)
 		return -1;
 	}
 
-	if (G_UNLIKELY(sess->want_data_pdu && (op != ISCSI_WRITE_DATA))) {
-		iscsi_trace(TRACE_ISCSI_CMD, __FILE__, __LINE__,
-			    "session %d: unexpected Command %#x when expecting Write Data\n",
-			    sess->id, op);
-
-		return -1;
-	}
-
 	switch (op) {
 	case ISCSI_TASK_CMD:
 		iscsi_trace(TRACE_ISCSI_CMD, __FILE__, __LINE__,
@@ -1405,11 +2306,7 @@ static int execute_t(struct target_session *sess, const uint8_t *header)
 		iscsi_trace(TRACE_ISCSI_CMD, __FILE__, __LINE__,
 			    "session %d: SCSI Command\n", sess->id);
 
-		memset(&sess->scsi_cmd, 0, sizeof(sess->scsi_cmd));
-		sess->DataSN = 0;
-		sess->n_iov = 0;
-
-		if (scsi_command_t(sess, header, &sess->scsi_cmd) != 0) {
+		if (scsi_command_t(sess, header) != 0) {
 			iscsi_trace_error(__FILE__, __LINE__,
 					  "scsi_command_t() failed\n");
 			return -1;
@@ -1417,12 +2314,8 @@ static int execute_t(struct target_session *sess, const uint8_t *header)
 		break;
 
 	case ISCSI_WRITE_DATA:
-		if (sess->want_data_pdu) {
-			target_data_pdu(sess);
-			break;
-		}
-
-		/* fall through */
+		target_data_pdu(sess);
+		break;
 
 	default:
 		iscsi_trace_error(__FILE__, __LINE__, "Unknown Opcode %#x\n",
@@ -1438,77 +2331,146 @@ static int execute_t(struct target_session *sess, const uint8_t *header)
 	return 0;
 }
 
-static int send_r2t(struct target_session *sess)
+static uint32_t sess_new_ttt(struct target_session *sess)
 {
-	int send_it = 0;
-	uint8_t         *header;
+	struct target_nexus *nx = sess->nexus;
+	uint32_t ttt;
 
-	sess->want_data_pdu = true;
+	pthread_mutex_lock(&nx->lock);
 
-	/*
-	 * Send R2T if we're either operating in solicted
-	 * mode or we're operating in unsolicted
-	 */
-	/* mode and have reached the first burst */
-	if (!sess->xfer.r2t_flag && (sess->sess_params.initial_r2t ||
-			  (sess->sess_params.first_burst
-			   && (sess->xfer.bytes_recv >=
-			       sess->sess_params.first_burst))))
-		send_it = 1;
+	/* 0xffffffff marks unsolicited data */
+	if (nx->next_ttt == 0xffffffff)
+		nx->next_ttt = 0;
+	ttt = nx->next_ttt++;
 
-	if (!send_it)
-		return 0;
+	pthread_mutex_unlock(&nx->lock);
 
-	sess->xfer.desired_len =
-	    MIN((sess->xfer.trans_len - sess->xfer.bytes_recv),
-		sess->sess_params.max_burst);
+	return ttt;
+}
 
-	iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
-		    "sending R2T for %u bytes data\n",
-		    sess->xfer.desired_len);
+static struct xfer_seq *xfer_seq_find(struct session_xfer *xfer, uint32_t ttt)
+{
+	unsigned int i;
 
-	sess->xfer.r2t.tag = sess->xfer.tag;
+	if (ttt == 0xffffffff)
+		return xfer->unsol.active ? &xfer->unsol : NULL;
 
-	sess->xfer.r2t.transfer_tag = 0x1234;
+	for (i = 0; i < TARGET_MAX_R2T; i++)
+		if (xfer->r2t[i].active && (xfer->r2t[i].ttt == ttt))
+			return &xfer->r2t[i];
 
-	sess->xfer.r2t.ExpCmdSN = sess->ExpCmdSN;
-	sess->xfer.r2t.MaxCmdSN = sess->MaxCmdSN;
-	sess->xfer.r2t.StatSN = ++(sess->StatSN);
-	sess->xfer.r2t.length = sess->xfer.desired_len;
-	sess->xfer.r2t.offset = sess->xfer.bytes_recv;
+	return NULL;
+}
+
+/* the sequence a Data-Out PDU continues, if it arrived in order */
+static struct xfer_seq *xfer_seq_expect(struct session_xfer *xfer,
+					uint32_t ttt, uint32_t offset,
+					uint32_t len)
+{
+	struct xfer_seq *seq = xfer_seq_find(xfer, ttt);
+
+	if (!seq || (offset != seq->offset + seq->recv) ||
+	    (len > seq->length - seq->recv))
+		return NULL;
+
+	return seq;
+}
+
+static int send_r2t(struct target_session *sess, struct target_task *task,
+		    const struct xfer_seq *seq)
+{
+	struct iscsi_r2t r2t;
+	uint8_t         *header;
+
+	memset(&r2t, 0, sizeof(r2t));
+	r2t.tag = task->scsi_cmd.tag;
+	r2t.transfer_tag = seq->ttt;
 
-	header = header_get();
+	/* R2T carries the next StatSN, without advancing it */
+	sess_window_get(sess, &r2t.ExpCmdSN, &r2t.MaxCmdSN);
+	r2t.StatSN = sess->StatSN + 1;
+	r2t.R2TSN = task->xfer.R2TSN++;
+	r2t.length = seq->length;
+	r2t.offset = seq->offset;
+
+	header = header_get(&sess->wst);
 	if (!header)
 		return -1;
 
-	if (iscsi_r2t_encap(header, &sess->xfer.r2t) != 0) {
+	if (iscsi_r2t_encap(header, &r2t) != 0) {
 		iscsi_trace_error(__FILE__, __LINE__,
 				  "r2t_encap() failed\n");
-		header_put(header);
+		header_put(&sess->wst, header);
 		return -1;
 	}
 
 	iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__,
 		    __LINE__,
 		    "sending R2T tag %u transfer tag %u len %u offset %u\n",
-		    sess->xfer.r2t.tag, sess->xfer.r2t.transfer_tag,
-		    sess->xfer.r2t.length, sess->xfer.r2t.offset);
+		    r2t.tag, r2t.transfer_tag, r2t.length, r2t.offset);
 
-	atcp_writeq(&sess->wst, header, ISCSI_HEADER_LEN,
-		   hdr_cb_free, header);
-	atcp_write_start(&sess->wst);
+	atcp_writeq_wbuf(&sess->wst, header, ISCSI_HEADER_LEN);
+
+	return 0;
+}
+
+/*
+ * Solicit the rest of a WRITE's data, in MaxBurstLength chunks, keeping
+ * up to MaxOutstandingR2T R2Ts in flight.  Solicitation starts once any
+ * unsolicited burst is complete.
+ */
+static int send_r2ts(struct target_session *sess, struct target_task *task)
+{
+	struct session_xfer *xfer = &task->xfer;
+	const struct iscsi_sess_param *sp = &sess->sess_params;
+	unsigned int i, max_r2t;
+	struct xfer_seq *seq;
+	uint32_t len;
+	bool sent = false;
+
+	task->want_data_pdu = true;
+
+	if (xfer->unsol.active)
+		return 0;
+
+	max_r2t = MIN(MAX(sp->max_r2t, 1), TARGET_MAX_R2T);
+
+	for (i = 0; (i < TARGET_MAX_R2T) && (xfer->n_r2t < max_r2t) &&
+		    (xfer->r2t_next < xfer->trans_len); i++) {
+		seq = &xfer->r2t[i];
+		if (seq->active)
+			continue;
 
-	sess->xfer.r2t_flag = 1;
-	sess->xfer.r2t.R2TSN += 1;
+		len = xfer->trans_len - xfer->r2t_next;
+		if (sp->max_burst && (len > sp->max_burst))
+			len = sp->max_burst;
+
+		seq->ttt = sess_new_ttt(sess);
+		seq->offset = xfer->r2t_next;
+		seq->length = len;
+		seq->recv = 0;
+		seq->active = true;
+
+		xfer->r2t_next += len;
+		xfer->n_r2t++;
+
+		if (send_r2t(sess, task, seq) < 0)
+			return -1;
+		sent = true;
+	}
+
+	if (sent)
+		atcp_write_start(&sess->wst);
 
 	return 0;
 }
 
 static int
-read_data_pdu(struct target_session *sess,
-	      struct iscsi_write_data *data)
+read_data_pdu(struct target_session *sess, struct target_task **ptask,
+	      struct xfer_seq **pseq, struct iscsi_write_data *data)
 {
 	uint8_t         header[ISCSI_HEADER_LEN];
+	struct target_task *task;
 	int             ret_val = -1;
 
 	memcpy(header, sess->pdu.header, sizeof(header));
@@ -1519,10 +2481,30 @@ read_data_pdu(struct target_session *sess,
 		return ret_val;
 	}
 
+	task = task_find(sess, data->tag);
+	if (!task || !task->want_data_pdu) {
+		iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
+			    "Data ITT (%d) matches no task awaiting data\n",
+			    data->tag);
+		if (data->final)
+			return 1;
+
+		/* Send a reject PDU */
+		iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
+			    "Sending Reject PDU\n");
+		if (reject_t(sess, header, 0x09) != 0) {	/* Invalid PDU Field */
+			iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__,
+				    __LINE__,
+				    "Sending Reject PDU failed\n");
+		}
+		return 1;
+	}
+	*ptask = task;
+
 	/* Check args */
 	if (sess->sess_params.max_data_seg) {
 		if (data->length > sess->sess_params.max_data_seg) {
-			sess->xfer.status = SCSI_CHECK_CONDITION;
+			task->xfer.status = SCSI_CHECK_CONDITION;
 			iscsi_trace_error(__FILE__, __LINE__,
 				  "data PDU len %u too large "
 				  "(larger than session max_data_seg %d)\n",
@@ -1531,47 +2513,46 @@ read_data_pdu(struct target_session *sess,
 			return -2;
 		}
 	}
-	if ((sess->xfer.bytes_recv + data->length) > sess->xfer.trans_len) {
-		sess->xfer.status = SCSI_CHECK_CONDITION;
+	*pseq = xfer_seq_expect(&task->xfer, data->transfer_tag, data->offset,
+				data->length);
+	if (!*pseq) {
+		task->xfer.status = SCSI_CHECK_CONDITION;
 		iscsi_trace_error(__FILE__, __LINE__,
-			"Data PDU bytes received so far (%u) + Data PDU len %u "
-			"is larger than expected xfer length %u\n",
-			sess->xfer.bytes_recv, data->length,
-			sess->xfer.trans_len);
+			"Data PDU (transfer tag %u, offset %u, len %u) "
+			"matches no outstanding sequence\n",
+			data->transfer_tag, data->offset, data->length);
 		return -3;
 	}
-	if (data->tag != sess->xfer.tag) {
-		iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
-			    "Data ITT (%d) does not match with command ITT (%d)\n",
-			    data->tag, sess->xfer.tag);
-		if (data->final) {
-			sess->xfer.status = SCSI_CHECK_CONDITION;
-			return -4;
-		} else {
-			/* Send a reject PDU */
-			iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
-				    "Sending Reject PDU\n");
-			if (reject_t(sess, header, 0x09) != 0) {	/* Invalid PDU Field */
-				iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__,
-					    __LINE__,
-					    "Sending Reject PDU failed\n");
-				return 1;
-			}
-		}
-	}
 
 	return 0;
 }
 
+/* a WRITE whose data transfer went wrong is failed, and its data dropped */
+static void task_fail(struct target_session *sess, struct target_task *task)
+{
+	struct iscsi_scsi_cmd_args *scsi_cmd = &task->scsi_cmd;
+
+	scsi_cmd->status = SCSI_CHECK_CONDITION;
+	scsi_cmd->length = 0;
+	scsi_cmd->input = scsi_cmd->output = 0;
+
+	task_unhold(sess, task);
+	send_rsp_pdu(sess, task);
+	task_free(sess, task);
+}
+
 static int target_data_pdu(struct target_session *sess)
 {
 	struct iscsi_write_data data;
+	struct target_task *task = NULL;
+	struct session_xfer *xfer;
+	struct xfer_seq *seq = NULL;
 	int read_status;
 
 	iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
 		    "reading data pdu\n");
 
-	read_status = read_data_pdu(sess, &data);
+	read_status = read_data_pdu(sess, &task, &seq, &data);
 	if (read_status) {
 		if (read_status == 1) {
 			iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__,
@@ -1582,11 +2563,12 @@ static int target_data_pdu(struct target_session *sess)
 			iscsi_trace_error(__FILE__, __LINE__,
 					  "read_data_pdu() failed, status %d\n",
 					  read_status);
-			sess->xfer.status = SCSI_CHECK_CONDITION;
-			return -1;
+			goto err_out;
 		}
 	}
 
+	xfer = &task->xfer;
+
 	WARN_NOT_EQUAL("ExpStatSN", data.ExpStatSN, sess->StatSN);
 	iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
 		    "read data pdu OK (offset %u, length %u)\n",
@@ -1594,72 +2576,76 @@ static int target_data_pdu(struct target_session *sess)
 
 	/* Scatter into destination buffers */
 
-	sess->iov[sess->n_iov].iov_base = sess->pdu.data;
-	sess->pdu.data = NULL;
-
-	sess->iov[sess->n_iov++].iov_len = data.length;
+	if (pdu_park_data(sess, task, data.offset, data.length) < 0)
+		goto err_out;
 
 	iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
 		    "successfully scattered %u bytes\n", data.length);
 
-	sess->xfer.bytes_recv += data.length;
-	sess->xfer.desired_len -= data.length;
+	xfer->bytes_recv += data.length;
+	seq->recv += data.length;
 
-	if ((!sess->xfer.r2t_flag)
-	    && (sess->xfer.bytes_recv > sess->sess_params.first_burst)) {
-		iscsi_trace_error(__FILE__, __LINE__,
-		  "Received unsolicited data (%d) more than first_burst (%d)\n",
-				  sess->xfer.bytes_recv,
-				  sess->sess_params.first_burst);
-		sess->xfer.status = SCSI_CHECK_CONDITION;
-		return -1;
-	}
-	if ((sess->xfer.desired_len != 0) && data.final) {
+	if ((seq->recv < seq->length) && data.final) {
 		iscsi_trace_error(__FILE__, __LINE__,
-		  "Expecting more data (%d) from initiator for this sequence\n",
-				  sess->xfer.desired_len);
-		sess->xfer.status = SCSI_CHECK_CONDITION;
-		return -1;
+		  "Expecting more data (%u) from initiator for this sequence\n",
+				  seq->length - seq->recv);
+		goto err_out;
 	}
-	if ((sess->xfer.desired_len == 0) && !data.final) {
-		iscsi_trace_error(__FILE__, __LINE__,
+	if (seq->recv == seq->length) {
+		if (!data.final) {
+			iscsi_trace_error(__FILE__, __LINE__,
 		  "Final bit not set on the last data PDU of this sequence\n");
-		sess->xfer.status = SCSI_CHECK_CONDITION;
-		return -1;
-	}
-	if ((sess->xfer.desired_len == 0)
-	    && (sess->xfer.bytes_recv < sess->xfer.trans_len)) {
-		sess->xfer.r2t_flag = 0;
+			goto err_out;
+		}
+		seq->active = false;
+		if (seq != &xfer->unsol)
+			xfer->n_r2t--;
 	}
 
-	if (sess->xfer.bytes_recv < sess->xfer.trans_len) {
+	if (xfer->bytes_recv < xfer->trans_len) {
 		/* continue transfer */
-		if (send_r2t(sess) < 0)
-			return -1;
+		if (send_r2ts(sess, task) < 0)
+			goto err_out;
 	} else {
 		struct target_cmd cmd = {
-			.scsi_cmd	= &sess->scsi_cmd,
+			.scsi_cmd	= &task->scsi_cmd,
+			.task		= task,
 		};
 
+		uint64_t start = now_ns();
+
 		/* all bytes received, end transfer, complete transaction */
-		RETURN_NOT_EQUAL("Final bit", data.final, 1, , -1);
-		sess->want_data_pdu = false;
+		task->want_data_pdu = false;
 
 		if (device_commit(sess, &cmd) < 0)
-			return -1;
+			goto err_out;
+		if (task->io.busy)
+			return 0;
+		sess_window_sample(sess, now_ns() - start);
 
-		if (send_rsp_pdu(sess, &sess->scsi_cmd, &sess->DataSN) < 0)
+		task_unhold(sess, task);
+		if (send_rsp_pdu(sess, task) < 0) {
+			task_free(sess, task);
 			return -1;
+		}
+		task_free(sess, task);
 	}
 
 	return 0;
 
+err_out:
+	if (task)
+		task_fail(sess, task);
+	return -1;
 }
 
-int target_transfer_data(struct target_session *sess,
-			 struct iscsi_scsi_cmd_args *scsi_cmd)
+int target_transfer_data(struct target_session *sess, struct target_cmd *tc)
 {
-	memset(&sess->xfer, 0, sizeof(sess->xfer));
+	struct iscsi_scsi_cmd_args *scsi_cmd = tc->scsi_cmd;
+	struct target_task *task = tc->task;
+	struct session_xfer *xfer = &task->xfer;
+
+	memset(xfer, 0, sizeof(*xfer));
 
 	if ((!sess->sess_params.immediate_data) && scsi_cmd->length) {
 		iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
@@ -1678,32 +2664,44 @@ int target_transfer_data(struct target_session *sess,
 				       sess->sess_params.max_data_seg, , -1);
 		}
 
-		sess->iov[sess->n_iov].iov_base = sess->pdu.data;
-		sess->pdu.data = NULL;
-
-		sess->iov[sess->n_iov++].iov_len = scsi_cmd->length;
+		if (pdu_park_data(sess, task, 0, scsi_cmd->length) < 0)
+			return -1;
 
 		iscsi_trace(TRACE_SCSI_DATA, __FILE__, __LINE__,
 			    "successfully read %d bytes immediate write data\n",
 			    scsi_cmd->length);
 
-		sess->xfer.bytes_recv += scsi_cmd->length;
+		xfer->bytes_recv += scsi_cmd->length;
 	}
 	/*
 	 * Read iSCSI data PDUs
 	 */
 
-	if (sess->xfer.bytes_recv >= scsi_cmd->trans_len) {
+	if (xfer->bytes_recv >= scsi_cmd->trans_len) {
 		RETURN_NOT_EQUAL("Final bit", scsi_cmd->final, 1, , -1);
 		goto out;
 	}
 
-	sess->xfer.tag = scsi_cmd->tag;
-	sess->xfer.trans_len = scsi_cmd->trans_len;
-	sess->xfer.desired_len = MIN(sess->sess_params.first_burst,
-			       scsi_cmd->trans_len) - sess->xfer.bytes_recv;
+	xfer->tag = scsi_cmd->tag;
+	xfer->trans_len = scsi_cmd->trans_len;
+	xfer->r2t_next = xfer->bytes_recv;
+
+	/* the rest of the first burst follows unsolicited */
+	if (!scsi_cmd->final && !sess->sess_params.initial_r2t) {
+		uint32_t burst = sess->sess_params.first_burst ?
+				 sess->sess_params.first_burst : xfer->trans_len;
+
+		burst = MIN(burst, xfer->trans_len);
+		if (burst > xfer->bytes_recv) {
+			xfer->unsol.ttt = 0xffffffff;
+			xfer->unsol.offset = xfer->bytes_recv;
+			xfer->unsol.length = burst - xfer->bytes_recv;
+			xfer->unsol.active = true;
+			xfer->r2t_next = burst;
+		}
+	}
 
-	if (send_r2t(sess)) {
+	if (send_r2ts(sess, task)) {
 		scsi_cmd->status = SCSI_CHECK_CONDITION;
 		return -1;
 	}
@@ -1711,69 +2709,415 @@ int target_transfer_data(struct target_session *sess,
 out:
 	iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
 		    "successfully transferred initial %u bytes write data\n",
-		    sess->xfer.bytes_recv);
+		    xfer->bytes_recv);
 	return 0;
 }
 
-/********************
- * Public Functions *
- ********************/
-
-int target_init(struct globals *gp, targv_t * tv, char *TargetName)
+/*
+ * Hand device work for a command to the storage threads.  The command
+ * is completed, and its response sent, by target_io_done().
+ */
+int target_io_submit(struct target_session *sess, struct target_cmd *tc,
+		     target_io_fn fn)
 {
-	int             i;
+	struct target_io *io = &tc->task->io;
+
+	io->sess = sess;
+	io->cmd = *tc;
+	io->fn = fn;
+	io->release = NULL;
+	io->busy = true;
+	io->aborted = false;
+	io->start = now_ns();
+	sess->io_queued++;
+	sess->n_io++;
+
+	pthread_mutex_lock(&io_pool.lock);
+	list_add_tail(&io->node, &io_pool.queue);
+	pthread_cond_signal(&io_pool.work);
+	pthread_mutex_unlock(&io_pool.lock);
 
-	strlcpy(gp->targetname, TargetName, sizeof(gp->targetname));
-	if (gp->state == TARGET_INITIALIZING || gp->state == TARGET_INITIALIZED) {
-		iscsi_trace_error(__FILE__, __LINE__,
-				  "duplicate target initialization attempted\n");
-		return -1;
-	}
-	gp->state = TARGET_INITIALIZING;
-	gp->tv = tv;
+	return 0;
+}
 
-	for (i = 0; i < tv->c; i++) {
-		if (device_init(gp, tv, &tv->v[i]) < 0) {
-			iscsi_trace_error(__FILE__, __LINE__,
-					  "device_init() failed\n");
-			return -1;
-		}
-	}
+/*
+ * Device work the device carries out itself, on the session's event
+ * loop.  The device calls target_io_end() once it is done; release, if
+ * any, is called as the task is freed.
+ */
+void target_io_begin(struct target_session *sess, struct target_cmd *tc,
+		     target_io_fn release)
+{
+	struct target_io *io = &tc->task->io;
+
+	io->sess = sess;
+	io->cmd = *tc;
+	io->fn = NULL;
+	io->release = release;
+	io->busy = true;
+	io->aborted = false;
+	io->start = now_ns();
+	sess->io_queued++;
+	sess->n_io++;
+	sess->n_dev_io++;
+}
 
-	gp->state = TARGET_INITIALIZED;
+static void target_io_post(struct target_worker *w, struct target_io *io)
+{
+	uint64_t one = 1;
 
-	fprintf(stderr, "TARGET: TargetName is %s\n", gp->targetname);
+	pthread_mutex_lock(&w->io_lock);
+	list_add_tail(&io->node, &w->io_done);
+	pthread_mutex_unlock(&w->io_lock);
 
-	return 0;
+	if (write(w->io_fd, &one, sizeof(one)) < 0)
+		iscsi_trace_error(__FILE__, __LINE__, "eventfd write: %s\n",
+				  strerror(errno));
 }
 
-int target_sess_cleanup(struct target_session *sess)
+void target_io_end(struct target_io *io)
 {
-	/* Clean up */
+	io->sess->n_dev_io--;
+	target_io_post(io->sess->worker, io);
+}
 
-	if (param_list_destroy(sess->params) != 0) {
-		iscsi_trace_error(__FILE__, __LINE__,
-				  "param_list_destroy() failed\n");
-		return -1;
-	}
+static void *target_io_thread(void *userdata)
+{
+	struct target_io *io;
 
-	pdu_cleanup(&sess->pdu);
+	pthread_mutex_lock(&io_pool.lock);
+	while (!io_pool.stop) {
+		if (list_empty(&io_pool.queue)) {
+			pthread_cond_wait(&io_pool.work, &io_pool.lock);
+			continue;
+		}
 
-	event_del(&sess->ev);
+		io = list_entry(io_pool.queue.next, struct target_io, node);
+		list_del(&io->node);
+		pthread_mutex_unlock(&io_pool.lock);
 
-	atcp_wr_exit(&sess->wst);
+		io->fn(&io->cmd);
 
-	/* Terminate connection */
-	if (sess->fd >= 0)
+		/* once posted, io belongs to the session's worker */
+		target_io_post(io->sess->worker, io);
+
+		pthread_mutex_lock(&io_pool.lock);
+	}
+	pthread_mutex_unlock(&io_pool.lock);
+
+	return NULL;
+}
+
+/* destroy an ended session, once no device work refers to it */
+static void sess_free(struct target_session *sess)
+{
+	unsigned int i;
+
+	if (sess->tasks) {
+		for (i = 0; i < sess->globals->queue_depth; i++)
+			free(sess->tasks[i].parked);
+		free(sess->tasks);
+	}
+
+	iscsi_trace(TRACE_MEM, __FILE__, __LINE__,
+		    "session %d: segment cache %" PRIu64 " hits, %" PRIu64
+		    " misses, %" PRIu64 " peak buffers\n", sess->id,
+		    sess->segs.hits, sess->segs.misses, sess->segs.in_use_max);
+	seg_pool_exit(&sess->segs);
+	free(sess->rx.buf);
+
+	if (cur_sess == sess)
+		sess_leave(sess);
+	pthread_mutex_destroy(&sess->lock);
+	free(sess);
+}
+
+/* finish a command whose device work is done */
+static void target_io_done(struct target_session *sess, struct target_io *io)
+{
+	struct target_task *task = io->cmd.task;
+	struct iscsi_scsi_cmd_args *scsi_cmd = &task->scsi_cmd;
+
+	io->busy = false;
+
+	/* aborted meanwhile; no response */
+	if (io->aborted) {
+		task_free(sess, task);
+		return;
+	}
+
+	sess_window_sample(sess, now_ns() - io->start);
+
+	scsi_cmd->bytes_sent = 0;
+	if (!scsi_cmd->status && scsi_cmd->input &&
+	    (send_read_data(sess, scsi_cmd, &task->DataSN, &io->cmd) < 0))
+		goto err_out;
+
+	task_unhold(sess, task);
+	if (send_rsp_pdu(sess, task) < 0)
+		goto err_out;
+
+	task_free(sess, task);
+	return;
+
+err_out:
+	task_free(sess, task);
+	target_sess_cleanup(sess);
+}
+
+static void target_io_evt(int fd, short events, void *userdata)
+{
+	struct target_worker *w = userdata;
+	struct target_session *sess;
+	struct target_io *io;
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		iscsi_trace_error(__FILE__, __LINE__, "eventfd read: %s\n",
+				  strerror(errno));
+
+	for (;;) {
+		pthread_mutex_lock(&w->io_lock);
+		if (list_empty(&w->io_done)) {
+			pthread_mutex_unlock(&w->io_lock);
+			break;
+		}
+		io = list_entry(w->io_done.next, struct target_io, node);
+		list_del(&io->node);
+		pthread_mutex_unlock(&w->io_lock);
+
+		sess = io->sess;
+		sess_enter(sess);
+		sess->n_io--;
+
+		/* a command parked on a claim tries again, and may park */
+		if (io->parked && !io->aborted) {
+			io->parked = false;
+			io->busy = false;
+			io->fn(&io->cmd);
+			if (io->busy) {
+				sess_leave(sess);
+				continue;
+			}
+		}
+		io->parked = false;
+		target_io_done(sess, io);
+
+		/* an ended session goes with its last device work */
+		if (cur_sess == sess && sess->ended) {
+			if (!sess->n_io)
+				sess_free(sess);
+			else
+				sess_leave(sess);
+			continue;
+		}
+
+		/*
+		 * Storage completions queue responses too; those already
+		 * sent let go of their data now, not on the next read.
+		 */
+		if (cur_sess == sess)
+			atcp_write_run_compl(&sess->wst);
+		if (cur_sess == sess && sess->rx_paused)
+			sess_rx_resume(sess);
+		else if (cur_sess == sess)
+			sess_rx_pause(sess);
+		if (cur_sess == sess)
+			sess_leave(sess);
+	}
+}
+
+/*
+ * With the event loops stopped, wait out the session's device work
+ * here, freeing its tasks as their work completes.  A session ended
+ * while the target runs is not waited for; see target_sess_cleanup().
+ */
+static void sess_io_drain(struct target_session *sess)
+{
+	struct target_worker *w = sess->worker;
+	struct pollfd pfd = { .fd = w->io_fd, .events = POLLIN };
+	struct target_io *io, *tmp;
+	LIST_HEAD(done);
+	uint64_t n;
+
+	if (sess->tasks)
+		task_free_all(sess);
+	sess_claims_cancel(sess);
+
+	while (sess->n_io) {
+		if (sess->n_dev_io)
+			device_io_wait(w);
+		else if ((poll(&pfd, 1, -1) > 0) &&
+			 (read(w->io_fd, &n, sizeof(n)) < 0))
+			break;
+
+		pthread_mutex_lock(&w->io_lock);
+		list_for_each_entry_safe(io, tmp, &w->io_done, node)
+			if (io->sess == sess)
+				list_move_tail(&io->node, &done);
+		pthread_mutex_unlock(&w->io_lock);
+
+		list_for_each_entry_safe(io, tmp, &done, node) {
+			list_del(&io->node);
+			sess->n_io--;
+			io->busy = false;
+			task_free(sess, io->cmd.task);
+		}
+	}
+}
+
+static int target_io_init(unsigned int n_threads)
+{
+	sigset_t set, oldset;
+	unsigned int i;
+	int rc = 0;
+
+	io_pool.threads = calloc(n_threads, sizeof(pthread_t));
+	if (!io_pool.threads)
+		return -1;
+
+	/* signals are for the event loops */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+	for (i = 0; i < n_threads; i++) {
+		rc = pthread_create(&io_pool.threads[i], NULL,
+				    target_io_thread, NULL);
+		if (rc) {
+			iscsi_trace_error(__FILE__, __LINE__,
+					  "pthread_create: %s\n",
+					  strerror(rc));
+			break;
+		}
+		io_pool.n_threads++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	return rc ? -1 : 0;
+}
+
+static void target_io_exit(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&io_pool.lock);
+	io_pool.stop = true;
+	pthread_cond_broadcast(&io_pool.work);
+	pthread_mutex_unlock(&io_pool.lock);
+
+	for (i = 0; i < io_pool.n_threads; i++)
+		pthread_join(io_pool.threads[i], NULL);
+
+	io_pool.n_threads = 0;
+	free(io_pool.threads);
+	io_pool.threads = NULL;
+}
+
+/********************
+ * Public Functions *
+ ********************/
+
+int target_init(struct globals *gp, targv_t * tv, char *TargetName)
+{
+	int             i;
+
+	strlcpy(gp->targetname, TargetName, sizeof(gp->targetname));
+	if (gp->state == TARGET_INITIALIZING || gp->state == TARGET_INITIALIZED) {
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "duplicate target initialization attempted\n");
+		return -1;
+	}
+	gp->state = TARGET_INITIALIZING;
+	gp->tv = tv;
+
+	pthread_rwlock_init(&sessions_lock, NULL);
+	for (i = 0; i < REF_HASH; i++)
+		INIT_LIST_HEAD(&refs.hash[i]);
+
+	if (gp->n_io_threads && (target_io_init(gp->n_io_threads) < 0))
+		return -1;
+
+	for (i = 0; i < tv->c; i++) {
+		if (device_init(gp, tv, &tv->v[i]) < 0) {
+			iscsi_trace_error(__FILE__, __LINE__,
+					  "device_init() failed\n");
+			return -1;
+		}
+	}
+
+	gp->state = TARGET_INITIALIZED;
+
+	fprintf(stderr, "TARGET: TargetName is %s\n", gp->targetname);
+
+	return 0;
+}
+
+int target_sess_cleanup(struct target_session *sess)
+{
+	/* Clean up */
+
+	if (param_list_destroy(sess->params) != 0) {
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "param_list_destroy() failed\n");
+		return -1;
+	}
+
+	net_conn_close(sess);
+	pdu_cleanup(sess, &sess->pdu);
+
+	/* tasks with device work are freed as it completes */
+	if (sess->tasks)
+		task_free_all(sess);
+	sess_claims_cancel(sess);
+
+	/*
+	 * Once off the session lists, no other thread reaches this
+	 * connection.  The session ends with its last connection.
+	 */
+	sessions_lock_begin(true);
+	list_del_init(&sess->sessions_node);
+	pthread_mutex_lock(&sess->nexus->lock);
+	list_del_init(&sess->cmdsn_node);
+	list_del_init(&sess->tmf_node);
+	pthread_mutex_unlock(&sess->nexus->lock);
+	list_del(&sess->conns_node);
+	/* aborts posted here are as good as done */
+	while (sess->n_aborts > 0)
+		nexus_tmf_confirm(sess->nexus,
+				  sess->aborts[--sess->n_aborts].tmf_seq);
+	if (--sess->nexus->n_conns == 0) {
+		list_del(&sess->nexus->nexus_node);
+		pthread_mutex_destroy(&sess->nexus->lock);
+		free(sess->nexus);
+	}
+	if (cur_sess == sess)
+		cur_sess = NULL;
+	sessions_lock_end();
+
+	iscsi_trace(TRACE_NET_DEBUG, __FILE__, __LINE__,
+		    "session %d: %" PRIu64 " reads for %" PRIu64 " PDUs\n",
+		    sess->id, sess->rx.reads, sess->rx.pdus);
+
+	if (!sess->worker->net)
+		event_del(&sess->ev);
+	event_del(&sess->zc_ev);
+	event_del(&sess->hold_ev);
+
+	atcp_wr_exit(&sess->wst);
+
+	/* Terminate connection */
+	if (sess->fd >= 0)
 		close(sess->fd);
+	sess->fd = -1;
 
 	iscsi_trace(TRACE_ISCSI_DEBUG, __FILE__, __LINE__,
 		    "session %d: ended\n", sess->id);
 
-	list_del_init(&sess->sessions_node);
-
-	/* Destroy session */
-	free(sess);
+	/* the event loop is not held up waiting for device work */
+	sess->ended = true;
+	if (!sess->n_io)
+		sess_free(sess);
 
 	return 0;
 }
@@ -1802,12 +3146,13 @@ int target_shutdown(struct globals *gp, bool strict_free)
 			return -1;
 		}
 
-		if (strict_free)
+		if (strict_free) {
+			sess_io_drain(sess);
 			target_sess_cleanup(sess);
+		}
 	}
 
-	if (strict_free)
-		hdrs_free_all();
+	target_io_exit();
 
 	/* listen socket is shutdown at layer above us */
 
@@ -1832,29 +3177,316 @@ static void target_read_hdr(struct target_session *sess)
 
 	sess->readst = srs_bhs;
 
-	pdu_reinit(&sess->pdu);
+	pdu_reinit(sess, &sess->pdu);
+}
+
+static void net_ready(struct net_ring *nr, struct net_conn *nc)
+{
+	if (!nc->on_ready) {
+		nc->on_ready = true;
+		list_add_tail(&nc->ready_node, &nr->ready);
+	}
+}
+
+/*
+ * Receives that ran out of provided buffers wait for one to come back,
+ * rather than re-arming straight into another -ENOBUFS.  A buffer may
+ * come back from outside net_ring_evt(), so kick the eventfd to get the
+ * waiters run.
+ */
+static void net_bufs_wake(struct net_ring *nr)
+{
+	struct net_conn *nc;
+	uint64_t n = 1;
+
+	while (!list_empty(&nr->nobufs)) {
+		nc = list_entry(nr->nobufs.next, struct net_conn, nobufs_node);
+		list_del(&nc->nobufs_node);
+		nc->recv_nobufs = false;
+		net_ready(nr, nc);
+	}
+
+	if (write(nr->efd, &n, sizeof(n)) < 0)
+		iscsi_trace_error(__FILE__, __LINE__, "eventfd write: %s\n",
+				  strerror(errno));
+}
+
+/*
+ * Refill the (fully parsed) receive buffer with a single read.  Once a
+ * read comes up short the socket is assumed dry, and no further reads
+ * are attempted until the next read event.
+ */
+static void net_buf_put(struct net_ring *nr, unsigned int bid)
+{
+	struct io_uring_buf *b = &nr->br->bufs[nr->br_tail & (NET_BUFS - 1)];
+
+	b->addr = (uintptr_t) (nr->bufs + (size_t) bid * NET_BUF_SIZE);
+	b->len = NET_BUF_SIZE;
+	b->bid = bid;
+
+	__atomic_store_n(&nr->br->tail, ++nr->br_tail, __ATOMIC_RELEASE);
+	nr->bufs_free++;
+
+	if (!list_empty(&nr->nobufs))
+		net_bufs_wake(nr);
 }
 
-static int net_readbuf(int fd, void *buf, unsigned int bufsz,
-		       unsigned int *progress_io)
+/* io_uring: the next received buffer becomes the receive buffer */
+static int net_rx_fill(struct target_session *sess)
 {
+	struct net_conn *nc = sess->conn;
+	struct target_rx *rx = &sess->rx;
+	unsigned int i;
+
+	if (rx->bid >= 0) {
+		net_buf_put(nc->nr, rx->bid);
+		rx->bid = -1;
+		rx->buf = NULL;
+	}
+	rx->head = rx->tail = 0;
+
+	if (nc->rxq_head == nc->rxq_tail) {
+		if (nc->recv_err)
+			return -1;
+		rx->drained = true;
+		return 0;
+	}
+
+	i = nc->rxq_head++ % NET_BUFS;
+	rx->bid = nc->rxq_bid[i];
+	rx->buf = nc->nr->bufs + (size_t) rx->bid * NET_BUF_SIZE;
+	rx->tail = nc->rxq_len[i];
+	rx->reads++;
+	rx->bytes += rx->tail;
+
+	return 1;
+}
+
+static int rx_fill(struct target_session *sess)
+{
+	struct target_rx *rx = &sess->rx;
 	ssize_t rc;
-	int progress = *progress_io;
 
-	if (progress >= bufsz)
-		return 1;
+	if (rx->drained)
+		return 0;
 
-	errno = 0;
-	rc = read(fd, buf + progress, bufsz - progress);
-	if (rc <= 0)
+	if (sess->conn)
+		return net_rx_fill(sess);
+
+	rx->head = rx->tail = 0;
+
+	rc = read(sess->fd, rx->buf, TARGET_RX_SIZE);
+	rx->reads++;
+	if (rc < 0) {
+		if (errno != EAGAIN)
+			return -1;
+		rx->drained = true;
+		return 0;
+	}
+	if (rc == 0)	/* connection closed */
 		return -1;
 
-	*progress_io = progress + rc;
+	rx->tail = rc;
+	rx->bytes += rc;
 
-	if (*progress_io == bufsz)
-		return 1;
+	if (rc < TARGET_RX_SIZE)
+		rx->drained = true;
 
-	return 0;
+	return 1;
+}
+
+/* gather a fixed-size chunk (BHS, AHS) from the receive buffer */
+static int rx_copy(struct target_session *sess, void *dst, unsigned int len,
+		   unsigned int *progress_io)
+{
+	struct target_rx *rx = &sess->rx;
+	unsigned int n;
+	int rc;
+
+	while (*progress_io < len) {
+		if (rx->head == rx->tail) {
+			rc = rx_fill(sess);
+			if (rc <= 0)
+				return rc;
+		}
+
+		n = MIN(rx->tail - rx->head, len - *progress_io);
+		memcpy(dst + *progress_io, rx->buf + rx->head, n);
+		rx->head += n;
+		*progress_io += n;
+	}
+
+	return 1;
+}
+
+/* read the remainder of a data segment and its padding from the socket */
+static int net_readdata(struct target_session *sess, struct target_pdu *pdu)
+{
+	struct target_rx *rx = &sess->rx;
+	struct iovec iov[2];
+	unsigned int progress = pdu->data_pad_recv;
+	unsigned int want = 0;
+	int n = 0;
+	ssize_t rc;
+
+	if (rx->drained)
+		return 0;
+
+	if (progress < pdu->data_len) {
+		iov[n].iov_base = pdu->data + progress;
+		iov[n].iov_len = pdu->data_len - progress;
+		want += iov[n++].iov_len;
+		progress = 0;
+	} else
+		progress -= pdu->data_len;
+
+	if (progress < pdu->pad_len) {
+		iov[n].iov_base = pdu->pad + progress;
+		iov[n].iov_len = pdu->pad_len - progress;
+		want += iov[n++].iov_len;
+	}
+
+	rc = readv(sess->fd, iov, n);
+	rx->reads++;
+	if (rc < 0) {
+		if (errno != EAGAIN)
+			return -1;
+		rx->drained = true;
+		return 0;
+	}
+	if (rc == 0)	/* connection closed */
+		return -1;
+
+	pdu->data_pad_recv += rc;
+	rx->bytes += rc;
+
+	if (rc < want)
+		rx->drained = true;
+
+	return 1;
+}
+
+/* receive a data segment and its padding, via the receive buffer */
+static int target_read_data(struct target_session *sess,
+			    struct target_pdu *pdu)
+{
+	struct target_rx *rx = &sess->rx;
+	unsigned int total = pdu->data_len + pdu->pad_len;
+	unsigned int progress, n;
+	int rc;
+
+	while (pdu->data_pad_recv < total) {
+		if (rx->head == rx->tail) {
+			/* large remainders bypass the receive buffer */
+			if (!sess->conn &&
+			    (total - pdu->data_pad_recv >= TARGET_RX_BYPASS))
+				rc = net_readdata(sess, pdu);
+			else
+				rc = rx_fill(sess);
+			if (rc <= 0)
+				return rc;
+			continue;
+		}
+
+		progress = pdu->data_pad_recv;
+		if (progress < pdu->data_len) {
+			n = MIN(rx->tail - rx->head, pdu->data_len - progress);
+			memcpy(pdu->data + progress, rx->buf + rx->head, n);
+		} else {
+			progress -= pdu->data_len;
+			n = MIN(rx->tail - rx->head, pdu->pad_len - progress);
+			memcpy(pdu->pad + progress, rx->buf + rx->head, n);
+		}
+
+		rx->head += n;
+		pdu->data_pad_recv += n;
+	}
+
+	return 1;
+}
+
+/*
+ * With the BHS in hand, decide whether the data segment of a WRITE
+ * (immediate data, or an in-order Data-Out PDU) may be received straight
+ * into its final location in the backing store.  The data lands before
+ * the command executes, so only a command certain to execute, and to
+ * write exactly there, qualifies; anything unusual is left to the
+ * normal, staged path and its error handling.
+ */
+static uint8_t *target_recv_direct(struct target_session *sess,
+				   const struct target_pdu *pdu)
+{
+	const uint8_t *buf = pdu->header;
+	const struct iscsi_sess_param *sp = &sess->sess_params;
+	uint32_t len = pdu->data_len;
+	uint32_t cmdsn, offset;
+	struct target_task *task;
+	uint64_t lun;
+	uint8_t *mem;
+	bool valid;
+
+	if (!sess->IsFullFeature || pdu->ahs_len || !len)
+		return NULL;
+	if (sp->max_data_seg && (len > sp->max_data_seg))
+		return NULL;
+
+	/* the storage threads, not the event loop, touch the backing store */
+	if (io_pool.n_threads)
+		return NULL;
+
+	switch (ISCSI_OPCODE(buf)) {
+	case ISCSI_SCSI_CMD:
+		if (!sp->immediate_data || !(buf[1] & 0x20))	/* Output */
+			return NULL;
+
+		/* the command must get a task, or its data is dropped */
+		if (list_empty(&sess->task_free) ||
+		    task_find(sess, ntohl(*((uint32_t *) (void *)(buf + 16)))))
+			return NULL;
+		if (sp->first_burst && (len > sp->first_burst))
+			return NULL;
+		if (len > ntohl(*((uint32_t *) (void *)(buf + 20))))
+			return NULL;
+
+		/*
+		 * only a command due now: one outside the CmdSN window is
+		 * ignored, and one ahead of it is held unexecuted
+		 */
+		cmdsn = ntohl(*((uint32_t *) (void *)(buf + 24)));
+		if (!(buf[0] & 0x40)) {				/* Immediate */
+			pthread_mutex_lock(&sess->nexus->lock);
+			valid = (cmdsn == sess->nexus->ExpCmdSN) &&
+				nexus_cmdsn_valid(sess->nexus, cmdsn);
+			pthread_mutex_unlock(&sess->nexus->lock);
+			if (!valid)
+				return NULL;
+		}
+
+		/* the device checks the CDB as it would the command's */
+		lun = GUINT64_FROM_BE(*((uint64_t *) (void *)(buf + 8)));
+		return device_recv_direct(sess, lun, buf + 32,
+				ntohl(*((uint32_t *) (void *)(buf + 20))), len);
+
+	case ISCSI_WRITE_DATA:
+		task = task_find(sess, ntohl(*((uint32_t *) (void *)(buf + 16))));
+		if (!task || !task->want_data_pdu || !task->scsi_cmd.recv_data)
+			return NULL;
+
+		offset = ntohl(*((uint32_t *) (void *)(buf + 40)));
+		if (!xfer_seq_expect(&task->xfer,
+				     ntohl(*((uint32_t *) (void *)(buf + 20))),
+				     offset, len))
+			return NULL;
+
+		/* not while READ data queued from there is still unsent */
+		mem = task->scsi_cmd.recv_data + offset;
+		if (target_mem_busy(mem, len))
+			return NULL;
+
+		return mem;
+	}
+
+	return NULL;
 }
 
 static void target_read_evt(struct target_session *sess)
@@ -1862,18 +3494,21 @@ static void target_read_evt(struct target_session *sess)
 	uint8_t        *buf;
 	unsigned int	v;
 	struct target_pdu *pdu = &sess->pdu;
+	struct target_rx *rx = &sess->rx;
 	int rc;
 
+	if (sess->rx_paused)
+		return;
+
+	rx->drained = false;
+
 restart:
 	switch (sess->readst) {
 	case srs_bhs:
-		rc = net_readbuf(sess->fd, &pdu->header, ISCSI_HEADER_LEN,
-				 &pdu->hdr_recv);
-		if (rc < 0) {	/* error */
-			if (errno != EAGAIN)
-				goto err_out;
-			break;
-		}
+		rc = rx_copy(sess, &pdu->header, ISCSI_HEADER_LEN,
+			     &pdu->hdr_recv);
+		if (rc < 0)	/* error */
+			goto err_out;
 		if (rc == 0)	/* more to read */
 			break;
 
@@ -1891,14 +3526,27 @@ restart:
 		v = pdu->ahs_len + pdu->data_len;
 		pdu->pad_len = padding_bytes(v);
 
-		if (pdu->data_len > 0 || pdu->pad_len > 0) {
-			pdu->data = malloc(pdu->data_len + pdu->pad_len);
-			if (!pdu->data)
-				goto err_out;
+		pdu->data = target_recv_direct(sess, pdu);
+		if (pdu->data)
+			pdu->data_direct = true;
+		else if (pdu->data_len > 0 || pdu->pad_len > 0) {
+			v = pdu->data_len + pdu->pad_len;
+
+			if (!pdu->ahs_len && (rx->tail - rx->head >= v)) {
+				/* whole segment already buffered; use in place */
+				pdu->data = rx->buf + rx->head;
+				pdu->data_in_rx = true;
+				pdu->data_pad_recv = v;
+				rx->head += v;
+			} else {
+				pdu->data = seg_get(&sess->segs, v);
+				if (!pdu->data)
+					goto err_out;
+			}
 		}
 
 		if (pdu->ahs_len) {
-			pdu->ahs = malloc(pdu->ahs_len);
+			pdu->ahs = seg_get(&sess->segs, pdu->ahs_len);
 			if (!pdu->ahs)
 				goto err_out;
 		}
@@ -1913,13 +3561,9 @@ restart:
 		goto restart;
 
 	case srs_ahs:
-		rc = net_readbuf(sess->fd, pdu->ahs, pdu->ahs_len,
-				 &pdu->ahs_recv);
-		if (rc < 0) {	/* error */
-			if (errno != EAGAIN)
-				goto err_out;
-			break;
-		}
+		rc = rx_copy(sess, pdu->ahs, pdu->ahs_len, &pdu->ahs_recv);
+		if (rc < 0)	/* error */
+			goto err_out;
 		if (rc == 0)	/* more to read */
 			break;
 
@@ -1935,14 +3579,9 @@ restart:
 		goto restart;
 
 	case srs_data_pad:
-		rc = net_readbuf(sess->fd,
-				 pdu->data, pdu->data_len + pdu->pad_len,
-				 &pdu->data_pad_recv);
-		if (rc < 0) {	/* error */
-			if (errno != EAGAIN)
-				goto err_out;
-			break;
-		}
+		rc = target_read_data(sess, pdu);
+		if (rc < 0)	/* error */
+			goto err_out;
 		if (rc == 0)	/* more to read */
 			break;
 
@@ -1951,68 +3590,602 @@ restart:
 		 * and any subsequent padding
 		 */
 
-		sess->readst = srs_exec_pdu;
+		sess->readst = srs_exec_pdu;
+
+		goto restart;
+
+	case srs_exec_pdu:
+		if (sess_cmdsn_hold(sess))
+			break;
+		rx->pdus++;
+		target_exec_pdu(sess);
+		target_read_hdr(sess);
+		if (sess_rx_pause(sess))
+			break;
+		goto restart;
+
+	case srs_err:
+		/* do nothing, invalid read state */
+		break;
+	}
+
+	atcp_write_run_compl(&sess->wst);
+	return;
+
+err_out:
+	target_sess_cleanup(sess);
+}
+
+static void target_tcp_evt(int fd, short events, void *userdata)
+{
+	struct target_session *sess = userdata;
+
+	if (!(events & EV_READ))
+		return;
+
+	sess_enter(sess);
+
+	/* socket errors, including zero-copy completions, wake reads */
+	atcp_zc_reap(&sess->wst);
+
+	target_read_evt(sess);
+
+	/* unless the session ended */
+	if (cur_sess == sess)
+		sess_leave(sess);
+}
+
+static void target_write_evt(int fd, short events, void *userdata)
+{
+	struct target_session *sess = userdata;
+
+	sess_enter(sess);
+
+	sess->write_cb(fd, events, sess->write_cb_data);
+	if (cur_sess == sess)
+		sess_rx_resume(sess);
+
+	if (cur_sess == sess)
+		sess_leave(sess);
+}
+
+static int target_sess_le_wset(void *ev_info, int fd, atcp_ev_func cb, void *cb_data)
+{
+	struct event *ev = ev_info;
+	struct target_session *sess;
+
+	sess = list_entry(ev, struct target_session, write_ev);
+	sess->write_cb = cb;
+	sess->write_cb_data = cb_data;
+
+	event_set(ev, fd, EV_WRITE | EV_PERSIST, target_write_evt, sess);
+	return event_base_set(sess->worker->base, ev);
+}
+
+static int target_sess_le_add(void *ev_info, const struct timeval *tv)
+{
+	struct event *ev = ev_info;
+	return event_add(ev, tv);
+}
+
+static int target_sess_le_del(void *ev_info)
+{
+	struct event *ev = ev_info;
+	return event_del(ev);
+}
+
+static const struct atcp_wr_ops libevent_wr_ops = {
+	.ev_wset	= target_sess_le_wset,
+	.ev_add		= target_sess_le_add,
+	.ev_del		= target_sess_le_del,
+};
+
+static void net_ring_cqe(void *data, uint64_t user_data, int res,
+			 uint32_t flags)
+{
+	struct net_ring *nr = data;
+	struct net_conn *nc;
+	unsigned int i;
+
+	nc = (struct net_conn *)(uintptr_t) (user_data & ~NET_OP_MASK);
+	if (!nc)		/* a cancellation */
+		return;
+
+	switch (user_data & NET_OP_MASK) {
+	case NET_OP_RECV:
+		if (!(flags & IORING_CQE_F_MORE)) {
+			nc->recv_armed = false;
+			nc->n_ops--;
+		}
+
+		if (res > 0)
+			nr->bufs_free--;
+
+		if (res > 0 && !nc->sess)
+			net_buf_put(nr, flags >> IORING_CQE_BUFFER_SHIFT);
+		else if (res > 0) {
+			i = nc->rxq_tail++ % NET_BUFS;
+			nc->rxq_bid[i] = flags >> IORING_CQE_BUFFER_SHIFT;
+			nc->rxq_len[i] = res;
+		} else if (res == 0)
+			nc->recv_err = -EPIPE;
+		else if (res == -ENOBUFS) {
+			/* unless some came back since; see net_bufs_wake() */
+			if (nc->sess && !nc->recv_nobufs && !nr->bufs_free) {
+				nc->recv_nobufs = true;
+				list_add_tail(&nc->nobufs_node, &nr->nobufs);
+			}
+		} else if (res != -ECANCELED)
+			nc->recv_err = res;	/* else re-armed */
+		break;
+
+	case NET_OP_SEND:
+		nc->n_ops--;
+		nc->send_res = res;
+		__atomic_store_n(&nc->send_state, NET_SEND_DONE,
+				 __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&nr->send_waiters, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&nr->send_lock);
+			pthread_cond_broadcast(&nr->send_done);
+			pthread_mutex_unlock(&nr->send_lock);
+		}
+		break;
+	}
+
+	if (!nc->sess) {
+		if (!nc->n_ops) {
+			nr->n_conns--;
+			free(nc);
+		}
+		return;
+	}
+
+	net_ready(nr, nc);
+}
+
+/* submit queued SQEs, and note the completions of any within timeout */
+static int net_ring_wait(struct net_ring *nr, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = nr->ring.fd, .events = POLLIN };
+	int rc;
+
+	rc = uring_submit(&nr->ring, 0);
+	if (rc < 0)
+		return rc;
+
+	rc = poll(&pfd, 1, timeout_ms);
+	if (rc <= 0)
+		return -ETIMEDOUT;
+
+	uring_reap(&nr->ring, net_ring_cqe, nr);
+	return 0;
+}
+
+static void net_cancel(struct net_ring *nr, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&nr->ring);
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = 0;
+}
+
+static int net_recv_arm(struct net_conn *nc, int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&nc->nr->ring);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = (uintptr_t) nc | NET_OP_RECV;
+
+	nc->recv_armed = true;
+	nc->n_ops++;
+	return 0;
+}
+
+/*
+ * Transmit backpressure.  Once more than tx_high octets of responses
+ * wait to be sent, stop reading new commands from the socket, leaving
+ * the initiator to TCP flow control; resume below tx_low.  Octets held
+ * only for zero-copy completion are already sent, and do not count.
+ */
+static bool sess_rx_pause(struct target_session *sess)
+{
+	struct globals *gp = sess->globals;
+
+	if (sess->rx_paused)
+		return true;
+	if (!gp->tx_high || atcp_wunsent(&sess->wst) < gp->tx_high)
+		return false;
+
+	sess->rx_pauses++;
+	sess_rx_stop(sess);
+	return true;
+}
+
+/* stop reading the socket; sess_rx_resume() starts it again */
+static void sess_rx_stop(struct target_session *sess)
+{
+	struct net_conn *nc = sess->conn;
+
+	if (sess->rx_paused)
+		return;
+
+	sess->rx_paused = true;
+
+	if (!nc)
+		event_del(&sess->ev);
+	else if (nc->recv_armed)
+		net_cancel(nc->nr, (uintptr_t) nc | NET_OP_RECV);
+}
+
+static void sess_rx_resume(struct target_session *sess)
+{
+	if (!sess->rx_paused || sess->cmdsn_held || sess->tmf_held ||
+	    atcp_wunsent(&sess->wst) > sess->globals->tx_low)
+		return;
+
+	sess->rx_paused = false;
+
+	if (!sess->conn && event_add(&sess->ev, NULL)) {
+		iscsi_trace_error(__FILE__, __LINE__, "event_add failed\n");
+		target_sess_cleanup(sess);
+		return;
+	}
+
+	/* commands already buffered do not wake the socket */
+	target_read_evt(sess);
+}
+
+/* apply a finished send; the caller holds the session lock */
+static void net_send_finish(struct target_session *sess)
+{
+	struct net_conn *nc = sess->conn;
+
+	if (__atomic_load_n(&nc->send_state, __ATOMIC_ACQUIRE) !=
+	    NET_SEND_DONE)
+		return;
+
+	nc->send_state = NET_SEND_IDLE;
+	atcp_send_done(&sess->wst, nc->send_res);
+}
+
+static int target_net_send(void *ev_info, const struct iovec *iov,
+			   int iovcnt, int flags)
+{
+	struct target_session *sess;
+	struct io_uring_sqe *sqe;
+	struct net_conn *nc;
+
+	sess = list_entry(ev_info, struct target_session, write_ev);
+	nc = sess->conn;
+
+	sqe = uring_get_sqe(&nc->nr->ring);
+	if (!sqe)
+		return -EBUSY;
+
+	/* the kernel reads these once the SQE is submitted */
+	memcpy(nc->iov, iov, iovcnt * sizeof(*iov));
+	memset(&nc->msg, 0, sizeof(nc->msg));
+	nc->msg.msg_iov = nc->iov;
+	nc->msg.msg_iovlen = iovcnt;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = sess->fd;
+	sqe->addr = (uintptr_t) &nc->msg;
+	sqe->len = 1;
+	sqe->msg_flags = flags;
+	sqe->user_data = (uintptr_t) nc | NET_OP_SEND;
+
+	nc->send_state = NET_SEND_BUSY;
+	nc->n_ops++;
+	return 0;
+}
+
+static bool net_send_busy(struct net_conn *nc)
+{
+	return __atomic_load_n(&nc->send_state, __ATOMIC_SEQ_CST) ==
+	       NET_SEND_BUSY;
+}
+
+/* sleep until a send of the ring completes, or the deadline passes */
+static void net_send_sleep(struct net_conn *nc, const struct timespec *ts)
+{
+	struct net_ring *nr = nc->nr;
+
+	pthread_mutex_lock(&nr->send_lock);
+	__atomic_add_fetch(&nr->send_waiters, 1, __ATOMIC_SEQ_CST);
+	while (net_send_busy(nc))
+		if (pthread_cond_timedwait(&nr->send_done, &nr->send_lock,
+					   ts) == ETIMEDOUT)
+			break;
+	__atomic_sub_fetch(&nr->send_waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&nr->send_lock);
+}
+
+/*
+ * Wait, at most timeout_ms, for the session's send to complete, so that
+ * its data may be overwritten.  Only the session's own event loop may
+ * reap its ring; other threads sleep until net_ring_cqe() notes the
+ * completion, which it does without the session lock they hold.
+ */
+static void target_net_send_wait(void *ev_info, int timeout_ms)
+{
+	struct target_session *sess;
+	struct net_conn *nc;
+	struct timespec ts;
+	uint64_t end;
+	int64_t left;
+
+	sess = list_entry(ev_info, struct target_session, write_ev);
+	nc = sess->conn;
+
+	if (cur_worker != sess->worker) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		net_send_sleep(nc, &ts);
+	} else {
+		end = now_ns() + (uint64_t) timeout_ms * 1000000;
+		while (net_send_busy(nc)) {
+			left = (int64_t)(end - now_ns()) / 1000000;
+			if ((left <= 0) || (net_ring_wait(nc->nr, left) < 0))
+				break;
+		}
+	}
+
+	net_send_finish(sess);
+}
 
-		goto restart;
+static const struct atcp_wr_ops uring_wr_ops = {
+	.ev_wset	= target_sess_le_wset,
+	.ev_add		= target_sess_le_add,
+	.ev_del		= target_sess_le_del,
+	.send		= target_net_send,
+	.send_wait	= target_net_send_wait,
+};
 
-	case srs_exec_pdu:
-		target_exec_pdu(sess);
-		target_read_hdr(sess);
-		goto restart;
+static void net_conn_run(struct target_session *sess)
+{
+	struct net_conn *nc = sess->conn;
 
-	case srs_err:
-		/* do nothing, invalid read state */
-		break;
+	net_send_finish(sess);
+
+	if ((nc->rxq_head != nc->rxq_tail) || nc->recv_err) {
+		target_read_evt(sess);
+		if (cur_sess != sess)	/* session ended */
+			return;
 	}
 
+	/* carry on with whatever the send left queued */
+	atcp_write_start(&sess->wst);
 	atcp_write_run_compl(&sess->wst);
-	return;
 
-err_out:
-	target_sess_cleanup(sess);
+	sess_rx_resume(sess);
+	if (cur_sess != sess)
+		return;
+
+	if (!sess->rx_paused && !nc->recv_armed && !nc->recv_nobufs &&
+	    !nc->recv_err && (net_recv_arm(nc, sess->fd) < 0))
+		target_sess_cleanup(sess);
 }
 
-static void target_tcp_evt(int fd, short events, void *userdata)
+static void net_ring_evt(int fd, short events, void *userdata)
 {
-	struct target_session *sess = userdata;
+	struct target_worker *w = userdata;
+	struct net_ring *nr = w->net;
+	struct target_session *sess;
+	struct net_conn *nc;
+	uint64_t n;
 
-	if (!(events & EV_READ))
-		return;
+	if (read(fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		iscsi_trace_error(__FILE__, __LINE__, "eventfd read: %s\n",
+				  strerror(errno));
 
-	target_read_evt(sess);
+	uring_reap(&nr->ring, net_ring_cqe, nr);
+
+	while (!list_empty(&nr->ready)) {
+		nc = list_entry(nr->ready.next, struct net_conn, ready_node);
+		list_del(&nc->ready_node);
+		nc->on_ready = false;
+
+		sess = nc->sess;
+		sess_enter(sess);
+		net_conn_run(sess);
+		if (cur_sess == sess)
+			sess_leave(sess);
+	}
 }
 
-static int target_sess_le_wset(void *ev_info, int fd, atcp_ev_func cb, void *cb_data)
+static int net_conn_open(struct target_session *sess)
 {
-	struct event *ev = ev_info;
+	struct net_conn *nc;
+
+	nc = calloc(1, sizeof(*nc));
+	if (!nc)
+		return -1;
 
-	event_set(ev, fd, EV_WRITE | EV_PERSIST, cb, cb_data);
+	nc->sess = sess;
+	nc->nr = sess->worker->net;
+	if (net_recv_arm(nc, sess->fd) < 0) {
+		free(nc);
+		return -1;
+	}
+
+	nc->nr->n_conns++;
+	sess->conn = nc;
 	return 0;
 }
 
-static int target_sess_le_add(void *ev_info, const struct timeval *tv)
+/*
+ * Cancel the session's receives, and wait out its send, whose data the
+ * kernel may still be reading.  Shutting the socket down first fails
+ * a send the peer is not draining, so the wait is short; it is bounded
+ * all the same, lest the event loop hang on a send the kernel will not
+ * let go of.  The connection itself is freed once its last SQE
+ * completes.
+ */
+static void net_conn_close(struct target_session *sess)
 {
-	struct event *ev = ev_info;
-	return event_add(ev, tv);
+	struct net_conn *nc = sess->conn;
+	struct net_ring *nr;
+
+	if (!nc)
+		return;
+	nr = nc->nr;
+
+	shutdown(sess->fd, SHUT_RDWR);
+
+	if (nc->recv_armed)
+		net_cancel(nr, (uintptr_t) nc | NET_OP_RECV);
+	if (nc->send_state == NET_SEND_BUSY) {
+		net_cancel(nr, (uintptr_t) nc | NET_OP_SEND);
+		target_net_send_wait(&sess->write_ev, NET_CLOSE_WAIT_MS);
+		if (nc->send_state == NET_SEND_BUSY)
+			iscsi_trace_error(__FILE__, __LINE__,
+					  "session %d: send not cancelled\n",
+					  sess->id);
+	}
+	net_send_finish(sess);
+
+	while (nc->rxq_head != nc->rxq_tail)
+		net_buf_put(nr, nc->rxq_bid[nc->rxq_head++ % NET_BUFS]);
+	if (sess->rx.bid >= 0)
+		net_buf_put(nr, sess->rx.bid);
+	sess->rx.bid = -1;
+	sess->rx.buf = NULL;
+
+	if (nc->on_ready)
+		list_del(&nc->ready_node);
+	if (nc->recv_nobufs)
+		list_del(&nc->nobufs_node);
+
+	nc->sess = NULL;
+	sess->conn = NULL;
+	if (!nc->n_ops) {
+		nr->n_conns--;
+		free(nc);
+	} else
+		uring_submit(&nr->ring, 0);
 }
 
-static int target_sess_le_del(void *ev_info)
+static int net_ring_init(struct target_worker *w)
 {
-	struct event *ev = ev_info;
-	return event_del(ev);
+	struct io_uring_buf_reg reg;
+	struct net_ring *nr;
+	unsigned int i;
+	int rc;
+
+	nr = calloc(1, sizeof(*nr));
+	if (!nr)
+		return -1;
+	INIT_LIST_HEAD(&nr->ready);
+	INIT_LIST_HEAD(&nr->nobufs);
+	pthread_mutex_init(&nr->send_lock, NULL);
+	pthread_cond_init(&nr->send_done, NULL);
+
+	rc = uring_init(&nr->ring, NET_ENTRIES);
+	if (rc) {
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "io_uring_setup failed: %s\n",
+				  strerror(-rc));
+		goto err_out;
+	}
+
+	if (posix_memalign((void **) &nr->br, getpagesize(),
+			   NET_BUFS * sizeof(struct io_uring_buf)) ||
+	    posix_memalign((void **) &nr->bufs, getpagesize(),
+			   (size_t) NET_BUFS * NET_BUF_SIZE))
+		goto err_out_ring;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) nr->br;
+	reg.ring_entries = NET_BUFS;
+	reg.bgid = 0;
+	rc = uring_register(&nr->ring, IORING_REGISTER_PBUF_RING, &reg, 1);
+	if (rc) {
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "io_uring provided buffers: %s\n",
+				  strerror(-rc));
+		goto err_out_ring;
+	}
+
+	nr->br->tail = 0;
+	for (i = 0; i < NET_BUFS; i++)
+		net_buf_put(nr, i);
+
+	nr->efd = eventfd(0, EFD_NONBLOCK);
+	if (nr->efd < 0)
+		goto err_out_ring;
+
+	if (uring_register(&nr->ring, IORING_REGISTER_EVENTFD, &nr->efd, 1))
+		goto err_out_efd;
+
+	event_set(&nr->ev, nr->efd, EV_READ | EV_PERSIST, net_ring_evt, w);
+	event_base_set(w->base, &nr->ev);
+	if (event_add(&nr->ev, NULL) < 0)
+		goto err_out_efd;
+
+	w->net = nr;
+	return 0;
+
+err_out_efd:
+	close(nr->efd);
+err_out_ring:
+	uring_exit(&nr->ring);
+	free(nr->bufs);
+	free(nr->br);
+err_out:
+	pthread_cond_destroy(&nr->send_done);
+	pthread_mutex_destroy(&nr->send_lock);
+	free(nr);
+	return -1;
 }
 
-static const struct atcp_wr_ops libevent_wr_ops = {
-	.ev_wset	= target_sess_le_wset,
-	.ev_add		= target_sess_le_add,
-	.ev_del		= target_sess_le_del,
-};
+static void net_ring_exit(struct target_worker *w)
+{
+	struct net_ring *nr = w->net;
+
+	if (!nr)
+		return;
+
+	/* connections of ended sessions, awaiting cancellations */
+	while (nr->n_conns && (net_ring_wait(nr, NET_CLOSE_WAIT_MS) == 0))
+		;
+
+	event_del(&nr->ev);
+	close(nr->efd);
+	uring_exit(&nr->ring);
+	free(nr->bufs);
+	free(nr->br);
+	pthread_cond_destroy(&nr->send_done);
+	pthread_mutex_destroy(&nr->send_lock);
+	free(nr);
+	w->net = NULL;
+}
 
 int target_accept(struct globals *gp, struct server_socket *sock)
 {
 	struct target_session *sess;
 	struct iscsi_parameter **l;
 	socklen_t addrlen = sizeof(struct sockaddr_in6);
+	unsigned int i;
 	int on = 1;
 
 	iscsi_trace(TRACE_NET_DEBUG, __FILE__, __LINE__,
@@ -2029,6 +4202,8 @@ int target_accept(struct globals *gp, struct server_socket *sock)
 	}
 
 	INIT_LIST_HEAD(&sess->sessions_node);
+	pthread_mutex_init(&sess->lock, NULL);
+	sess->worker = sock->worker;
 
 	sess->fd = accept(sock->fd, (struct sockaddr *) &sess->addr, &addrlen);
 	if (sess->fd < 0) {
@@ -2039,11 +4214,52 @@ int target_accept(struct globals *gp, struct server_socket *sock)
 
 	sess->globals = gp;
 
-	atcp_wr_init(&sess->wst, &libevent_wr_ops, &sess->write_ev, sess);
+	seg_pool_init(&sess->segs, ISCSI_DATA_SEG_DFLT);
+
+	/* with io_uring, data is received into the loop's buffers */
+	sess->rx.bid = -1;
+	if (!sess->worker->net) {
+		sess->rx.buf = malloc(TARGET_RX_SIZE);
+		if (!sess->rx.buf)
+			goto err_out_fd;
+	}
+
+	sess->tasks = calloc(gp->queue_depth, sizeof(struct target_task));
+	if (!sess->tasks)
+		goto err_out_fd;
+
+	/* a private nexus, until login creates or joins a session */
+	sess->nexus = calloc(1, sizeof(*sess->nexus));
+	if (!sess->nexus)
+		goto err_out_fd;
+	INIT_LIST_HEAD(&sess->nexus->conns);
+	INIT_LIST_HEAD(&sess->nexus->nexus_node);
+	INIT_LIST_HEAD(&sess->nexus->cmdsn_waiters);
+	INIT_LIST_HEAD(&sess->nexus->tmf_waiters);
+	INIT_LIST_HEAD(&sess->cmdsn_node);
+	INIT_LIST_HEAD(&sess->tmf_node);
+	INIT_LIST_HEAD(&sess->refs);
+	pthread_mutex_init(&sess->nexus->lock, NULL);
+	list_add_tail(&sess->conns_node, &sess->nexus->conns);
+	sess->nexus->n_conns = 1;
+
+	INIT_LIST_HEAD(&sess->task_free);
+	for (i = 0; i < gp->queue_depth; i++)
+		list_add_tail(&sess->tasks[i].node, &sess->task_free);
+	for (i = 0; i < TARGET_TASK_HASH; i++)
+		INIT_LIST_HEAD(&sess->task_hash[i]);
+
+	atcp_wr_init(&sess->wst, sess->worker->net ? &uring_wr_ops :
+		     &libevent_wr_ops, &sess->write_ev, sess);
 	atcp_wr_set_fd(&sess->wst, sess->fd);
 
 	event_set(&sess->ev, sess->fd, EV_READ | EV_PERSIST,
 		  target_tcp_evt, sess);
+	event_base_set(sess->worker->base, &sess->ev);
+	evtimer_set(&sess->zc_ev, target_zc_evt, sess);
+	event_base_set(sess->worker->base, &sess->zc_ev);
+	evtimer_set(&sess->hold_ev, target_hold_evt, sess);
+	event_base_set(sess->worker->base, &sess->hold_ev);
 
 	if (fsetflags("tcp client", sess->fd, O_NONBLOCK) < 0) {
 		iscsi_trace(TRACE_NET_DEBUG, __FILE__, __LINE__,
@@ -2057,7 +4273,18 @@ int target_accept(struct globals *gp, struct server_socket *sock)
 		goto err_out_fd;
 	}
 
-	if (event_add(&sess->ev, NULL)) {
+	if (gp->zerocopy_min &&
+	    (atcp_wr_set_zerocopy(&sess->wst, gp->zerocopy_min) < 0))
+		iscsi_trace_warning(__FILE__, __LINE__,
+				    "MSG_ZEROCOPY unavailable, copying\n");
+
+	if (sess->worker->net) {
+		if (net_conn_open(sess) < 0) {
+			iscsi_trace(TRACE_NET_DEBUG, __FILE__, __LINE__,
+				    "io_uring recv failed\n");
+			goto err_out_fd;
+		}
+	} else if (event_add(&sess->ev, NULL)) {
 		iscsi_trace(TRACE_NET_DEBUG, __FILE__, __LINE__,
 			    "event_add failed\n", strerror(errno));
 		goto err_out_fd;
@@ -2113,7 +4340,7 @@ int target_accept(struct globals *gp, struct server_socket *sock)
 	PARAM_LIST_ADD(l, ISCSI_PARAM_TYPE_LIST, "DataDigest", "None", "None",
 		       return -1);
 	PARAM_LIST_ADD(l, ISCSI_PARAM_TYPE_NUMERICAL, "MaxConnections", "1",
-		       "1", return -1);
+		       "8", return -1);	/* TARGET_MAX_CONNS */
 	PARAM_LIST_ADD(l, ISCSI_PARAM_TYPE_DECLARATIVE, "SendTargets", "", "",
 		       return -1);
 	PARAM_LIST_ADD(l, ISCSI_PARAM_TYPE_DECLARATIVE, "TargetName", "", "",
@@ -2150,7 +4377,7 @@ int target_accept(struct globals *gp, struct server_socket *sock)
 	PARAM_LIST_ADD(l, ISCSI_PARAM_TYPE_NUMERICAL, "DefaultTime2Retain",
 		       "20", "20", return -1);
 	PARAM_LIST_ADD(l, ISCSI_PARAM_TYPE_NUMERICAL, "MaxOutstandingR2T", "1",
-		       "1", return -1);
+		       "16", return -1);	/* TARGET_MAX_R2T */
 	PARAM_LIST_ADD(l, ISCSI_PARAM_TYPE_BINARY_OR, "DataPDUInOrder", "Yes",
 		       "Yes,No", return -1);
 	PARAM_LIST_ADD(l, ISCSI_PARAM_TYPE_BINARY_OR, "DataSequenceInOrder",
@@ -2173,13 +4400,593 @@ int target_accept(struct globals *gp, struct server_socket *sock)
 	/* Begin PDU input loop */
 	target_read_hdr(sess);
 
+	pthread_rwlock_wrlock(&sessions_lock);
 	list_add_tail(&sess->sessions_node, &session_list);
+	pthread_rwlock_unlock(&sessions_lock);
 
 	return 0;
 
 err_out_fd:
 	close(sess->fd);
 err_out:
+	seg_pool_exit(&sess->segs);
+	free(sess->rx.buf);
+	free(sess->tasks);
+	if (sess->nexus)
+		pthread_mutex_destroy(&sess->nexus->lock);
+	free(sess->nexus);
+	pthread_mutex_destroy(&sess->lock);
 	free(sess);
 	return -1;
 }
+
+/*
+ * Is READ data queued by reference in [lo, hi)?  If claim, each such
+ * piece is marked as waited on, and the connection that queued it woken
+ * to copy it; see sess_refs_copy().  refs.lock held.
+ */
+static bool refs_overlap(const uint8_t *lo, const uint8_t *hi, bool claim)
+{
+	uintptr_t r, first, last;
+	struct target_ref *ref;
+	bool found = false;
+
+	/* a piece may start regions before lo */
+	first = (uintptr_t) lo >> REF_REGION_SHIFT;
+	first -= MIN(first, refs.span);
+	last = ((uintptr_t) hi - 1) >> REF_REGION_SHIFT;
+	if (last - first >= REF_HASH) {
+		first = 0;
+		last = REF_HASH - 1;
+	}
+
+	for (r = first; r <= last; r++)
+		list_for_each_entry(ref, &refs.hash[r % REF_HASH], node) {
+			if ((ref->lo >= hi) || (ref->hi <= lo))
+				continue;
+
+			found = true;
+			if (!claim)
+				return true;
+			if (ref->claimed)
+				continue;
+
+			ref->claimed = true;
+			ref->sess->refs_claimed = true;
+			target_worker_wake(ref->sess->worker);
+		}
+
+	return found;
+}
+
+/* queue READ data by reference; NULL to send a copy instead */
+static struct target_ref *sess_ref_add(struct target_session *sess,
+				       const uint8_t *buf, size_t len,
+				       int fd, uint64_t off)
+{
+	struct target_ref *ref;
+	uintptr_t span;
+
+	ref = malloc(sizeof(*ref));
+	if (!ref)
+		return NULL;
+
+	ref->lo = buf;
+	ref->hi = buf + len;
+	ref->fd = fd;
+	ref->off = off;
+	ref->sess = sess;
+	ref->claimed = false;
+
+	span = (((uintptr_t) ref->hi - 1) >> REF_REGION_SHIFT) -
+	       ((uintptr_t) buf >> REF_REGION_SHIFT);
+
+	pthread_mutex_lock(&refs.lock);
+	list_add_tail(&ref->node, &refs.hash[((uintptr_t) buf >>
+					      REF_REGION_SHIFT) % REF_HASH]);
+	list_add_tail(&ref->sess_node, &sess->refs);
+	refs.span = MAX(refs.span, span);
+	__atomic_store_n(&refs.n_refs, refs.n_refs + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&refs.lock);
+
+	return ref;
+}
+
+/*
+ * atcp write callback: the data is sent, given a private copy, or
+ * dropped with the connection.  WRITEs parked on nothing else resume.
+ */
+static bool target_ref_put(struct atcp_wr_state *wst, void *cb_data,
+			   bool done)
+{
+	struct target_ref *ref = cb_data;
+	struct target_io *io, *tmp;
+
+	pthread_mutex_lock(&refs.lock);
+	list_del(&ref->node);
+	list_del(&ref->sess_node);
+	__atomic_store_n(&refs.n_refs, refs.n_refs - 1, __ATOMIC_RELEASE);
+
+	list_for_each_entry_safe(io, tmp, &refs.waiters, claim_node) {
+		if ((ref->lo >= io->claim_hi) || (ref->hi <= io->claim_lo) ||
+		    refs_overlap(io->claim_lo, io->claim_hi, false))
+			continue;
+
+		list_del_init(&io->claim_node);
+		target_io_post(io->sess->worker, io);
+	}
+	pthread_mutex_unlock(&refs.lock);
+
+	free(ref);
+	return false;
+}
+
+/*
+ * Pieces held by zero-copy sends are let go as the kernel reports them
+ * done on the socket's error queue, which the read and write events
+ * see.  With reads stopped, perhaps waiting on a CmdSN, and nothing
+ * left to send, neither may run; look in now and then instead.
+ */
+static void sess_zc_watch(struct target_session *sess)
+{
+	struct timeval tv = { .tv_usec = REF_ZC_REAP_MS * 1000 };
+
+	if (!sess->rx_paused || list_empty(&sess->wst.zc_q))
+		return;
+
+	if (evtimer_add(&sess->zc_ev, &tv))
+		iscsi_trace_error(__FILE__, __LINE__, "evtimer_add failed\n");
+}
+
+/*
+ * Copy the READ data this connection queued by reference that WRITEs
+ * wait on.  What a send in flight, or a zero-copy send, still holds
+ * cannot be copied; it lets go as the send completes.
+ */
+static void sess_refs_copy(struct target_session *sess)
+{
+	struct target_ref *ref;
+	const uint8_t *lo;
+	uint64_t off;
+	size_t len;
+	bool found;
+	bool busy = false;
+	int fd;
+
+	do {
+		found = false;
+
+		pthread_mutex_lock(&refs.lock);
+		sess->refs_claimed = false;
+		list_for_each_entry(ref, &sess->refs, sess_node)
+			if (ref->claimed) {
+				ref->claimed = false;
+				lo = ref->lo;
+				len = ref->hi - ref->lo;
+				fd = ref->fd;
+				off = ref->off;
+				found = true;
+				break;
+			}
+		pthread_mutex_unlock(&refs.lock);
+
+		/* the callbacks of pieces copied take refs.lock */
+		if (found && (fd >= 0))
+			busy |= atcp_write_remap_file(&sess->wst, fd, off,
+						      lo, len) == -EBUSY;
+		else if (found)
+			busy |= atcp_write_remap(&sess->wst, lo, len) == -EBUSY;
+	} while (found);
+
+	if (busy)
+		sess_zc_watch(sess);
+}
+
+static void target_zc_evt(int fd, short events, void *userdata)
+{
+	struct target_session *sess = userdata;
+	bool waiting;
+
+	sess_enter(sess);
+
+	atcp_zc_reap(&sess->wst);
+	atcp_write_run_compl(&sess->wst);
+
+	pthread_mutex_lock(&refs.lock);
+	waiting = !list_empty(&refs.waiters);
+	pthread_mutex_unlock(&refs.lock);
+
+	if (waiting)
+		sess_zc_watch(sess);
+
+	sess_leave(sess);
+}
+
+/*
+ * A held connection does not read its socket, so would not see the
+ * initiator hang up or reset it; look for that now and then instead.
+ * Nor may a hold last for ever: a CmdSN gap never filled, or aborts
+ * never confirmed, end the connection after TARGET_HOLD_MS.
+ */
+static void sess_hold_watch(struct target_session *sess)
+{
+	struct timeval tv = { .tv_usec = TARGET_HOLD_POLL_MS * 1000 };
+
+	if (!sess->hold_start)
+		sess->hold_start = now_ns();
+
+	if (evtimer_add(&sess->hold_ev, &tv))
+		iscsi_trace_error(__FILE__, __LINE__, "evtimer_add failed\n");
+}
+
+static void target_hold_evt(int fd, short events, void *userdata)
+{
+	struct target_session *sess = userdata;
+	struct pollfd pfd = { .fd = sess->fd, .events = POLLRDHUP };
+
+	sess_enter(sess);
+
+	if (!sess->cmdsn_held && !sess->tmf_held) {
+		sess->hold_start = 0;
+		sess_leave(sess);
+		return;
+	}
+
+	if ((poll(&pfd, 1, 0) > 0) &&
+	    (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+		iscsi_trace(TRACE_NET_DEBUG, __FILE__, __LINE__,
+			    "session %d: closed while held\n", sess->id);
+		target_sess_cleanup(sess);
+		return;
+	}
+
+	if (now_ns() - sess->hold_start >= TARGET_HOLD_MS * 1000000ULL) {
+		iscsi_trace_error(__FILE__, __LINE__,
+				  "session %d: %s held over %d ms\n", sess->id,
+				  sess->tmf_held ? "task management response" :
+				  "command", TARGET_HOLD_MS);
+		target_sess_cleanup(sess);
+		return;
+	}
+
+	sess_hold_watch(sess);
+	sess_leave(sess);
+}
+
+/* WRITEs the session parked are not waited for once it ends */
+static void sess_claims_cancel(struct target_session *sess)
+{
+	struct target_io *io, *tmp;
+
+	pthread_mutex_lock(&refs.lock);
+	list_for_each_entry_safe(io, tmp, &refs.waiters, claim_node)
+		if (io->sess == sess) {
+			list_del_init(&io->claim_node);
+			target_io_post(sess->worker, io);
+		}
+	pthread_mutex_unlock(&refs.lock);
+}
+
+/*
+ * May [buf, buf+len) of the backing store be overwritten right now?  If
+ * READ data queued by reference is still to be sent from it, the
+ * connections that queued it are asked to copy it, and true returned.
+ */
+bool target_mem_busy(const void *buf, size_t len)
+{
+	bool busy;
+
+	if (!len || !__atomic_load_n(&refs.n_refs, __ATOMIC_ACQUIRE))
+		return false;
+
+	pthread_mutex_lock(&refs.lock);
+	busy = refs_overlap(buf, (const uint8_t *) buf + len, true);
+	pthread_mutex_unlock(&refs.lock);
+
+	return busy;
+}
+
+/*
+ * Ready [buf, buf+len) of the backing store to be overwritten by a
+ * command.  READ data queued by reference, not yet sent from there,
+ * must keep what it had: the connections that queued it copy it, or
+ * let go as their sends complete.  Meanwhile the command is parked, as
+ * device work, and resume() called on the session's event loop once
+ * the range is clear, to try again.
+ *
+ * Returns 0 if the range may be overwritten at once, 1 if parked.
+ */
+int target_mem_claim(struct target_session *sess, struct target_cmd *tc,
+		     const void *buf, size_t len, target_io_fn resume)
+{
+	struct target_io *io = &tc->task->io;
+	const uint8_t *lo = buf, *hi = lo + len;
+
+	if (!len || !__atomic_load_n(&refs.n_refs, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pthread_mutex_lock(&refs.lock);
+	if (!refs_overlap(lo, hi, true)) {
+		pthread_mutex_unlock(&refs.lock);
+		return 0;
+	}
+
+	io->sess = sess;
+	io->cmd = *tc;
+	io->fn = resume;
+	io->release = NULL;
+	io->busy = true;
+	io->aborted = false;
+	io->parked = true;
+	io->start = now_ns();
+	io->claim_lo = lo;
+	io->claim_hi = hi;
+	list_add_tail(&io->claim_node, &refs.waiters);
+	sess->n_io++;
+	sess->claim_parks++;
+	pthread_mutex_unlock(&refs.lock);
+
+	return 1;
+}
+
+void target_stats(FILE *f)
+{
+	struct target_session *sess;
+	uint64_t total;
+
+	sessions_lock_begin(false);
+	list_for_each_entry(sess, &session_list, sessions_node) {
+		pthread_mutex_lock(&sess->lock);
+
+		total = sess->segs.hits + sess->segs.misses;
+
+		fprintf(f, "session %d (%s): segment cache %" PRIu64
+			" hits, %" PRIu64 " misses (%u%% hit), %" PRIu64
+			" in use, %" PRIu64 " peak\n",
+			sess->id, sess->initiator,
+			sess->segs.hits, sess->segs.misses,
+			total ? (unsigned int)(sess->segs.hits * 100 / total) : 0,
+			sess->segs.in_use, sess->segs.in_use_max);
+
+		fprintf(f, "session %d (%s): %" PRIu64 " reads, %" PRIu64
+			" bytes, %" PRIu64 " PDUs\n",
+			sess->id, sess->initiator,
+			sess->rx.reads, sess->rx.bytes, sess->rx.pdus);
+
+		fprintf(f, "session %d (%s): %" PRIu64 " optimistic writes, %"
+			PRIu64 " queued READ data remapped, %zu peak queued, %"
+			PRIu64 " writes past descriptor ring, %u peak headers\n",
+			sess->id, sess->initiator, sess->wst.opt_write,
+			sess->wst.remaps, sess->wst.write_cnt_max,
+			sess->wst.ring_full, sess->wst.wbuf_cnt_max);
+
+		fprintf(f, "session %d (%s): %zu octets unsent, %zu peak, "
+			"%" PRIu64 " reads paused for backlog\n",
+			sess->id, sess->initiator,
+			atcp_wunsent(&sess->wst), sess->wst.write_unsent_max,
+			sess->rx_pauses);
+
+		fprintf(f, "session %d (%s): %u tasks held, %u peak, %"
+			PRIu64 " refused with TASK SET FULL\n",
+			sess->id, sess->initiator, sess->n_tasks,
+			sess->n_tasks_max, sess->task_set_full);
+
+		if (sess->io_queued)
+			fprintf(f, "session %d (%s): %" PRIu64
+				" commands completed asynchronously\n",
+				sess->id, sess->initiator, sess->io_queued);
+
+		pthread_mutex_lock(&sess->nexus->lock);
+		if (sess->nexus->lat_avg)
+			fprintf(f, "session %d (%s): CmdSN window %u, %u "
+				"lowest, %" PRIu64 " cuts; storage latency %"
+				PRIu64 " us, %" PRIu64 " us baseline\n",
+				sess->id, sess->initiator, sess->nexus->window,
+				sess->nexus->window_min,
+				sess->nexus->window_cuts,
+				sess->nexus->lat_avg / 1000,
+				sess->nexus->lat_min / 1000);
+		pthread_mutex_unlock(&sess->nexus->lock);
+
+		if (sess->claim_parks)
+			fprintf(f, "session %d (%s): %" PRIu64
+				" writes waited for queued READ data\n",
+				sess->id, sess->initiator, sess->claim_parks);
+
+		if (sess->cmdsn_holds)
+			fprintf(f, "session %d (%s): %" PRIu64
+				" commands held for CmdSN order\n",
+				sess->id, sess->initiator, sess->cmdsn_holds);
+
+		if (sess->nexus->n_conns > 1)
+			fprintf(f, "session %d (%s): CID %u, one of %u "
+				"connections of TSIH %u\n", sess->id,
+				sess->initiator, sess->cid,
+				sess->nexus->n_conns, sess->nexus->tsih);
+
+		if (sess->wst.zc_min)
+			fprintf(f, "session %d (%s): %" PRIu64
+				" zero-copy sends, %" PRIu64
+				" copied by kernel\n",
+				sess->id, sess->initiator,
+				sess->wst.zc_sends, sess->wst.zc_copied);
+
+		if (sess->conn)
+			fprintf(f, "session %d (%s): %" PRIu64
+				" io_uring sends\n", sess->id,
+				sess->initiator, sess->wst.async_sends);
+
+		pthread_mutex_unlock(&sess->lock);
+	}
+	sessions_lock_end();
+}
+
+/* a connection of this worker whose held command or response is now due */
+static struct target_session *worker_held_due(struct target_worker *w)
+{
+	struct target_session *sess, *due = NULL;
+
+	sessions_lock_begin(false);
+	list_for_each_entry(sess, &session_list, sessions_node) {
+		if ((sess->worker != w) || (!sess->cmdsn_held &&
+					    !sess->tmf_held))
+			continue;
+
+		pthread_mutex_lock(&sess->nexus->lock);
+		if ((sess->cmdsn_held && list_empty(&sess->cmdsn_node)) ||
+		    (sess->tmf_held && list_empty(&sess->tmf_node)))
+			due = sess;
+		pthread_mutex_unlock(&sess->nexus->lock);
+		if (due)
+			break;
+	}
+	sessions_lock_end();
+
+	return due;
+}
+
+static void target_wake_evt(int fd, short events, void *userdata)
+{
+	struct target_worker *w = userdata;
+	struct target_session *sess;
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	if (w->stop) {
+		event_base_loopbreak(w->base);
+		return;
+	}
+
+	sessions_lock_begin(false);
+	list_for_each_entry(sess, &session_list, sessions_node) {
+		if (sess->worker != w)
+			continue;
+
+		pthread_mutex_lock(&sess->lock);
+		sess_abort_pending(sess);
+		if (__atomic_load_n(&sess->refs_claimed, __ATOMIC_RELAXED))
+			sess_refs_copy(sess);
+		pthread_mutex_unlock(&sess->lock);
+	}
+	sessions_lock_end();
+
+	/*
+	 * Only this worker ends its connections, so one found stays
+	 * valid once the session list is unlocked.
+	 */
+	while ((sess = worker_held_due(w))) {
+		sess_enter(sess);
+		event_del(&sess->hold_ev);
+		sess->hold_start = 0;
+		if (!sess->tmf_held) {
+			sess->cmdsn_held = false;
+		} else {
+			sess->tmf_held = false;
+			if (task_rsp_send(sess, sess->tmf_tag,
+					  sess->tmf_response) < 0) {
+				target_sess_cleanup(sess);
+				continue;
+			}
+		}
+		if (sess->conn)
+			net_conn_run(sess);
+		else
+			sess_rx_resume(sess);
+		if (cur_sess == sess)
+			sess_leave(sess);
+	}
+}
+
+int target_worker_init(struct globals *gp, struct target_worker *w)
+{
+	INIT_LIST_HEAD(&w->sockets);
+
+	if (pipe(w->wake_fd) < 0) {
+		iscsi_trace_error(__FILE__, __LINE__, "pipe: %s\n",
+				  strerror(errno));
+		return -1;
+	}
+
+	if ((fsetflags("wake pipe", w->wake_fd[0], O_NONBLOCK) < 0) ||
+	    (fsetflags("wake pipe", w->wake_fd[1], O_NONBLOCK) < 0))
+		goto err_out;
+
+	event_set(&w->wake_ev, w->wake_fd[0], EV_READ | EV_PERSIST,
+		  target_wake_evt, w);
+	event_base_set(w->base, &w->wake_ev);
+	if (event_add(&w->wake_ev, NULL) < 0)
+		goto err_out;
+
+	pthread_mutex_init(&w->io_lock, NULL);
+	INIT_LIST_HEAD(&w->io_done);
+
+	w->io_fd = eventfd(0, EFD_NONBLOCK);
+	if (w->io_fd < 0) {
+		iscsi_trace_error(__FILE__, __LINE__, "eventfd: %s\n",
+				  strerror(errno));
+		goto err_out_wake;
+	}
+
+	event_set(&w->io_ev, w->io_fd, EV_READ | EV_PERSIST,
+		  target_io_evt, w);
+	event_base_set(w->base, &w->io_ev);
+	if (event_add(&w->io_ev, NULL) < 0)
+		goto err_out_io;
+
+	if (gp->net_uring && (net_ring_init(w) < 0))
+		goto err_out_io_ev;
+
+	return 0;
+
+err_out_io_ev:
+	event_del(&w->io_ev);
+err_out_io:
+	close(w->io_fd);
+err_out_wake:
+	event_del(&w->wake_ev);
+err_out:
+	close(w->wake_fd[0]);
+	close(w->wake_fd[1]);
+	return -1;
+}
+
+void target_worker_wake(struct target_worker *w)
+{
+	char c = 0;
+
+	/* a full pipe already has a wakeup pending */
+	if (write(w->wake_fd[1], &c, 1) < 0 && errno != EAGAIN)
+		iscsi_trace_error(__FILE__, __LINE__, "worker %u: wake: %s\n",
+				  w->id, strerror(errno));
+}
+
+/* the end of an event loop iteration: submit the work it queued */
+void target_worker_flush(struct target_worker *w)
+{
+	int rc;
+
+	if (w->net && uring_queued(&w->net->ring)) {
+		rc = uring_submit(&w->net->ring, 0);
+		if (rc < 0)
+			iscsi_trace_error(__FILE__, __LINE__,
+					  "io_uring_enter failed: %s\n",
+					  strerror(-rc));
+	}
+
+	device_flush(w);
+}
+
+void target_worker_exit(struct target_worker *w)
+{
+	net_ring_exit(w);
+
+	event_del(&w->io_ev);
+	close(w->io_fd);
+	pthread_mutex_destroy(&w->io_lock);
+
+	event_del(&w->wake_ev);
+	close(w->wake_fd[0]);
+	close(w->wake_fd[1]);
+}
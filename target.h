@@ -44,6 +44,7 @@
 #define _TARGET_H_
 
 #include <stdbool.h>
+#include <pthread.h>
 #include <glib.h>
 #include <event.h>
 
@@ -57,7 +58,22 @@ enum {
 };
 
 enum {
-	TARGET_MAX_IOV		= 1024,
+	TARGET_MAX_QUEUE_DEPTH	= 1024,		/* tasks per session */
+	TARGET_TASK_HASH	= 64,		/* task table buckets */
+	TARGET_MAX_R2T		= 16,		/* R2Ts outstanding per task */
+	TARGET_MAX_CONNS	= 8,		/* connections per session */
+	TARGET_MAX_WORKERS	= 64,		/* event loop threads */
+	TARGET_MAX_IO_THREADS	= 64,		/* storage threads */
+	TARGET_ABORT_TAGS	= 8,		/* aborts posted per connection */
+	TARGET_RX_SIZE		= 64 * 1024,	/* per-session receive buffer */
+	TARGET_RX_BYPASS	= 16 * 1024,	/* larger reads skip the buffer */
+	TARGET_MAX_LUNS		= 32,		/* LUNs per target */
+	TARGET_MIN_WINDOW	= 4,		/* CmdSN window under load */
+	TARGET_LAT_SLACK	= 100 * 1000,	/* ns of queueing tolerated */
+	TARGET_LAT_EPOCH_MS	= 5000,		/* latency baseline epoch */
+	TARGET_IDLE_MS		= 1000,		/* idle before a full window */
+	TARGET_HOLD_MS		= 20 * 1000,	/* longest a connection is held */
+	TARGET_HOLD_POLL_MS	= 100,		/* hangup checks while held */
 };
 
 /* a device can be made up of an extent or another device */
@@ -100,6 +116,27 @@ enum {
 	TARGET_READONLY	= 0x01
 };
 
+/* backing store of a logical unit */
+enum {
+	LUN_RAM,		/* heap memory */
+	LUN_MAP,		/* memory mapped file */
+	LUN_DIRECT,		/* O_DIRECT file, through io_uring */
+};
+
+struct dev_lun;
+
+/* this struct describes a logical unit of a target */
+struct disc_lun {
+	uint32_t	lun;	/* logical unit number */
+	int		backend;	/* LUN_RAM, LUN_MAP or LUN_DIRECT */
+	char		*path;	/* backing file or device; NULL for RAM */
+	uint64_t	size;	/* size in bytes, for RAM */
+	uint32_t	block_size;	/* 512 or 4096; 0 for the default */
+	struct dev_lun	*dev;	/* device state, once initialized */
+};
+
+DEFINE_ARRAY(lunv_t, struct disc_lun);
+
 /* this struct describes an iscsi target's associated features */
 struct disc_target {
 	char		*target;	/* target name */
@@ -109,6 +146,7 @@ struct disc_target {
 	uint32_t	flags;	/* any flags */
 	uint16_t	tsih;	/* target session identifying handle */
 	char		*iqn;	/* assigned iqn - can be NULL */
+	lunv_t		luns;	/* its logical units */
 };
 
 DEFINE_ARRAY(targv_t, struct disc_target);
@@ -120,12 +158,14 @@ DEFINE_ARRAY(targv_t, struct disc_target);
 #define DEFAULT_TARGET_BLOCK_LEN	512
 #define DEFAULT_TARGET_NUM_BLOCKS	204800
 #define DEFAULT_TARGET_NAME		"iqn.1994-04.org.netbsd.iscsi-target"
-#define DEFAULT_TARGET_QUEUE_DEPTH	8
+#define DEFAULT_TARGET_QUEUE_DEPTH	32
+#define DEFAULT_TARGET_TX_HIGH		(16 * 1024 * 1024)
 #define DEFAULT_TARGET_TCQ		0
 
 enum {
 	MAX_TGT_NAME_SIZE	= 512,
 	MAX_INITIATOR_ADDRESS_SIZE	= 256,
+	MAX_INITIATOR_NAME_SIZE	= 224,
 	MAX_CONFIG_FILE_NAME	= 512,
 
 	ISCSI_IPv4		= AF_INET,
@@ -142,12 +182,44 @@ struct globals {
 	targv_t	 *tv;	/* array of target devices */
 	int		address_family;	/* global default IP address family */
 	uint32_t	last_tsih;	/* the last TSIH that was used */
-	struct list_head sockets;
 	char		host[128];
+	unsigned int	zerocopy_min;	/* MSG_ZEROCOPY threshold; 0 = off */
+	unsigned int	queue_depth;	/* tasks per session */
+	unsigned int	n_workers;	/* event loop threads */
+	struct target_worker *workers;
+	unsigned int	n_io_threads;	/* storage threads; 0 = inline */
+	bool		net_uring;	/* session sockets on io_uring */
+	size_t		tx_high;	/* stop reading above this backlog */
+	size_t		tx_low;		/* ... until it is back below this */
+};
+
+/*
+ * An event loop thread.  Each listens on its own SO_REUSEPORT sockets,
+ * and the sessions it accepts stay with it.
+ */
+struct target_worker {
+	unsigned int		id;
+	pthread_t		thread;
+	struct event_base	*base;
+	struct list_head	sockets;	/* listening sockets */
+	bool			stop;
+
+	int			wake_fd[2];	/* pipe, to interrupt the loop */
+	struct event		wake_ev;
+
+	/* device work finished by the storage threads */
+	int			io_fd;		/* eventfd */
+	struct event		io_ev;
+	pthread_mutex_t		io_lock;
+	struct list_head	io_done;
+
+	void			*dev;		/* device state, e.g. an io_uring */
+	struct net_ring		*net;		/* io_uring transport, if any */
 };
 
 struct server_socket {
 	int			fd;
+	struct target_worker	*worker;
 	struct event		ev;
 	struct sockaddr		addr;
 	socklen_t		addrlen;
@@ -166,20 +238,125 @@ struct target_pdu {
 	uint8_t		*data;
 	unsigned int	data_len;
 	unsigned int	data_pad_recv;
+	bool		data_direct;	/* data points into backing store */
+	bool		data_in_rx;	/* data points into receive buffer */
 
 	unsigned int	pad_len;
+	uint8_t		pad[4];		/* padding of a direct data segment */
+};
+
+/*
+ * Receive buffer.  Each read pulls in as much as the socket has, and
+ * complete PDUs are parsed out of it; only data segments too large to
+ * have arrived whole are read separately.
+ */
+struct target_rx {
+	uint8_t		*buf;
+	unsigned int	head;		/* next byte to parse */
+	unsigned int	tail;		/* end of received bytes */
+	bool		drained;	/* socket read dry, this event */
+	int		bid;		/* io_uring buffer in buf, or -1 */
+
+	/* various statistics */
+	uint64_t	reads;		/* read syscalls */
+	uint64_t	bytes;
+	uint64_t	pdus;
+};
+
+/* a Data-Out sequence: the unsolicited burst, or the answer to an R2T */
+struct xfer_seq {
+	uint32_t	ttt;		/* Target Transfer Tag */
+	uint32_t	offset;
+	uint32_t	length;
+	uint32_t	recv;		/* bytes received so far */
+	bool		active;
 };
 
 struct session_xfer {
-	unsigned int	desired_len;
-	struct iscsi_r2t r2t;
-	unsigned int	r2t_flag;
 	unsigned int	bytes_recv;
 	unsigned int	trans_len;
+	uint32_t	r2t_next;	/* first offset not yet solicited */
+	uint32_t	R2TSN;
+	unsigned int	n_r2t;		/* R2Ts outstanding */
+	struct xfer_seq	unsol;
+	struct xfer_seq	r2t[TARGET_MAX_R2T];
 	int		tag;
 	uint8_t		status;
 };
 
+struct target_task;
+
+struct target_cmd {
+	struct iscsi_scsi_cmd_args *scsi_cmd;
+	struct target_task *task;
+	bool		send_ref;	/* send_data is in the backing store */
+	bool		send_file;	/* ... and may be sent from send_fd */
+	int		send_fd;
+	uint64_t	send_off;	/* file offset of send_data */
+};
+
+typedef void (*target_io_fn)(struct target_cmd *);
+
+/*
+ * Device work handed to a storage thread, or started by the device on
+ * its own, e.g. on an io_uring.  When it is done, the worker owning the
+ * session completes the command and sends its response.
+ */
+struct target_io {
+	struct list_head	node;		/* pool queue, or done list */
+	struct target_session	*sess;
+	struct target_cmd	cmd;
+	target_io_fn		fn;
+	target_io_fn		release;	/* called as the task is freed */
+	bool			busy;		/* not yet completed */
+	bool			aborted;	/* task freed meanwhile */
+	uint64_t		start;		/* ns, CLOCK_MONOTONIC */
+	uint8_t			sense[32];
+
+	/* device buffer, e.g. an io_uring registered buffer */
+	void			*buf;
+	int			buf_index;
+	uint32_t		buf_len;
+
+	/* device range, e.g. of a flush */
+	uint64_t		off;
+	uint64_t		len;
+
+	/* parked by target_mem_claim() until queued READs let go of it */
+	bool			parked;
+	const uint8_t		*claim_lo, *claim_hi;
+	struct list_head	claim_node;
+};
+
+/* a received data segment, parked until device_commit() */
+struct target_seg {
+	void		*base;		/* NULL if received in place */
+	uint32_t	off;		/* offset within the transfer */
+	uint32_t	len;
+};
+
+/*
+ * A SCSI command in progress.  Most complete as soon as they are
+ * received; WRITEs stay in the session's task table, keyed by Initiator
+ * Task Tag, until all of their data has arrived.
+ */
+struct target_task {
+	struct iscsi_scsi_cmd_args scsi_cmd;
+	uint8_t			cdb[16];	/* scsi_cmd.cdb points here */
+	struct session_xfer	xfer;
+	uint32_t		DataSN;
+	bool			want_data_pdu;
+	bool			held;		/* counted in n_tasks */
+
+	struct target_seg	*parked;	/* parked data segments */
+	uint32_t		n_parked;
+	uint32_t		parked_size;
+
+	struct target_io	io;
+
+	struct list_head	node;		/* hash chain, or free list */
+};
+
 enum session_read_state {
 	srs_err,
 	srs_bhs,
@@ -188,14 +365,89 @@ enum session_read_state {
 	srs_exec_pdu,
 };
 
-/* session parameters */
+/*
+ * An iSCSI session.  Its connections (struct target_session, below)
+ * share the CmdSN window, while each task stays on the connection its
+ * command arrived on.
+ */
+struct target_nexus {
+	pthread_mutex_t		lock;		/* CmdSN window */
+	char			initiator[MAX_INITIATOR_NAME_SIZE];
+	uint64_t		isid;
+	int			tsih;
+	int			d;
+	uint32_t		ExpCmdSN;
+	uint32_t		MaxCmdSN;
+	uint32_t		cmdsn_seen[TARGET_MAX_QUEUE_DEPTH / 32];
+	struct list_head	cmdsn_waiters;	/* conns holding a command */
+	struct list_head	tmf_waiters;	/* conns holding a TMF response */
+	uint32_t		tmf_seq;
+	unsigned int		n_tasks;	/* tasks held, all connections */
+	uint32_t		next_ttt;	/* Target Transfer Tags */
+
+	/* CmdSN window sizing, from storage latency */
+	unsigned int		window;
+	unsigned int		window_min;
+	uint64_t		lat_avg;	/* ns, moving average */
+	uint64_t		lat_min;	/* ns, the uncongested baseline */
+	uint64_t		lat_min_next;	/* ns, least this epoch */
+	uint64_t		lat_epoch;	/* start of this epoch */
+	uint64_t		lat_last;	/* time of the last sample */
+	uint64_t		window_cuts;
+
+	/* changed only with the session list locked for writing */
+	struct list_head	conns;
+	unsigned int		n_conns;
+	unsigned int		max_conns;	/* MaxConnections */
+	struct list_head	nexus_node;
+};
+
+/* an abort posted to a connection by another; see sess_task_abort() */
+struct target_abort {
+	bool			all;
+	uint32_t		tag;
+	uint32_t		tmf_seq;	/* its TMF, on the nexus */
+};
+
+/* connection parameters */
 struct target_session {
 	int			id;
 	int			d;
 	uint16_t		cid;
 	uint32_t		StatSN;
-	uint32_t		ExpCmdSN;
-	uint32_t		MaxCmdSN;
+	struct target_nexus	*nexus;
+	struct list_head	conns_node;
+
+	/* a command ahead of ExpCmdSN, unexecuted; see sess_cmdsn_hold() */
+	bool			cmdsn_held;
+	uint32_t		cmdsn_wait;
+	struct list_head	cmdsn_node;	/* on nexus->cmdsn_waiters */
+	uint64_t		cmdsn_holds;
+
+	pthread_mutex_t		lock;		/* held by event handlers */
+	struct target_worker	*worker;
+
+	/* READ data queued by reference, see target_mem_claim() */
+	struct list_head	refs;
+	bool			refs_claimed;	/* WRITEs wait on some */
+	uint64_t		claim_parks;	/* WRITEs that waited */
+
+	/* aborts posted by other connections of the session */
+	struct target_abort	aborts[TARGET_ABORT_TAGS];
+	unsigned int		n_aborts;
+
+	/* a TMF response awaiting those aborts; see sess_task_abort() */
+	bool			tmf_held;
+	uint8_t			tmf_response;
+	uint32_t		tmf_tag;
+	uint32_t		tmf_seq;
+	unsigned int		tmf_waits;	/* aborts not yet confirmed */
+	struct list_head	tmf_node;	/* on nexus->tmf_waiters */
+
+	/* either hold; see sess_hold_watch() */
+	struct event		hold_ev;
+	uint64_t		hold_start;
+
 	int			UsePhaseCollapsedRead;
 	int			IsFullFeature;
 	int			IsLoggedIn;
@@ -210,51 +462,99 @@ struct target_session {
 	enum session_read_state	readst;
 
 	struct target_pdu	pdu;
-
-	struct iscsi_scsi_cmd_args scsi_cmd;
-	uint32_t		DataSN;
-	bool			want_data_pdu;
-	unsigned int		n_iov;
-
+	struct target_rx	rx;
+	bool			rx_paused;	/* transmit backlog too high */
+	uint64_t		rx_pauses;
+	struct seg_pool		segs;		/* received segment buffers */
+
+	struct target_task	*tasks;		/* task table */
+	unsigned int		n_tasks;	/* tasks held */
+	unsigned int		n_tasks_max;
+	uint64_t		task_set_full;	/* commands refused */
+
+	unsigned int		n_io;		/* device work yet to complete */
+	unsigned int		n_dev_io;	/* ... of it with the device */
+	bool			ended;		/* freed with its last n_io */
+	uint64_t		io_queued;
+	struct list_head	task_free;
+	struct list_head	task_hash[TARGET_TASK_HASH];
+
+	struct net_conn		*conn;		/* io_uring transport, if any */
 	int			fd;
 	struct sockaddr		addr;
 	struct event		ev;
 	struct event		write_ev;
+	struct event		zc_ev;		/* see sess_refs_copy() */
+	atcp_ev_func		write_cb;
+	void			*write_cb_data;
 
 	struct atcp_wr_state	wst;
 
-	struct session_xfer	xfer;
-
 	struct list_head	sessions_node;
 
-	struct iovec		iov[TARGET_MAX_IOV];
 	char			initiator[MAX_INITIATOR_ADDRESS_SIZE];
 	char			addr_host[128];
 	uint8_t			outbuf[512];
 };
 
-struct target_cmd {
-	struct iscsi_scsi_cmd_args *scsi_cmd;
-};
-
 extern int target_init(struct globals *, targv_t *, char *);
 extern int target_shutdown(struct globals *, bool);
 extern int target_accept(struct globals *gp, struct server_socket *sock);
+extern int target_worker_init(struct globals *gp, struct target_worker *w);
+extern void target_worker_flush(struct target_worker *w);
+extern void target_worker_wake(struct target_worker *w);
+extern void target_worker_exit(struct target_worker *w);
 extern int target_sess_cleanup(struct target_session *sess);
+extern void target_stats(FILE *f);
+extern bool target_mem_busy(const void *buf, size_t len);
+extern int target_mem_claim(struct target_session *sess,
+			    struct target_cmd *tc, const void *buf,
+			    size_t len, target_io_fn resume);
 extern int target_transfer_data(struct target_session *,
-				struct iscsi_scsi_cmd_args *);
+				struct target_cmd *);
+extern int target_io_submit(struct target_session *sess,
+			    struct target_cmd *tc, target_io_fn fn);
+extern void target_io_begin(struct target_session *sess,
+			    struct target_cmd *tc, target_io_fn release);
+extern void target_io_end(struct target_io *io);
 
 /*
  * Interface from target to device:
  *
  * device_init() initializes the device
  * device_command() sends a SCSI command to one of the logical units in the device.
+ * device_recv_direct() locates where WRITE data may be received in place.
+ * device_flush() submits the device work queued by an event loop.
+ * device_io_wait() waits for some of an event loop's device work.
  * device_shutdown() shuts down the device.
  */
 
 extern int device_init(struct globals *, targv_t *, struct disc_target *);
 extern int device_command(struct target_session *, struct target_cmd *);
 extern int device_commit(struct target_session *, struct target_cmd *);
+extern void *device_recv_direct(struct target_session *, uint64_t,
+				const uint8_t *, uint32_t, uint32_t);
+extern void device_flush(struct target_worker *);
+extern void device_io_wait(struct target_worker *);
 extern int device_shutdown(struct target_session *, bool);
 
+/*
+ * Configuration file, describing targets and their logical units:
+ *
+ *	target iqn.2010-04.us.yyz.bd.itd:disks 10.0.0.0/8
+ *		lun 0 ram 100m
+ *		lun 1 file /srv/itd/disk1.img
+ *		lun 2 direct /dev/sdb 4096
+ *
+ * The netmask, limiting discovery, defaults to 0/0.  "file" LUNs are
+ * memory mapped; "direct" ones are accessed with O_DIRECT, through
+ * io_uring.  A LUN's logical block size, 512 or 4096 bytes, may follow
+ * its backing store.  Anything from a '#' to the end of a line is
+ * ignored.
+ */
+
+extern int config_read(const char *fn, targv_t *tv);
+extern void config_free(targv_t *tv);
+extern int config_parse_size(const char *s, uint64_t *bytes);
+
 #endif /* _TARGET_H_ */
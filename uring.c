@@ -0,0 +1,183 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+int uring_register(struct uring *r, unsigned int opcode,
+		   const void *arg, unsigned int nr_args)
+{
+	if (syscall(__NR_io_uring_register, r->fd, opcode, arg, nr_args) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int uring_init(struct uring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+	int rc;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+
+	r->fd = sys_io_uring_setup(entries, &p);
+	if (r->fd < 0)
+		return -errno;
+
+	r->entries = p.sq_entries;
+	r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_sz = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err_out;
+	r->sq_ring = sq;
+
+	cq = mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+		goto err_out_sq;
+	r->cq_ring = cq;
+
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto err_out_cq;
+
+	r->sq_head = sq + p.sq_off.head;
+	r->sq_tail = sq + p.sq_off.tail;
+	r->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = sq + p.sq_off.array;
+
+	r->cq_head = cq + p.cq_off.head;
+	r->cq_tail = cq + p.cq_off.tail;
+	r->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = cq + p.cq_off.cqes;
+
+	r->sqe_head = r->sqe_tail = *r->sq_tail;
+
+	return 0;
+
+err_out_cq:
+	munmap(r->cq_ring, r->cq_ring_sz);
+err_out_sq:
+	munmap(r->sq_ring, r->sq_ring_sz);
+err_out:
+	rc = -errno;
+	close(r->fd);
+	r->fd = -1;
+	return rc;
+}
+
+void uring_exit(struct uring *r)
+{
+	if (r->fd < 0)
+		return;
+
+	munmap(r->sqes, r->sqes_sz);
+	munmap(r->cq_ring, r->cq_ring_sz);
+	munmap(r->sq_ring, r->sq_ring_sz);
+	close(r->fd);
+	r->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+	    r->entries) {
+		uring_submit(r, 0);
+		if (r->sqe_tail - __atomic_load_n(r->sq_head,
+						  __ATOMIC_ACQUIRE) >=
+		    r->entries)
+			return NULL;
+	}
+
+	idx = r->sqe_tail++ & r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+
+	return sqe;
+}
+
+int uring_submit(struct uring *r, unsigned int wait_nr)
+{
+	unsigned int to_submit = uring_queued(r);
+	int rc;
+
+	if (!to_submit && !wait_nr)
+		return 0;
+
+	/* publish the SQEs filled in since the last submission */
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+	do {
+		rc = sys_io_uring_enter(r->fd, to_submit, wait_nr,
+					wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+		return -errno;
+
+	r->submits++;
+	r->sqes_submitted += rc;
+	r->sqe_head += rc;
+
+	return rc;
+}
+
+unsigned int uring_reap(struct uring *r, uring_cqe_func fn, void *data)
+{
+	unsigned int head, tail, n = 0;
+	struct io_uring_cqe *cqe;
+
+	head = *r->cq_head;
+	tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		cqe = &r->cqes[head & r->cq_mask];
+		fn(data, cqe->user_data, cqe->res, cqe->flags);
+		head++;
+		n++;
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
@@ -0,0 +1,86 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring, driven from a single thread.  SQEs are filled in
+ * as work arrives and handed to the kernel in one io_uring_enter(2) by
+ * uring_submit(); completions are handed back by uring_reap().
+ */
+struct uring {
+	int			fd;
+	unsigned int		entries;
+
+	/* submission queue */
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		sq_mask;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+	unsigned int		sqe_tail;	/* next SQE to fill */
+	unsigned int		sqe_head;	/* first SQE not yet submitted */
+
+	/* completion queue */
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring;
+	size_t			sq_ring_sz;
+	void			*cq_ring;
+	size_t			cq_ring_sz;
+	size_t			sqes_sz;
+
+	/* various statistics */
+	uint64_t		submits;	/* io_uring_enter calls */
+	uint64_t		sqes_submitted;
+};
+
+typedef void (*uring_cqe_func)(void *, uint64_t user_data, int res,
+			       uint32_t flags);
+
+/* setup and teardown */
+extern int uring_init(struct uring *r, unsigned int entries);
+extern void uring_exit(struct uring *r);
+
+/* io_uring_register(2): buffers, files, eventfd */
+extern int uring_register(struct uring *r, unsigned int opcode,
+			  const void *arg, unsigned int nr_args);
+
+/* a zeroed SQE, submitting queued ones first if the ring is full */
+extern struct io_uring_sqe *uring_get_sqe(struct uring *r);
+
+/* submit queued SQEs, waiting for at least wait_nr completions */
+extern int uring_submit(struct uring *r, unsigned int wait_nr);
+
+/* call fn for each completion; returns the number reaped */
+extern unsigned int uring_reap(struct uring *r, uring_cqe_func fn,
+			       void *data);
+
+/* SQEs filled in, but not yet submitted */
+static inline unsigned int uring_queued(const struct uring *r)
+{
+	return r->sqe_tail - r->sqe_head;
+}
+
+#endif /* __URING_H__ */
@@ -221,6 +221,8 @@ void set_debug(const char *level)
 		iscsi_debug_level |= TRACE_SCSI_ALL;
 	} else if (strcmp(level, "osd") == 0) {
 		iscsi_debug_level |= TRACE_OSD;
+	} else if (strcmp(level, "mem") == 0) {
+		iscsi_debug_level |= TRACE_MEM;
 	} else if (strcmp(level, "all") == 0) {
 		iscsi_debug_level |= TRACE_ALL;
 	}
@@ -289,41 +291,130 @@ void iscsi_print_buffer(uint8_t * buf, const size_t len)
 	}
 }
 
-static GTrashStack *free_headers;
+/*
+ * PDU headers live in the inline buffer of the write descriptor that
+ * sends them, so each session draws them from its own descriptor ring.
+ */
+void *header_get(struct atcp_wr_state *wst)
+{
+	return atcp_wbuf_get(wst);
+}
+
+void header_put(struct atcp_wr_state *wst, void *mem)
+{
+	atcp_wbuf_put(wst, mem);
+}
 
-void *header_get(void)
+/* prepended to each segment buffer; 16 bytes keeps the payload aligned */
+struct seg_hdr {
+	struct seg_hdr	*next;		/* free stack link */
+	uint32_t	cl;		/* size class, or SEG_CLASSES */
+	uint32_t	pad;
+};
+
+static unsigned int seg_class(size_t size)
 {
-	void *mem;
+	unsigned int cl;
 
-	mem = g_trash_stack_pop(&free_headers);
-	if (mem)
-		return mem;
+	for (cl = 0; cl < SEG_CLASSES; cl++)
+		if (size <= ((size_t)1 << (cl + SEG_MIN_SHIFT)))
+			break;
 
-	return malloc(ISCSI_HEADER_LEN);
+	return cl;
 }
 
-void header_put(void *mem)
+static unsigned int seg_cache_depth(unsigned int cl)
 {
-	g_trash_stack_push(&free_headers, mem);
+	return MAX(SEG_CACHE_MIN, SEG_CACHE_BYTES >> (cl + SEG_MIN_SHIFT));
 }
 
-bool hdr_cb_free(struct atcp_wr_state *wst, void *cb_data, bool done)
+static void seg_free_class(struct seg_pool *pool, unsigned int cl)
 {
-	header_put(cb_data);
-	return false;
+	struct seg_hdr *hdr;
+
+	while ((hdr = pool->free[cl]) != NULL) {
+		pool->free[cl] = hdr->next;
+		free(hdr);
+	}
+	pool->n_free[cl] = 0;
 }
 
-void hdrs_free_all(void)
+void seg_pool_init(struct seg_pool *pool, size_t max_seg)
 {
-	while (1) {
-		void *mem;
+	memset(pool, 0, sizeof(*pool));
+	seg_pool_set_max(pool, max_seg);
+}
 
-		mem = g_trash_stack_pop(&free_headers);
-		if (!mem)
-			break;
+/* re-key the cache on a (re)negotiated MaxRecvDataSegmentLength */
+void seg_pool_set_max(struct seg_pool *pool, size_t max_seg)
+{
+	unsigned int cl;
+
+	/* data segments are received along with their padding */
+	pool->max_class = seg_class(max_seg + 3);
+	if (pool->max_class >= SEG_CLASSES)
+		pool->max_class = SEG_CLASSES - 1;
+
+	for (cl = pool->max_class + 1; cl < SEG_CLASSES; cl++)
+		seg_free_class(pool, cl);
+}
+
+void seg_pool_exit(struct seg_pool *pool)
+{
+	unsigned int cl;
+
+	for (cl = 0; cl < SEG_CLASSES; cl++)
+		seg_free_class(pool, cl);
+}
+
+void *seg_get(struct seg_pool *pool, size_t size)
+{
+	struct seg_hdr *hdr;
+	unsigned int cl = seg_class(size);
+
+	if (cl <= pool->max_class && pool->free[cl]) {
+		hdr = pool->free[cl];
+		pool->free[cl] = hdr->next;
+		pool->n_free[cl]--;
+		pool->hits++;
+	} else {
+		if (cl < SEG_CLASSES)
+			size = (size_t)1 << (cl + SEG_MIN_SHIFT);
+
+		hdr = malloc(sizeof(*hdr) + size);
+		if (!hdr)
+			return NULL;
+
+		hdr->cl = cl;
+		pool->misses++;
+	}
+
+	if (++pool->in_use > pool->in_use_max)
+		pool->in_use_max = pool->in_use;
+
+	return hdr + 1;
+}
+
+void seg_put(struct seg_pool *pool, void *mem)
+{
+	struct seg_hdr *hdr;
+	unsigned int cl;
+
+	if (!mem)
+		return;
 
-		free(mem);
+	hdr = ((struct seg_hdr *) mem) - 1;
+	cl = hdr->cl;
+	pool->in_use--;
+
+	if (cl > pool->max_class || pool->n_free[cl] >= seg_cache_depth(cl)) {
+		free(hdr);
+		return;
 	}
+
+	hdr->next = pool->free[cl];
+	pool->free[cl] = hdr;
+	pool->n_free[cl]++;
 }
 
 void send_padding(struct atcp_wr_state *st, unsigned int len_out)
@@ -348,17 +439,25 @@ void send_padding(struct atcp_wr_state *st, unsigned int len_out)
  * data, else send as two separate messages.
  */
 
-int iscsi_writev(struct atcp_wr_state *st,
-		 void *header, unsigned header_len,
-		 const void *data, unsigned data_len)
+static int __iscsi_writev(struct atcp_wr_state *st,
+			  void *header, unsigned header_len,
+			  const void *data, unsigned data_len, bool by_ref,
+			  atcp_write_func cb, void *cb_data)
 {
 	iscsi_trace(TRACE_NET_BUFF, __FILE__, __LINE__,
-		    "NET: writing %u header bytes, %u data bytes\n",
-		    header_len, data_len);
+		    "NET: writing %u header bytes, %u data bytes%s\n",
+		    header_len, data_len, by_ref ? " by reference" : "");
 
-	atcp_writeq(st, header, header_len, hdr_cb_free, header);
+	atcp_writeq_wbuf(st, header, header_len);
 
-	if (data && data_len > 0) {
+	if (data && data_len > 0 && by_ref) {
+		if (atcp_writeq(st, data, data_len, cb, cb_data) < 0) {
+			if (cb)
+				cb(st, cb_data, false);
+			shutdown(st->fd, SHUT_RDWR);
+			return -1;
+		}
+	} else if (data && data_len > 0) {
 		void *mem;
 
 		mem = g_memdup(data, data_len);
@@ -375,6 +474,62 @@ int iscsi_writev(struct atcp_wr_state *st,
 	return header_len + data_len;
 }
 
+int iscsi_writev(struct atcp_wr_state *st,
+		 void *header, unsigned header_len,
+		 const void *data, unsigned data_len)
+{
+	return __iscsi_writev(st, header, header_len, data, data_len, false,
+			      NULL, NULL);
+}
+
+/*
+ * Queue data to be sent straight from a file's page cache.  A range that
+ * cannot be queued, or that sendfile() later fails to send in full, is
+ * fatal to the connection: the header is already committed to the stream.
+ * cb runs once the range is no longer sent from the file, as with
+ * iscsi_writev_ref().
+ */
+int iscsi_writev_file(struct atcp_wr_state *st,
+		      void *header, unsigned header_len,
+		      int fd, off_t off, unsigned data_len,
+		      atcp_write_func cb, void *cb_data)
+{
+	iscsi_trace(TRACE_NET_BUFF, __FILE__, __LINE__,
+		    "NET: writing %u header bytes, %u data bytes from file\n",
+		    header_len, data_len);
+
+	atcp_writeq_wbuf(st, header, header_len);
+
+	if (data_len > 0 && atcp_writeq_file(st, fd, off, data_len,
+					     cb, cb_data) < 0) {
+		if (cb)
+			cb(st, cb_data, false);
+		shutdown(st->fd, SHUT_RDWR);
+		return -1;
+	}
+
+	send_padding(st, data_len);
+
+	atcp_write_start(st);
+
+	return header_len + data_len;
+}
+
+/*
+ * Queue data without copying it.  The caller must keep the data valid
+ * until cb runs: once the data is sent, or given a private copy by
+ * atcp_write_remap().  Data that cannot be queued is fatal to the
+ * connection, as for iscsi_writev_file().
+ */
+int iscsi_writev_ref(struct atcp_wr_state *st,
+		     void *header, unsigned header_len,
+		     const void *data, unsigned data_len,
+		     atcp_write_func cb, void *cb_data)
+{
+	return __iscsi_writev(st, header, header_len, data, data_len, true,
+			      cb, cb_data);
+}
+
 /*
  * Misc. Functions
  */